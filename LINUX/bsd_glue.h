@@ -199,6 +199,10 @@ struct thread;
  */
 #define MBUF_TXQ(m)		skb_get_queue_mapping(m)
 #define MBUF_RXQ(m)		(skb_rx_queue_recorded(m) ? skb_get_rx_queue(m) : 0)
+#ifdef NETMAP_LINUX_HAVE_SKB_XMIT_MORE
+/* the stack is going to send more packets right after this one */
+#define MBUF_XMIT_MORE(m)	((m)->xmit_more)
+#endif /* NETMAP_LINUX_HAVE_SKB_XMIT_MORE */
 #define SET_MBUF_DESTRUCTOR(m, f) m->destructor = (void *)f
 
 /* Magic number for sk_buff.priority field, used to take decisions in
@@ -219,6 +223,7 @@ struct thread;
 #define m_copydata(m, o, l, b)          skb_copy_bits(m, o, b, l)
 
 #define copyin(_from, _to, _len)	copy_from_user(_to, _from, _len)
+#define copyout(_from, _to, _len)	copy_to_user(_to, _from, _len)
 
 /*
  * struct ifnet is remapped into struct net_device on linux.
@@ -256,6 +261,7 @@ int linux_netmap_set_channels(struct net_device *, struct ethtool_channels *);
 
 #define refcount_acquire(_a)    atomic_add(1, (atomic_t *)_a)
 #define refcount_release(_a)    atomic_dec_and_test((atomic_t *)_a)
+#define atomic_add_long(_p, _v)	atomic_long_add((_v), (atomic_long_t *)(_p))
 
 
 /*
@@ -336,6 +342,16 @@ static inline int ilog2(uint64_t n)
 	if (p_ != NULL) 					\
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
+
+/* same, preferring the memory of NUMA node 'node' */
+#define contigmalloc_node(sz, ty, flags, node, a, b, pgsz, c) ({	\
+	unsigned int order_ =					\
+		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
+	struct page *p_ = alloc_pages_node((node),		\
+		GFP_ATOMIC | __GFP_ZERO, order_);		\
+	if (p_ != NULL) 					\
+		split_page(p_, order_);				\
+	(p_ != NULL ? (char*)page_address(p_) : NULL); })
 	
 #define contigfree(va, sz, ty)					\
 	do {							\
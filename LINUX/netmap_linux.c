@@ -72,6 +72,12 @@ nm_os_put_module(void)
 	module_put(THIS_MODULE);
 }
 
+uint64_t
+nm_os_get_nsec(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
 /* Register for a notification on device removal */
 static int
 linux_netmap_notifier_cb(struct notifier_block *b,
@@ -1748,7 +1754,7 @@ int netmap_bns_id;
 
 struct netmap_bns {
 	struct net *net;
-	struct nm_bridge *bridges;
+	struct nm_bridge **bridges;
 	u_int num_bridges;
 };
 
@@ -1799,7 +1805,7 @@ netmap_bns_put(struct net *net_ns)
 }
 
 void
-netmap_bns_getbridges(struct nm_bridge **b, u_int *n)
+netmap_bns_getbridges(struct nm_bridge ***b, u_int *n)
 {
 	struct net *net_ns = current->nsproxy->net_ns;
 	struct netmap_bns *ns = net_generic(net_ns, netmap_bns_id);
@@ -1819,8 +1825,7 @@ netmap_pernet_init(struct net *net)
 		return error;
 
 	ns->net = net;
-	ns->num_bridges = 8;
-	ns->bridges = netmap_init_bridges2(ns->num_bridges);
+	ns->bridges = netmap_init_bridges2(&ns->num_bridges);
 	if (ns->bridges == NULL) {
 		nm_bns_destroy(net, ns);
 		return -ENOMEM;
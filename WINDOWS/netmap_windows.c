@@ -946,3 +946,10 @@ nm_os_put_module(void)
 {
 	// TODO
 }
+
+uint64_t
+nm_os_get_nsec(void)
+{
+	/* interrupt time is in 100ns units */
+	return KeQueryInterruptTime() * 100;
+}
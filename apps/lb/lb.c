@@ -23,6 +23,7 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE	// for CPU_SET() etc
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -37,8 +38,20 @@
 #include <netinet/in.h>		/* htonl */
 
 #include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h> /* pthread w/ affinity */
+#include <sys/cpuset.h> /* cpu_set */
+#endif /* __FreeBSD__ */
+
+#ifdef linux
+#define cpuset_t        cpu_set_t
+#endif
+
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "pkt_hash.h"
+#include "maglev.h"
 #include "ctrs.h"
 
 
@@ -85,6 +98,8 @@ struct compact_ipv6_hdr {
 #define DEF_BATCH	2048
 #define DEF_SYSLOG_INT	600
 #define BUF_REVOKE	100
+#define MAX_DISPATCHERS	64
+#define HASH_BATCH	32	/* packets prefetched and hashed together */
 
 struct {
 	char ifname[MAX_IFNAMELEN];
@@ -92,6 +107,11 @@ struct {
 	uint32_t extra_bufs;
 	uint16_t batch;
 	int syslog_interval;
+	uint16_t dispatchers;	/* number of rx threads */
+	int first_core;		/* -1 means no pinning */
+	int maglev;		/* use consistent hashing */
+	uint32_t *weights;	/* per pipe, only changed by the control thread */
+	char *ctl_path;		/* control socket */
 } glob_arg;
 
 /*
@@ -137,10 +157,6 @@ oq_deq(struct overflow_queue *q)
 
 static volatile int do_abort = 0;
 
-uint64_t dropped = 0;
-uint64_t forwarded = 0;
-uint64_t non_ip = 0;
-
 struct port_des {
 	struct my_ctrs ctr;
 	unsigned int last_sync;
@@ -149,12 +165,50 @@ struct port_des {
 	struct netmap_ring *ring;
 };
 
-struct port_des *ports;
+/*
+ * Each dispatcher thread reads from a group of rx rings and sends
+ * packets to its own set of output pipes, so there is no shared
+ * state in the datapath. With one dispatcher the group contains all
+ * the rings, otherwise dispatcher i handles the rings r with
+ * r % dispatchers == i, each one bound through its own descriptor.
+ * Pipe j of dispatcher i is {(i * output_rings + j).
+ * Counters are only written by the owner, the stats thread reads them.
+ */
+struct dispatcher {
+	int id;
+	int core;		/* -1 if not pinned */
+	pthread_t tid;
+
+	uint32_t nrx;		/* rx ports in the group */
+	struct port_des *rxports;
+	struct port_des *ports;	/* output pipes, glob_arg.output_rings */
+	struct overflow_queue *oq; /* one per pipe, NULL if none */
+	struct overflow_queue *freeq;
+	uint32_t nbufs;		/* share of the extra buffers */
+
+	uint64_t forwarded __attribute__ ((aligned (64)));
+	uint64_t dropped;
+	uint64_t non_ip;
+	uint32_t table_gen;	/* last table generation seen, atomic */
+};
+
+/*
+ * The table mapping hashes to output pipes. It is rebuilt by the
+ * control thread and published by pointer. Dispatchers load the
+ * pointer once per batch and report the generation they have seen
+ * when not holding a reference, so the old table can be freed once
+ * all dispatchers have moved past it.
+ */
+static struct maglev_table *lb_table;
+
+struct dispatcher *disp;
+struct port_des *ports;	/* all output pipes, dispatcher-major */
 
 static void *
 print_stats(void *arg)
 {
 	int npipes = glob_arg.output_rings;
+	int ndisp = glob_arg.dispatchers;
 	int sys_int = 0;
 	(void)arg;
 	struct my_ctrs cur, prev;
@@ -170,8 +224,9 @@ print_stats(void *arg)
 	memset(&prev, 0, sizeof(prev));
 	gettimeofday(&prev.t, NULL);
 	while (!do_abort) {
-		int j, dosyslog = 0;
+		int i, j, dosyslog = 0;
 		uint64_t pps, dps, usec;
+		uint64_t forwarded = 0, dropped = 0, non_ip = 0;
 		struct my_ctrs x;
 
 		memset(&cur, 0, sizeof(cur));
@@ -183,17 +238,25 @@ print_stats(void *arg)
 		}
 
 		for (j = 0; j < npipes; ++j) {
-			struct port_des *p = &ports[j];
+			struct my_ctrs c;
 
-			cur.pkts += p->ctr.pkts;
-			cur.drop += p->ctr.drop;
+			/* sum the counters of pipe j of all dispatchers */
+			memset(&c, 0, sizeof(c));
+			for (i = 0; i < ndisp; i++) {
+				struct port_des *p = &disp[i].ports[j];
 
-			x.pkts = p->ctr.pkts - pipe_prev[j].pkts;
-			x.drop = p->ctr.drop - pipe_prev[j].drop;
+				c.pkts += p->ctr.pkts;
+				c.drop += p->ctr.drop;
+			}
+			cur.pkts += c.pkts;
+			cur.drop += c.drop;
+
+			x.pkts = c.pkts - pipe_prev[j].pkts;
+			x.drop = c.drop - pipe_prev[j].drop;
 			pps = (x.pkts*1000000 + usec/2) / usec;
 			dps = (x.drop*1000000 + usec/2) / usec;
 			printf("%s/%s|", norm(b1, pps), norm(b2, dps));
-			pipe_prev[j] = p->ctr;
+			pipe_prev[j] = c;
 
 			if (dosyslog) {
 				syslog(LOG_INFO,
@@ -202,10 +265,15 @@ print_stats(void *arg)
 						"\"output_ring\":%"PRIu16","
 						"\"packets_forwarded\":%"PRIu64","
 						"\"packets_dropped\":%"PRIu64
-					"}", glob_arg.ifname, j, p->ctr.pkts, p->ctr.drop);
+					"}", glob_arg.ifname, j, c.pkts, c.drop);
 			}
 		}
 		printf("\n");
+		for (i = 0; i < ndisp; i++) {
+			forwarded += disp[i].forwarded;
+			dropped += disp[i].dropped;
+			non_ip += disp[i].non_ip;
+		}
 		if (dosyslog) {
 			syslog(LOG_INFO,
 				"{"
@@ -232,30 +300,42 @@ print_stats(void *arg)
 static void
 free_buffers(void)
 {
-	int i, tot = 0;
-	struct port_des *rxport = &ports[glob_arg.output_rings];
+	int i, j, tot = 0;
+	/* the extra buffers were obtained through the first rx port */
+	struct port_des *rxport = &disp[0].rxports[0];
 
 	/* build a netmap free list with the buffers in all the overflow queues */
-	for (i = 0; i < glob_arg.output_rings + 1; i++) {
-		struct port_des *cp = &ports[i];
-		struct overflow_queue *q = cp->oq;
+	for (i = 0; i < glob_arg.dispatchers; i++) {
+		struct dispatcher *d = &disp[i];
 
-		if (!q)
-			continue;
+		for (j = 0; j < glob_arg.output_rings + 1; j++) {
+			struct port_des *cp = j < glob_arg.output_rings ?
+				&d->ports[j] : &d->rxports[0];
+			struct overflow_queue *q = cp->oq;
 
-		while (q->n) {
-			struct netmap_slot s = oq_deq(q);
-			uint32_t *b = (uint32_t *)NETMAP_BUF(cp->ring, s.buf_idx);
+			if (!q)
+				continue;
 
-			*b = rxport->nmd->nifp->ni_bufs_head;
-			rxport->nmd->nifp->ni_bufs_head = s.buf_idx;
-			tot++;
+			while (q->n) {
+				struct netmap_slot s = oq_deq(q);
+				uint32_t *b = (uint32_t *)NETMAP_BUF(cp->ring, s.buf_idx);
+
+				*b = rxport->nmd->nifp->ni_bufs_head;
+				rxport->nmd->nifp->ni_bufs_head = s.buf_idx;
+				tot++;
+			}
 		}
 	}
 	D("added %d buffers to netmap free list", tot);
 
-	for (i = 0; i < glob_arg.output_rings + 1; ++i) {
-		nm_close(ports[i].nmd);
+	for (i = glob_arg.dispatchers - 1; i >= 0; i--) {
+		struct dispatcher *d = &disp[i];
+
+		for (j = 0; j < glob_arg.output_rings; j++)
+			nm_close(d->ports[j].nmd);
+		/* the first rx port holds the memory, close it last */
+		for (j = d->nrx - 1; j >= 0; j--)
+			nm_close(d->rxports[j].nmd);
 	}
 }
 
@@ -267,6 +347,26 @@ static void sigint_h(int sig)
 	signal(SIGINT, SIG_DFL);
 }
 
+/* set the thread affinity. */
+static int
+setaffinity(pthread_t me, int i)
+{
+	cpuset_t cpumask;
+
+	if (i == -1)
+		return 0;
+
+	/* Set thread affinity affinity.*/
+	CPU_ZERO(&cpumask);
+	CPU_SET(i, &cpumask);
+
+	if (pthread_setaffinity_np(me, sizeof(cpuset_t), &cpumask) != 0) {
+		D("Unable to set affinity: %s", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
 void usage()
 {
 	printf("usage: lb [options]\n");
@@ -277,23 +377,541 @@ void usage()
 	printf("  -b batch        batch size (default: %d)\n", DEF_BATCH);
 	printf("  -s seconds      seconds between syslog messages (default: %d)\n",
 			DEF_SYSLOG_INT);
+	printf("  -t ndisp        number of dispatcher threads (default: 1)\n");
+	printf("                  dispatcher i uses pipes i*npipes .. (i+1)*npipes-1\n");
+	printf("  -C core         pin dispatcher i on core+i (default: no pinning)\n");
+	printf("  -m              use weighted consistent hashing (default: hash %% npipes)\n");
+	printf("  -W w0,w1,...    initial weights of the pipes (default: 1, implies -m)\n");
+	printf("  -S path         control socket for changing weights (implies -m)\n");
 	exit(0);
 }
 
+/*
+ * queue a packet for which there is no room in the output pipe into
+ * the overflow queue, revoking buffers from the longest queue if
+ * needed, or drop it. Returns the buffer to put in the rx slot.
+ */
+static uint32_t
+overflow_or_drop(struct dispatcher *d, uint32_t output_port,
+		struct netmap_slot *rs)
+{
+	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *ports = d->ports;
+	struct port_des *port = &ports[output_port];
+	struct overflow_queue *freeq = d->freeq;
+
+	/* use the overflow queue, if available */
+	if (!d->oq) {
+		d->dropped++;
+		port->ctr.drop++;
+		return rs->buf_idx;
+	}
+
+	if (!freeq->n) {
+		/* revoke some buffers from the longest overflow queue */
+		uint32_t j;
+		struct port_des *lp = &ports[0];
+		uint32_t max = lp->oq->n;
+
+		for (j = 1; j < npipes; j++) {
+			struct port_des *cp = &ports[j];
+			if (cp->oq->n > max) {
+				lp = cp;
+				max = cp->oq->n;
+			}
+		}
+
+		// XXX optimize this cycle
+		for (j = 0; lp->oq->n && j < BUF_REVOKE; j++) {
+			struct netmap_slot tmp = oq_deq(lp->oq);
+			oq_enq(freeq, &tmp);
+		}
+
+		ND(1, "revoked %d buffers from %s", j, lq->name);
+		lp->ctr.drop += j;
+		d->dropped += j;
+	}
+
+	oq_enq(port->oq, rs);
+	return oq_deq(freeq).buf_idx;
+}
+
+/*
+ * move the packets received on rxport to the output pipes of d.
+ * Packets are handled in batches of HASH_BATCH: all the buffers are
+ * prefetched, then parsed and hashed together, then grouped by
+ * output pipe so that each output ring is updated once per batch.
+ */
+static void
+dispatch_rxport(struct dispatcher *d, struct port_des *rxport)
+{
+	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *ports = d->ports;
+	uint32_t first[npipes + 1];	/* start of each pipe in order[] */
+	const struct maglev_table *tbl;
+	int batch = 0;
+	uint32_t i, j, k;
+
+	for (i = rxport->nmd->first_rx_ring; i <= rxport->nmd->last_rx_ring; i++) {
+		struct netmap_ring *rxring = NETMAP_RXRING(rxport->nmd->nifp, i);
+
+		while (!nm_ring_empty(rxring)) {
+			struct netmap_slot *rs[HASH_BATCH];
+			const unsigned char *buf[HASH_BATCH];
+			uint32_t hash[HASH_BATCH];
+			uint8_t order[HASH_BATCH]; /* packets sorted by pipe */
+			uint32_t cur = rxring->cur;
+			uint32_t n = nm_ring_space(rxring);
+
+			if (n > HASH_BATCH)
+				n = HASH_BATCH;
+
+			/* prefetch the whole batch */
+			for (k = 0; k < n; k++) {
+				rs[k] = &rxring->slot[cur];
+				buf[k] = (const unsigned char *)
+					NETMAP_BUF(rxring, rs[k]->buf_idx);
+				__builtin_prefetch(buf[k]);
+				cur = nm_ring_next(rxring, cur);
+			}
+
+			// CHOOSE THE CORRECT OUTPUT PIPE
+			// 'B' is just a hashing seed
+			pkt_hdr_hash_batch(buf, hash, n, 4, 'B');
+
+			/* group by output pipe, preserving the order */
+			memset(first, 0, sizeof(first));
+			tbl = __atomic_load_n(&lb_table, __ATOMIC_ACQUIRE);
+			for (k = 0; k < n; k++) {
+				if (hash[k] == 0)
+					d->non_ip++; // XXX ??
+				hash[k] = tbl->ent[hash[k] % tbl->size];
+				first[hash[k] + 1]++;
+			}
+			for (j = 0; j < npipes; j++)
+				first[j + 1] += first[j];
+			for (k = 0; k < n; k++)
+				order[first[hash[k]]++] = k;
+			/* now first[j] is the end of pipe j */
+
+			for (j = 0, k = 0; j < npipes; j++) {
+				struct port_des *port = &ports[j];
+				struct netmap_ring *ring = port->ring;
+				uint32_t space, tcur, fwd;
+
+				if (k == first[j])
+					continue;
+				/* Move the packets to the output pipe. */
+				space = nm_ring_space(ring);
+				tcur = ring->cur;
+				for (fwd = 0; k < first[j] && fwd < space; k++, fwd++) {
+					struct netmap_slot *p = rs[order[k]];
+					struct netmap_slot *ts = &ring->slot[tcur];
+					uint32_t free_buf = ts->buf_idx;
+
+					ts->buf_idx = p->buf_idx;
+					ts->len = p->len;
+					ts->flags |= NS_BUF_CHANGED;
+					p->buf_idx = free_buf;
+					p->flags |= NS_BUF_CHANGED;
+					tcur = nm_ring_next(ring, tcur);
+				}
+				if (fwd) {
+					ring->head = ring->cur = tcur;
+					port->ctr.pkts += fwd;
+					d->forwarded += fwd;
+				}
+				for (; k < first[j]; k++) {
+					struct netmap_slot *p = rs[order[k]];
+					uint32_t b = overflow_or_drop(d, j, p);
+
+					if (b != p->buf_idx) {
+						p->buf_idx = b;
+						p->flags |= NS_BUF_CHANGED;
+					}
+				}
+			}
+			rxring->head = rxring->cur = cur;
+
+			batch += n;
+			if (unlikely(batch >= glob_arg.batch)) {
+				ioctl(rxport->nmd->fd, NIOCRXSYNC, NULL);
+				batch = 0;
+			}
+			ND(1,
+			   "Forwarded Packets: %"PRIu64" Dropped packets: %"PRIu64"   Percent: %.2f",
+			   d->forwarded, d->dropped,
+			   ((float)d->dropped / (float)d->forwarded * 100));
+		}
+
+	}
+}
+
+static void *
+dispatch(void *arg)
+{
+	struct dispatcher *d = arg;
+	uint32_t npipes = glob_arg.output_rings;
+	struct port_des *ports = d->ports;
+	struct overflow_queue *oq = d->oq;
+	struct overflow_queue *freeq = d->freeq;
+	struct pollfd pollfd[npipes + d->nrx];
+	uint32_t i, r;
+	unsigned int iter = 0;
+
+	memset(&pollfd, 0, sizeof(pollfd));
+
+	setaffinity(pthread_self(), d->core);
 
+	while (!do_abort) {
+		u_int polli = 0;
+		iter++;
+
+		for (i = 0; i < npipes; ++i) {
+			pollfd[polli].fd = ports[i].nmd->fd;
+			pollfd[polli].events = POLLOUT;
+			pollfd[polli].revents = 0;
+			++polli;
+		}
+
+		for (r = 0; r < d->nrx; r++) {
+			pollfd[polli].fd = d->rxports[r].nmd->fd;
+			pollfd[polli].events = POLLIN;
+			pollfd[polli].revents = 0;
+			++polli;
+		}
+
+		/* no table references held here. The release orders
+		 * our reads of the old table before the store, so
+		 * update_table() can free it when it sees the new gen.
+		 */
+		__atomic_store_n(&d->table_gen,
+		    __atomic_load_n(&lb_table, __ATOMIC_ACQUIRE)->gen,
+		    __ATOMIC_RELEASE);
+
+		//RD(5, "polling %d file descriptors", polli+1);
+		i = poll(pollfd, polli, 10);
+		if (i <= 0) {
+			RD(1, "poll error %s", errno ? strerror(errno) : "timeout");
+			continue;
+		} else {
+			//RD(5, "Poll returned %d", i);
+		}
+
+		if (oq) {
+			/* try to push packets from the overflow queues
+			 * to the corresponding pipes
+			 */
+			for (i = 0; i < npipes; i++) {
+				struct port_des *p = &ports[i];
+				struct overflow_queue *q = p->oq;
+				uint32_t j, lim;
+				struct netmap_ring *ring;
+				struct netmap_slot *slot;
+
+				if (!q->n)
+					continue;
+				ring = p->ring;
+				lim = nm_ring_space(ring);
+				if (!lim)
+					continue;
+				if (q->n < lim)
+					lim = q->n;
+				for (j = 0; j < lim; j++) {
+					struct netmap_slot s = oq_deq(q);
+					slot = &ring->slot[ring->cur];
+					oq_enq(freeq, slot);
+					*slot = s;
+					slot->flags |= NS_BUF_CHANGED;
+					ring->cur = nm_ring_next(ring, ring->cur);
+				}
+				ring->head = ring->cur;
+				d->forwarded += lim;
+				p->ctr.pkts += lim;
+			}
+		}
+
+		for (r = 0; r < d->nrx; r++)
+			dispatch_rxport(d, &d->rxports[r]);
+	}
+	return NULL;
+}
+
+/*
+ * build a table with the current weights and publish it, then
+ * wait until no dispatcher can use the old one and free it.
+ */
+static int
+update_table(void)
+{
+	struct maglev_table *old = lb_table, *t;
+	uint32_t i;
+
+	t = maglev_build(glob_arg.weights, glob_arg.output_rings, MAGLEV_SIZE);
+	if (t == NULL)
+		return -1;
+	t->gen = old->gen + 1;
+	__atomic_store_n(&lb_table, t, __ATOMIC_RELEASE);
+	for (i = 0; i < glob_arg.dispatchers && !do_abort; i++) {
+		while (__atomic_load_n(&disp[i].table_gen, __ATOMIC_ACQUIRE) <
+		    t->gen && !do_abort)
+			usleep(1000);
+	}
+	if (!do_abort)
+		free(old);
+	return 0;
+}
+
+/*
+ * process one command from the control socket, write the reply in buf.
+ *	weight <pipe> <w>	set the weight of a pipe
+ *	add <pipe> [w]		same, w defaults to 1
+ *	drain <pipe>		weight 0, no new flows are sent to the pipe
+ *	show			print the weights
+ */
+static void
+control_cmd(char *buf, size_t len)
+{
+	char cmd[16];
+	uint32_t pipe, w = 1, oldw;
+	int n, ret;
+
+	n = sscanf(buf, "%15s %u %u", cmd, &pipe, &w);
+	if (n >= 1 && strcmp(cmd, "show") == 0) {
+		size_t l = 0;
+
+		for (pipe = 0; pipe < glob_arg.output_rings && l < len; pipe++) {
+			l += snprintf(buf + l, len - l, "pipe %u weight %u\n",
+				pipe, glob_arg.weights[pipe]);
+		}
+		return;
+	}
+	if (n < 2 || pipe >= glob_arg.output_rings) {
+		snprintf(buf, len, "error: usage weight|add|drain <pipe> [w], show\n");
+		return;
+	}
+	if (strcmp(cmd, "drain") == 0) {
+		w = 0;
+	} else if (strcmp(cmd, "weight") == 0) {
+		if (n != 3) {
+			snprintf(buf, len, "error: missing weight\n");
+			return;
+		}
+	} else if (strcmp(cmd, "add") != 0) {
+		snprintf(buf, len, "error: unknown command %s\n", cmd);
+		return;
+	}
+	oldw = glob_arg.weights[pipe];
+	glob_arg.weights[pipe] = w;
+	ret = update_table();
+	if (ret) {
+		glob_arg.weights[pipe] = oldw;
+		snprintf(buf, len, "error: cannot build the table\n");
+		return;
+	}
+	D("pipe %u weight %u -> %u", pipe, oldw, w);
+	syslog(LOG_INFO, "{\"interface\":\"%s\",\"output_ring\":%u,"
+		"\"weight\":%u}", glob_arg.ifname, pipe, w);
+	snprintf(buf, len, "ok\n");
+}
+
+/*
+ * the control thread accepts connections on a unix socket and
+ * executes one command per line.
+ */
+static void *
+control(void *arg)
+{
+	int s = *(int *)arg;
+
+	while (!do_abort) {
+		struct pollfd pfd = { .fd = s, .events = POLLIN };
+		char buf[2048];
+		FILE *f;
+		int c;
+
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+		c = accept(s, NULL, NULL);
+		if (c < 0)
+			continue;
+		f = fdopen(c, "r");
+		if (f == NULL) {
+			close(c);
+			continue;
+		}
+		while (!do_abort && fgets(buf, sizeof(buf), f)) {
+			control_cmd(buf, sizeof(buf));
+			if (write(c, buf, strlen(buf)) < 0)
+				break;
+		}
+		fclose(f);
+	}
+	close(s);
+	unlink(glob_arg.ctl_path);
+	return NULL;
+}
+
+static int
+open_control_socket(const char *path)
+{
+	struct sockaddr_un sun;
+	int s;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		D("control socket path too long %s", path);
+		return -1;
+	}
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) {
+		D("cannot create the control socket: %s", strerror(errno));
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(s, 4) < 0) {
+		D("cannot bind the control socket %s: %s", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ * parse the comma separated list of initial weights
+ */
+static int
+parse_weights(const char *arg)
+{
+	char *tmp = strdup(arg), *p, *save = NULL;
+	uint32_t i = 0;
+
+	if (tmp == NULL)
+		return -1;
+	free(glob_arg.weights);
+	glob_arg.weights = calloc(glob_arg.output_rings, sizeof(uint32_t));
+	if (glob_arg.weights == NULL) {
+		free(tmp);
+		return -1;
+	}
+	for (p = strtok_r(tmp, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		if (i >= glob_arg.output_rings) {
+			D("too many weights, only %u pipes", glob_arg.output_rings);
+			free(tmp);
+			return -1;
+		}
+		glob_arg.weights[i++] = atoi(p);
+	}
+	free(tmp);
+	for (; i < glob_arg.output_rings; i++)
+		glob_arg.weights[i] = 1;
+	return 0;
+}
+
+/*
+ * open the rx ports of dispatcher d. The first port of dispatcher 0
+ * has already been opened by the caller and holds the memory.
+ */
+static int
+open_rx_ports(struct dispatcher *d, struct nm_desc *parent, uint32_t nrings)
+{
+	uint32_t r;
+
+	d->nrx = glob_arg.dispatchers == 1 ? 1 :
+		(nrings - d->id + glob_arg.dispatchers - 1) / glob_arg.dispatchers;
+	d->rxports = calloc(d->nrx, sizeof(struct port_des));
+	if (!d->rxports) {
+		D("failed to allocate the rx ports");
+		return 1;
+	}
+	for (r = 0; r < d->nrx; r++) {
+		char interface[MAX_IFNAMELEN];
+		struct port_des *p = &d->rxports[r];
+		uint32_t ring = d->id + r * glob_arg.dispatchers;
+
+		if (ring == 0) {
+			p->nmd = parent;
+		} else {
+			snprintf(interface, sizeof(interface), "%s-%d",
+				glob_arg.ifname, ring);
+			p->nmd = nm_open(interface, NULL, 0, parent);
+			if (p->nmd == NULL) {
+				D("cannot open %s", interface);
+				return 1;
+			}
+			D("dispatcher %d: opened %s", d->id, interface);
+		}
+		p->ring = NETMAP_RXRING(p->nmd->nifp, p->nmd->first_rx_ring);
+	}
+	return 0;
+}
+
+/*
+ * open the output pipes of dispatcher d and their overflow queues.
+ * On allocation failures *extra_bufs is cleared to disable the
+ * overflow queues.
+ */
+static int
+open_pipes(struct dispatcher *d, struct nm_desc *parent, uint32_t *extra_bufs)
+{
+	uint32_t i, npipes = glob_arg.output_rings;
+
+	for (i = 0; i < npipes; ++i) {
+		char interface[MAX_IFNAMELEN];
+		struct port_des *p = &d->ports[i];
+		uint32_t pipe = d->id * npipes + i;
+
+		sprintf(interface, "%s{%d", glob_arg.ifname, pipe);
+		D("opening pipe named %s", interface);
+
+		//p->nmd = nm_open(interface, NULL, NM_OPEN_NO_MMAP | NM_OPEN_ARG3 | NM_OPEN_RING_CFG, parent);
+		p->nmd = nm_open(interface, NULL, 0, parent);
+
+		if (p->nmd == NULL) {
+			D("cannot open %s", interface);
+			return (1);
+		} else {
+			D("successfully opened pipe #%d %s (tx slots: %d)",
+			  pipe + 1, interface, p->nmd->req.nr_tx_slots);
+			p->ring = NETMAP_TXRING(p->nmd->nifp, 0);
+		}
+		D("zerocopy %s",
+		  (parent->mem == p->nmd->mem) ? "enabled" : "disabled");
+
+		if (*extra_bufs && d->oq) {
+			struct overflow_queue *q = &d->oq[i];
+			q->slots = calloc(d->nbufs, sizeof(struct netmap_slot));
+			if (!q->slots) {
+				D("failed to allocate overflow queue for pipe %d", pipe);
+				/* make all overflow queue management fail */
+				*extra_bufs = 0;
+			}
+			q->size = d->nbufs;
+			snprintf(q->name, MAX_IFNAMELEN, "oq %d", pipe);
+			p->oq = q;
+		}
+	}
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
 	int ch;
-	uint32_t i;
-	unsigned int iter = 0;
+	uint32_t i, t;
 
 	glob_arg.ifname[0] = '\0';
 	glob_arg.output_rings = DEF_OUT_PIPES;
 	glob_arg.batch = DEF_BATCH;
 	glob_arg.syslog_interval = DEF_SYSLOG_INT;
+	glob_arg.dispatchers = 1;
+	glob_arg.first_core = -1;
+
+	const char *weights = NULL;
 
-	while ( (ch = getopt(argc, argv, "i:p:b:B:s:")) != -1) {
+	while ( (ch = getopt(argc, argv, "i:p:b:B:s:t:C:mW:S:")) != -1) {
 		switch (ch) {
 		case 'i':
 			D("interface is %s", optarg);
@@ -332,6 +950,36 @@ int main(int argc, char **argv)
 			D("syslog interval is %d", glob_arg.syslog_interval);
 			break;
 
+		case 't':
+			glob_arg.dispatchers = atoi(optarg);
+			if (glob_arg.dispatchers < 1 ||
+			    glob_arg.dispatchers > MAX_DISPATCHERS) {
+				D("dispatchers must be between 1 and %d",
+					MAX_DISPATCHERS);
+				usage();
+				return 1;
+			}
+			break;
+
+		case 'C':
+			glob_arg.first_core = atoi(optarg);
+			D("first core is %d", glob_arg.first_core);
+			break;
+
+		case 'm':
+			glob_arg.maglev = 1;
+			break;
+
+		case 'W':
+			weights = optarg;
+			glob_arg.maglev = 1;
+			break;
+
+		case 'S':
+			glob_arg.ctl_path = optarg;
+			glob_arg.maglev = 1;
+			break;
+
 		default:
 			D("bad option %c %s", ch, optarg);
 			usage();
@@ -350,17 +998,44 @@ int main(int argc, char **argv)
 	openlog("lb", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 
 	uint32_t npipes = glob_arg.output_rings;
+	uint32_t ndisp = glob_arg.dispatchers;
 
-	struct overflow_queue *freeq = NULL;
+	/* pipes were given before -W, so parse the weights here */
+	if (parse_weights(weights ? weights : "1")) {
+		D("invalid weights %s", weights);
+		return 1;
+	}
+	lb_table = glob_arg.maglev ?
+		maglev_build(glob_arg.weights, npipes, MAGLEV_SIZE) :
+		maglev_build_mod(npipes);
+	if (lb_table == NULL) {
+		D("cannot build the lookup table: %s", strerror(errno));
+		return 1;
+	}
+
+	pthread_t ctl_thread;
+	int ctl_sock = -1;
+
+	if (glob_arg.ctl_path) {
+		ctl_sock = open_control_socket(glob_arg.ctl_path);
+		if (ctl_sock < 0)
+			return 1;
+	}
 
 	pthread_t stat_thread;
 
-	ports = calloc(npipes + 1, sizeof(struct port_des));
-	if (!ports) {
+	disp = calloc(ndisp, sizeof(struct dispatcher));
+	ports = calloc(ndisp * npipes, sizeof(struct port_des));
+	if (!disp || !ports) {
 		D("failed to allocate the stats array");
 		return 1;
 	}
-	struct port_des *rxport = &ports[npipes];
+	for (t = 0; t < ndisp; t++) {
+		disp[t].id = t;
+		disp[t].core = glob_arg.first_core < 0 ? -1 :
+			glob_arg.first_core + (int)t;
+		disp[t].ports = &ports[t * npipes];
+	}
 
 	if (pthread_create(&stat_thread, NULL, print_stats, NULL) == -1) {
 		D("unable to create the stats thread: %s", strerror(errno));
@@ -372,23 +1047,36 @@ int main(int argc, char **argv)
 	struct nmreq base_req;
 	memset(&base_req, 0, sizeof(base_req));
 
-	base_req.nr_arg1 = npipes;
+	base_req.nr_arg1 = npipes * ndisp;
 	base_req.nr_arg3 = glob_arg.extra_bufs;
 
-	rxport->nmd = nm_open(glob_arg.ifname, &base_req, 0, NULL);
+	/* with multiple dispatchers, the first port is bound to ring 0 */
+	char first_if[MAX_IFNAMELEN];
+	snprintf(first_if, sizeof(first_if), ndisp > 1 ? "%s-0" : "%s",
+		glob_arg.ifname);
+	struct nm_desc *mainnmd = nm_open(first_if, &base_req, 0, NULL);
 
-	if (rxport->nmd == NULL) {
-		D("cannot open %s", glob_arg.ifname);
+	if (mainnmd == NULL) {
+		D("cannot open %s", first_if);
 		return (1);
 	} else {
-		D("successfully opened %s (tx rings: %u)", glob_arg.ifname,
-		  rxport->nmd->req.nr_tx_slots);
+		D("successfully opened %s (tx rings: %u)", first_if,
+		  mainnmd->req.nr_tx_slots);
+	}
+	uint32_t nrings = mainnmd->req.nr_rx_rings;
+	if (ndisp > nrings) {
+		D("%u dispatchers but only %u rx rings", ndisp, nrings);
+		return 1;
 	}
 
-	uint32_t extra_bufs = rxport->nmd->req.nr_arg3;
-	struct overflow_queue *oq = NULL;
+	for (t = 0; t < ndisp; t++) {
+		if (open_rx_ports(&disp[t], mainnmd, nrings))
+			return 1;
+	}
+
+	uint32_t extra_bufs = mainnmd->req.nr_arg3;
 	/* reference ring to access the buffers */
-	rxport->ring = NETMAP_RXRING(rxport->nmd->nifp, 0);
+	struct netmap_ring *bufring = disp[0].rxports[0].ring;
 
 	if (!glob_arg.extra_bufs)
 		goto run;
@@ -397,258 +1085,110 @@ int main(int argc, char **argv)
 	if (!extra_bufs)
 		goto run;
 
-	/* one overflow queue for each output pipe, plus one for the
-	 * free extra buffers
+	/* each dispatcher has one overflow queue for each output pipe,
+	 * plus one for its share of the free extra buffers
 	 */
-	oq = calloc(npipes + 1, sizeof(struct overflow_queue));
-	if (!oq) {
-		D("failed to allocated overflow queues descriptors");
-		goto run;
-	}
+	for (t = 0; t < ndisp; t++) {
+		struct dispatcher *d = &disp[t];
+		d->nbufs = extra_bufs / ndisp +
+			(t < extra_bufs % ndisp ? 1 : 0);
+
+		d->oq = calloc(npipes + 1, sizeof(struct overflow_queue));
+		if (!d->oq) {
+			D("failed to allocated overflow queues descriptors");
+			extra_bufs = 0;
+			goto run;
+		}
 
-	freeq = &oq[npipes];
-	rxport->oq = freeq;
+		d->freeq = &d->oq[npipes];
+		d->rxports[0].oq = d->freeq;
 
-	freeq->slots = calloc(extra_bufs, sizeof(struct netmap_slot));
-	if (!freeq->slots) {
-		D("failed to allocate the free list");
-	}
-	freeq->size = extra_bufs;
-	snprintf(freeq->name, MAX_IFNAMELEN, "free queue");
+		d->freeq->slots = calloc(d->nbufs, sizeof(struct netmap_slot));
+		if (!d->freeq->slots) {
+			D("failed to allocate the free list");
+		}
+		d->freeq->size = d->nbufs;
+		snprintf(d->freeq->name, MAX_IFNAMELEN, "free queue %d", t);
+
+		/*
+		 * the list of buffers uses the first uint32_t in each buffer
+		 * as the index of the next buffer.
+		 */
+		uint32_t scan;
+		for (scan = mainnmd->nifp->ni_bufs_head;
+		     scan && d->freeq->n < d->nbufs;
+		     scan = *(uint32_t *)NETMAP_BUF(bufring, scan))
+		{
+			struct netmap_slot s;
+			s.buf_idx = scan;
+			ND("freeq <- %d", s.buf_idx);
+			oq_enq(d->freeq, &s);
+		}
+		mainnmd->nifp->ni_bufs_head = scan;
 
-	/*
-	 * the list of buffers uses the first uint32_t in each buffer
-	 * as the index of the next buffer.
-	 */
-	uint32_t scan;
-	for (scan = rxport->nmd->nifp->ni_bufs_head;
-	     scan;
-	     scan = *(uint32_t *)NETMAP_BUF(rxport->ring, scan))
-	{
-		struct netmap_slot s;
-		s.buf_idx = scan;
-		ND("freeq <- %d", s.buf_idx);
-		oq_enq(freeq, &s);
+		if (d->freeq->n != d->nbufs) {
+			D("something went wrong: dispatcher %d expected %u extra buffers, but the free list contained %u",
+					t, d->nbufs, d->freeq->n);
+			return 1;
+		}
 	}
 
 	atexit(free_buffers);
 
-	if (freeq->n != extra_bufs) {
-		D("something went wrong: netmap reported %d extra_bufs, but the free list contained %d",
-				extra_bufs, freeq->n);
-		return 1;
-	}
-	rxport->nmd->nifp->ni_bufs_head = 0;
+	mainnmd->nifp->ni_bufs_head = 0;
 
 run:
-	for (i = 0; i < npipes; ++i) {
-		char interface[25];
-		sprintf(interface, "%s{%d", glob_arg.ifname, i);
-		D("opening pipe named %s", interface);
-
-		//ports[i].nmd = nm_open(interface, NULL, NM_OPEN_NO_MMAP | NM_OPEN_ARG3 | NM_OPEN_RING_CFG, rxport->nmd);
-		ports[i].nmd = nm_open(interface, NULL, 0, rxport->nmd);
-
-		if (ports[i].nmd == NULL) {
-			D("cannot open %s", interface);
-			return (1);
-		} else {
-			D("successfully opened pipe #%d %s (tx slots: %d)",
-			  i + 1, interface, ports[i].nmd->req.nr_tx_slots);
-			ports[i].ring = NETMAP_TXRING(ports[i].nmd->nifp, 0);
-		}
-		D("zerocopy %s",
-		  (rxport->nmd->mem == ports[i].nmd->mem) ? "enabled" : "disabled");
-
-		if (extra_bufs) {
-			struct overflow_queue *q = &oq[i];
-			q->slots = calloc(extra_bufs, sizeof(struct netmap_slot));
-			if (!q->slots) {
-				D("failed to allocate overflow queue for pipe %d", i);
-				/* make all overflow queue management fail */
-				extra_bufs = 0;
-			}
-			q->size = extra_bufs;
-			snprintf(q->name, MAX_IFNAMELEN, "oq %d", i);
-			ports[i].oq = q;
-		}
+	for (t = 0; t < ndisp; t++) {
+		if (open_pipes(&disp[t], mainnmd, &extra_bufs))
+			return 1;
 	}
 
 	if (glob_arg.extra_bufs && !extra_bufs) {
-		if (oq) {
+		for (t = 0; t < ndisp; t++) {
+			struct dispatcher *d = &disp[t];
+
+			if (!d->oq)
+				continue;
 			for (i = 0; i < npipes + 1; i++) {
-				free(oq[i].slots);
-				oq[i].slots = NULL;
+				free(d->oq[i].slots);
+				d->oq[i].slots = NULL;
 			}
-			free(oq);
-			oq = NULL;
+			for (i = 0; i < npipes; i++)
+				d->ports[i].oq = NULL;
+			d->rxports[0].oq = NULL;
+			free(d->oq);
+			d->oq = NULL;
 		}
 		D("*** overflow queues disabled ***");
 	}
 
 	sleep(2);
 
-	struct pollfd pollfd[npipes + 1];
-	memset(&pollfd, 0, sizeof(pollfd));
-
 	signal(SIGINT, sigint_h);
-	while (!do_abort) {
-		u_int polli = 0;
-		iter++;
-
-		for (i = 0; i < npipes; ++i) {
-			pollfd[polli].fd = ports[i].nmd->fd;
-			pollfd[polli].events = POLLOUT;
-			pollfd[polli].revents = 0;
-			++polli;
-		}
-
-		pollfd[polli].fd = rxport->nmd->fd;
-		pollfd[polli].events = POLLIN;
-		pollfd[polli].revents = 0;
-		++polli;
-
-		//RD(5, "polling %d file descriptors", polli+1);
-		i = poll(pollfd, polli, 10);
-		if (i <= 0) {
-			RD(1, "poll error %s", errno ? strerror(errno) : "timeout");
-			continue;
-		} else {
-			//RD(5, "Poll returned %d", i);
-		}
-
-		if (oq) {
-			/* try to push packets from the overflow queues
-			 * to the corresponding pipes
-			 */
-			for (i = 0; i < npipes; i++) {
-				struct port_des *p = &ports[i];
-				struct overflow_queue *q = p->oq;
-				uint32_t j, lim;
-				struct netmap_ring *ring;
-				struct netmap_slot *slot;
-
-				if (!q->n)
-					continue;
-				ring = p->ring;
-				lim = nm_ring_space(ring);
-				if (!lim)
-					continue;
-				if (q->n < lim)
-					lim = q->n;
-				for (j = 0; j < lim; j++) {
-					struct netmap_slot s = oq_deq(q);
-					slot = &ring->slot[ring->cur];
-					oq_enq(freeq, slot);
-					*slot = s;
-					slot->flags |= NS_BUF_CHANGED;
-					ring->cur = nm_ring_next(ring, ring->cur);
-				}
-				ring->head = ring->cur;
-				forwarded += lim;
-				p->ctr.pkts += lim;
-			}
-		}
-
-		int batch = 0;
-		for (i = rxport->nmd->first_rx_ring; i <= rxport->nmd->last_rx_ring; i++) {
-			struct netmap_ring *rxring = NETMAP_RXRING(rxport->nmd->nifp, i);
-
-			//D("prepare to scan rings");
-			int next_cur = rxring->cur;
-			struct netmap_slot *next_slot = &rxring->slot[next_cur];
-			const char *next_buf = NETMAP_BUF(rxring, next_slot->buf_idx);
-			while (!nm_ring_empty(rxring)) {
-				struct overflow_queue *q;
-				struct netmap_slot *rs = next_slot;
-
-				// CHOOSE THE CORRECT OUTPUT PIPE
-				uint32_t hash = pkt_hdr_hash((const unsigned char *)next_buf, 4, 'B');
-				if (hash == 0)
-					non_ip++; // XXX ??
-				// prefetch the buffer for the next round
-				next_cur = nm_ring_next(rxring, next_cur);
-				next_slot = &rxring->slot[next_cur];
-				next_buf = NETMAP_BUF(rxring, next_slot->buf_idx);
-				__builtin_prefetch(next_buf);
-				// 'B' is just a hashing seed
-				uint32_t output_port = hash % glob_arg.output_rings;
-				struct port_des *port = &ports[output_port];
-				struct netmap_ring *ring = port->ring;
-				uint32_t free_buf;
-
-				// Move the packet to the output pipe.
-				if (nm_ring_space(ring)) {
-					struct netmap_slot *ts = &ring->slot[ring->cur];
-					free_buf = ts->buf_idx;
-					ts->buf_idx = rs->buf_idx;
-					ts->len = rs->len;
-					ts->flags |= NS_BUF_CHANGED;
-					ring->head = ring->cur = nm_ring_next(ring, ring->cur);
-					port->ctr.pkts++;
-					forwarded++;
-					goto forward;
-				}
-
-				/* use the overflow queue, if available */
-				if (!oq) {
-					dropped++;
-					port->ctr.drop++;
-					goto next;
-				}
-
-				q = &oq[output_port];
-
-				if (!freeq->n) {
-					/* revoke some buffers from the longest overflow queue */
-					uint32_t j;
-					struct port_des *lp = &ports[0];
-					uint32_t max = lp->oq->n;
-
-					for (j = 1; j < npipes; j++) {
-						struct port_des *cp = &ports[j];
-						if (cp->oq->n > max) {
-							lp = cp;
-							max = cp->oq->n;
-						}
-					}
-
-					// XXX optimize this cycle
-					for (j = 0; lp->oq->n && j < BUF_REVOKE; j++) {
-						struct netmap_slot tmp = oq_deq(lp->oq);
-						oq_enq(freeq, &tmp);
-					}
-
-					ND(1, "revoked %d buffers from %s", j, lq->name);
-					lp->ctr.drop += j;
-					dropped += j;
-				}
-
-				free_buf = oq_deq(freeq).buf_idx;
-				oq_enq(q, rs);
-
-			forward:
-				rs->buf_idx = free_buf;
-				rs->flags |= NS_BUF_CHANGED;
-			next:
-				rxring->head = rxring->cur = next_cur;
-
-				batch++;
-				if (unlikely(batch >= glob_arg.batch)) {
-					ioctl(rxport->nmd->fd, NIOCRXSYNC, NULL);
-					batch = 0;
-				}
-				ND(1,
-				   "Forwarded Packets: %"PRIu64" Dropped packets: %"PRIu64"   Percent: %.2f",
-				   forwarded, dropped,
-				   ((float)dropped / (float)forwarded * 100));
-			}
-
+	for (t = 0; t < ndisp; t++) {
+		if (pthread_create(&disp[t].tid, NULL, dispatch, &disp[t])) {
+			D("unable to create dispatcher %d: %s", t, strerror(errno));
+			do_abort = 1;
+			break;
 		}
 	}
+	if (ctl_sock >= 0 &&
+	    pthread_create(&ctl_thread, NULL, control, &ctl_sock)) {
+		D("unable to create the control thread: %s", strerror(errno));
+		ctl_sock = -1;
+	}
+	while (t-- > 0)
+		pthread_join(disp[t].tid, NULL);
+	if (ctl_sock >= 0)
+		pthread_join(ctl_thread, NULL);
 
 	pthread_join(stat_thread, NULL);
 
+	uint64_t forwarded = 0, dropped = 0;
+	for (t = 0; t < ndisp; t++) {
+		forwarded += disp[t].forwarded;
+		dropped += disp[t].dropped;
+	}
 	printf("%"PRIu64" packets forwarded.  %"PRIu64" packets dropped. Total %"PRIu64"\n", forwarded,
 	       dropped, forwarded + dropped);
 	return 0;
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2016 Broala and Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Weighted Maglev lookup table.
+ *
+ * Each output i has a preference list, a permutation of the table
+ * entries given by (offset_i + j * skip_i) % size, which only depends
+ * on i. Outputs take turns claiming the next free entry in their
+ * list. With weights, at each turn output i adds weight[i] to its
+ * credit and claims an entry only when the credit reaches the
+ * maximum weight, so the number of entries is proportional to the
+ * weight. Since the lists do not change, a small change in the
+ * weights only moves a small fraction of the entries.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "maglev.h"
+
+#define MAGLEV_EMPTY	0xffff
+
+/* integer hash (murmur3 finalizer) to derive offset and skip */
+static uint32_t
+maglev_mix(uint32_t x, uint32_t seed)
+{
+	x ^= seed;
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+struct maglev_table *
+maglev_build(const uint32_t *weight, uint32_t n, uint32_t size)
+{
+	struct maglev_table *t = NULL;
+	uint32_t *offset = NULL, *skip = NULL, *next = NULL;
+	uint64_t *credit = NULL;
+	uint32_t i, filled = 0, wmax = 0;
+
+	for (i = 0; i < n; i++) {
+		if (weight[i] > wmax)
+			wmax = weight[i];
+	}
+	if (wmax == 0 || n >= MAGLEV_EMPTY || size < 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+	t = malloc(sizeof(*t) + size * sizeof(t->ent[0]));
+	offset = calloc(n, sizeof(*offset));
+	skip = calloc(n, sizeof(*skip));
+	next = calloc(n, sizeof(*next));
+	credit = calloc(n, sizeof(*credit));
+	if (!t || !offset || !skip || !next || !credit) {
+		free(t);
+		t = NULL;
+		errno = ENOMEM;
+		goto done;
+	}
+	t->gen = 0;
+	t->size = size;
+	memset(t->ent, 0xff, size * sizeof(t->ent[0]));	/* MAGLEV_EMPTY */
+	for (i = 0; i < n; i++) {
+		offset[i] = maglev_mix(i, 0x5bd1e995) % size;
+		skip[i] = maglev_mix(i, 0x1b873593) % (size - 1) + 1;
+	}
+	while (filled < size) {
+		for (i = 0; i < n && filled < size; i++) {
+			uint32_t c;
+
+			if (weight[i] == 0)
+				continue;
+			credit[i] += weight[i];
+			if (credit[i] < wmax)
+				continue;
+			credit[i] -= wmax;
+			/* claim the next free entry in the preference list */
+			do {
+				c = (offset[i] + (uint64_t)next[i] * skip[i]) % size;
+				next[i]++;
+			} while (t->ent[c] != MAGLEV_EMPTY);
+			t->ent[c] = i;
+			filled++;
+		}
+	}
+done:
+	free(offset);
+	free(skip);
+	free(next);
+	free(credit);
+	return t;
+}
+
+struct maglev_table *
+maglev_build_mod(uint32_t n)
+{
+	struct maglev_table *t;
+	uint32_t i, size;
+
+	if (n == 0 || n >= MAGLEV_EMPTY) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* a multiple of n, so (hash % size) % n == hash % n */
+	size = (MAGLEV_SIZE / n) * n;
+	t = malloc(sizeof(*t) + size * sizeof(t->ent[0]));
+	if (t == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	t->gen = 0;
+	t->size = size;
+	for (i = 0; i < size; i++)
+		t->ent[i] = i % n;
+	return t;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2016 Broala and Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __MAGLEV_H__
+#define __MAGLEV_H__
+
+#include <stdint.h>
+
+/*
+ * Lookup table mapping a flow hash to an output, built with the
+ * consistent hashing scheme of Maglev (Eisenbud et al., NSDI 2016)
+ * extended with weights. Changing the weight of one output only
+ * remaps about 1/n of the entries.
+ * The datapath uses ent[hash % size].
+ */
+#define MAGLEV_SIZE	65537	/* must be prime */
+
+struct maglev_table {
+	uint32_t gen;		/* generation, set by the caller */
+	uint32_t size;		/* number of entries */
+	uint16_t ent[];		/* output for each entry */
+};
+
+/*
+ * Build a table of size entries (a prime) for n outputs with the given
+ * weights. Outputs with weight 0 get no entries. Returns NULL if there
+ * are no usable outputs or on allocation failures.
+ */
+struct maglev_table *maglev_build(const uint32_t *weight, uint32_t n,
+	uint32_t size);
+
+/*
+ * Build a table that gives the same result as hash % n
+ */
+struct maglev_table *maglev_build_mod(uint32_t n);
+
+#endif /* __MAGLEV_H__ */
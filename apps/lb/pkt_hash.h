@@ -65,6 +65,23 @@ typedef struct vlanhdr {
 	uint16_t proto;
 } vlanhdr;
 /*---------------------------------------------------------------------*/
+/**
+ ** Fields used for the symmetric hash, in host byte order.
+ **/
+struct pkt_tuple {
+	uint32_t sip;
+	uint32_t dip;
+	uint16_t sp;
+	uint16_t dp;
+};
+/*---------------------------------------------------------------------*/
+/**
+ ** Computes the symmetric hash of n tuples, 8 at a time
+ ** if the CPU supports AVX2. Results are the same as pkt_hdr_hash().
+ **/
+void
+sym_hash_batch(const struct pkt_tuple *t, uint32_t *rc, int n);
+/*---------------------------------------------------------------------*/
 /**
  ** Analyzes the packet header of computes a corresponding 
  ** hash function.
@@ -74,5 +91,18 @@ pkt_hdr_hash(const unsigned char *buffer,
 	     uint8_t hash_split,
 	     uint8_t seed);
 /*---------------------------------------------------------------------*/
+/**
+ ** Same as pkt_hdr_hash() on n packets: all headers are parsed
+ ** first, then the hashes are computed with sym_hash_batch().
+ ** Callers should prefetch the buffers in advance.
+ **/
+#define PKT_HASH_MAX_BATCH	64
+void
+pkt_hdr_hash_batch(const unsigned char **buffers,
+		   uint32_t *rc,
+		   int n,
+		   uint8_t hash_split,
+		   uint8_t seed);
+/*---------------------------------------------------------------------*/
 #endif /* __PKT_HASH__ */
 
@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ptnsim: userspace simulator of the ptnetmap guest/host sync logic.
+ *
+ * ptnetmap.c is compiled as is against ptnsim_glue.h. One ring is
+ * simulated, in the direction given with -m:
+ *
+ * - the guest is a thread running netmap_pt_guest_txsync() or
+ *   netmap_pt_guest_rxsync() on the CSB, as a ptnet driver would do
+ *   for an application calling NIOC[TR]XSYNC after each batch, and
+ *   sleeping when the ring is full (tx) or empty (rx);
+ * - the host is the real ptnetmap kthread handler, run by a pthread
+ *   that waits for guest kicks and backend wakeups;
+ * - the backend is the nm_sync of the host kring: it drains (tx) or
+ *   fills (rx) the ring, at a given rate if -r is used, in which case
+ *   a "wire" thread notifies the kthread as a NIC interrupt would do.
+ *
+ * Kicks and interrupts are counted condition variables instead of
+ * eventfds. At the end we print the throughput, the latency (from the
+ * producer to the consumer of each slot), the notification counters
+ * and the ptnetmap host statistics.
+ */
+
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+#include "ptnsim_glue.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sched.h>
+#endif /* __linux__ */
+
+int netmap_verbose;
+
+/* the code under test */
+#include <dev/netmap/ptnetmap.c>
+
+/* a counted wakeup, replacing the eventfds of the hypervisor */
+struct sim_event {
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cv;
+	int		pending;
+	u_long		count;
+};
+
+struct nm_kthread {
+	pthread_t		th;
+	nm_kthread_worker_fn_t	fn;
+	void			*arg;
+	struct sim_event	*kick;	/* guest kicks, backend wakeups */
+	struct sim_event	*irq;	/* interrupts to the guest */
+	int			cpu;
+	volatile int		stop;
+	u_long			runs;
+};
+
+static struct {
+	/* configuration */
+	int		tx;		/* direction */
+	u_int		num_slots;
+	u_int		batch;		/* guest batch */
+	u_int		guest_cost;	/* ns per packet */
+	u_int		host_cost;	/* ns per packet */
+	uint64_t	rate;		/* wire rate, pps, 0 unlimited */
+	u_int		intr_us;	/* wire interrupt period */
+	int		duration;	/* seconds */
+	int		guest_cpu, host_cpu;
+
+	/* shared state */
+	struct ptnet_ring	*csb;
+	struct netmap_ring	*ring;
+	uint64_t		*stamps;	/* per slot, ns */
+	struct netmap_kring	kring;		/* host */
+	struct netmap_kring	gkring;		/* guest */
+	struct netmap_adapter	parent;
+	struct netmap_pt_host_adapter pth_na;
+	struct sim_event	kick, irq;
+	volatile int		stop;
+
+	/* backend */
+	uint64_t	t0;
+	uint64_t	wire_pkts;
+	u_long		wire_intrs;
+
+	/* results */
+	uint64_t	pkts;
+	uint64_t	lat_sum, lat_max;
+	u_long		guest_syncs, guest_kicks, guest_sleeps;
+} sim;
+
+static inline uint64_t
+sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* busy wait for n packets worth of work */
+static void
+sim_work(u_int n, u_int cost)
+{
+	uint64_t end;
+
+	if (n == 0 || cost == 0)
+		return;
+	end = sim_now() + (uint64_t)n * cost;
+	while (sim_now() < end)
+		;
+}
+
+static void
+sim_pin(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t cpuset;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+		D("unable to pin on core %d", cpu);
+#else
+	(void)cpu;
+#endif /* __linux__ */
+}
+
+static void
+sim_event_init(struct sim_event *ev)
+{
+	pthread_mutex_init(&ev->mtx, NULL);
+	pthread_cond_init(&ev->cv, NULL);
+	ev->pending = 0;
+	ev->count = 0;
+}
+
+static void
+sim_event_signal(struct sim_event *ev)
+{
+	pthread_mutex_lock(&ev->mtx);
+	ev->pending = 1;
+	ev->count++;
+	pthread_cond_signal(&ev->cv);
+	pthread_mutex_unlock(&ev->mtx);
+}
+
+/* wait for a signal, or for *stop to be set */
+static void
+sim_event_wait(struct sim_event *ev, volatile int *stop)
+{
+	pthread_mutex_lock(&ev->mtx);
+	while (!ev->pending && !*stop) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&ev->cv, &ev->mtx, &ts);
+	}
+	ev->pending = 0;
+	pthread_mutex_unlock(&ev->mtx);
+}
+
+/*
+ * nm_kthread on top of pthreads. The event entries carry pointers to
+ * sim_events instead of file descriptors.
+ */
+struct nm_kthread *
+nm_os_kthread_create(struct nm_kthread_cfg *cfg)
+{
+	struct nm_kthread *nmk = calloc(1, sizeof(*nmk));
+
+	if (nmk == NULL)
+		return NULL;
+	nmk->fn = cfg->worker_fn;
+	nmk->arg = cfg->worker_private;
+	nmk->kick = (struct sim_event *)(uintptr_t)cfg->event.ioeventfd;
+	nmk->irq = (struct sim_event *)(uintptr_t)cfg->event.irqfd;
+	nmk->cpu = sim.host_cpu;
+	return nmk;
+}
+
+static void *
+sim_kthread_body(void *arg)
+{
+	struct nm_kthread *nmk = arg;
+
+	sim_pin(nmk->cpu);
+	for (;;) {
+		sim_event_wait(nmk->kick, &nmk->stop);
+		if (nmk->stop)
+			break;
+		nmk->runs++;
+		nmk->fn(nmk->arg);
+	}
+	return NULL;
+}
+
+int
+nm_os_kthread_start(struct nm_kthread *nmk)
+{
+	nmk->stop = 0;
+	return pthread_create(&nmk->th, NULL, sim_kthread_body, nmk);
+}
+
+void
+nm_os_kthread_stop(struct nm_kthread *nmk)
+{
+	nmk->stop = 1;
+	sim_event_signal(nmk->kick);
+	pthread_join(nmk->th, NULL);
+}
+
+void
+nm_os_kthread_delete(struct nm_kthread *nmk)
+{
+	(free)(nmk);
+}
+
+void
+nm_os_kthread_wakeup_worker(struct nm_kthread *nmk)
+{
+	sim_event_signal(nmk->kick);
+}
+
+void
+nm_os_kthread_send_irq(struct nm_kthread *nmk)
+{
+	sim_event_signal(nmk->irq);
+}
+
+/* packets the wire can take (tx) or has delivered (rx) so far */
+static u_int
+sim_wire_credit(u_int want)
+{
+	uint64_t avail;
+
+	if (sim.rate == 0)
+		return want;
+	avail = (sim_now() - sim.t0) * sim.rate / 1000000000ULL;
+	avail = avail > sim.wire_pkts ? avail - sim.wire_pkts : 0;
+	return avail < want ? (u_int)avail : want;
+}
+
+/* nm_ring_space() from netmap_user.h */
+static inline u_int
+sim_ring_space(struct netmap_ring *ring)
+{
+	int ret = ring->tail - ring->cur;
+
+	if (ret < 0)
+		ret += ring->num_slots;
+	return ret;
+}
+
+static void
+sim_account(uint64_t stamp, uint64_t now)
+{
+	uint64_t lat = now - stamp;
+
+	sim.lat_sum += lat;
+	if (lat > sim.lat_max)
+		sim.lat_max = lat;
+}
+
+/* backend txsync: transmit the slots in [hwcur, rhead) */
+static int
+sim_backend_txsync(struct netmap_kring *kring, int flags)
+{
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int i = kring->nr_hwcur, n;
+	uint64_t now = sim_now();
+
+	(void)flags;
+	n = sim_wire_credit(ptnetmap_moved(i, kring->rhead,
+				kring->nkr_num_slots));
+	sim_work(n, sim.host_cost);
+	sim.wire_pkts += n;
+	sim.pkts += n;
+	for (; n > 0; n--) {
+		sim_account(sim.stamps[i], now);
+		i = nm_next(i, lim);
+	}
+	kring->nr_hwcur = i;
+	kring->nr_hwtail = nm_prev(i, lim);
+	return 0;
+}
+
+/* backend rxsync: release [hwcur, rhead), fill [hwtail, rhead - 1) */
+static int
+sim_backend_rxsync(struct netmap_kring *kring, int flags)
+{
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int i = kring->nr_hwtail, n;
+	uint64_t now = sim_now();
+
+	(void)flags;
+	kring->nr_hwcur = kring->rhead;
+	n = sim_wire_credit(ptnetmap_moved(i, nm_prev(kring->nr_hwcur, lim),
+				kring->nkr_num_slots));
+	sim_work(n, sim.host_cost);
+	sim.wire_pkts += n;
+	for (; n > 0; n--) {
+		sim.ring->slot[i].len = 60;
+		sim.ring->slot[i].flags = 0;
+		sim.stamps[i] = now;
+		i = nm_next(i, lim);
+	}
+	kring->nr_hwtail = i;
+	return 0;
+}
+
+/*
+ * With a finite wire rate, notify the kthread (as netmap_tx_irq() or
+ * netmap_rx_irq() would do) when the backend can make progress.
+ */
+static void *
+sim_wire_body(void *arg)
+{
+	struct netmap_kring *kring = &sim.kring;
+
+	(void)arg;
+	while (!sim.stop) {
+		usleep(sim.intr_us);
+		if (sim_wire_credit(1) == 0)
+			continue;
+		if (sim.tx ? (NM_ACCESS_ONCE(kring->rhead) == kring->nr_hwcur) :
+		    ptnetmap_norxslots(kring, NM_ACCESS_ONCE(kring->rhead)))
+			continue;
+		sim.wire_intrs++;
+		kring->nm_notify(kring, 0);
+	}
+	return NULL;
+}
+
+static void
+sim_guest_tx(void)
+{
+	struct netmap_kring *gk = &sim.gkring;
+	struct netmap_ring *ring = sim.ring;
+	u_int lim = sim.num_slots - 1;
+
+	while (!sim.stop) {
+		u_int space = sim_ring_space(ring), n;
+
+		n = space < sim.batch ? space : sim.batch;
+		if (n) {
+			u_int head = ring->head;
+			uint64_t now = sim_now();
+
+			sim_work(n, sim.guest_cost);
+			for (; n > 0; n--) {
+				ring->slot[head].len = 60;
+				ring->slot[head].flags = 0;
+				sim.stamps[head] = now;
+				head = nm_next(head, lim);
+			}
+			ring->head = ring->cur = head;
+		}
+		/* NIOCTXSYNC */
+		gk->rhead = ring->head;
+		gk->rcur = ring->cur;
+		sim.guest_syncs++;
+		if (netmap_pt_guest_txsync(sim.csb, gk, 0)) {
+			sim.guest_kicks++;
+			sim_event_signal(&sim.kick);
+		}
+		ring->tail = gk->nr_hwtail;
+		if (nm_kr_txempty(gk)) {
+			/* poll() would block */
+			sim.guest_sleeps++;
+			sim_event_wait(&sim.irq, &sim.stop);
+		}
+	}
+}
+
+static void
+sim_guest_rx(void)
+{
+	struct netmap_kring *gk = &sim.gkring;
+	struct netmap_ring *ring = sim.ring;
+	u_int lim = sim.num_slots - 1;
+
+	while (!sim.stop) {
+		u_int avail, n;
+
+		/* NIOCRXSYNC */
+		gk->rhead = ring->head;
+		gk->rcur = ring->cur;
+		sim.guest_syncs++;
+		if (netmap_pt_guest_rxsync(sim.csb, gk, 0)) {
+			sim.guest_kicks++;
+			sim_event_signal(&sim.kick);
+		}
+		ring->tail = gk->nr_hwtail;
+		avail = sim_ring_space(ring);
+		if (avail == 0) {
+			if (nm_kr_rxempty(gk)) {
+				/* poll() would block */
+				sim.guest_sleeps++;
+				sim_event_wait(&sim.irq, &sim.stop);
+			}
+			continue;
+		}
+		n = avail < sim.batch ? avail : sim.batch;
+		{
+			u_int head = ring->head;
+			uint64_t now = sim_now();
+
+			sim.pkts += n;
+			sim_work(n, sim.guest_cost);
+			for (; n > 0; n--) {
+				sim_account(sim.stamps[head], now);
+				head = nm_next(head, lim);
+			}
+			ring->head = ring->cur = head;
+		}
+	}
+}
+
+static void *
+sim_guest_body(void *arg)
+{
+	(void)arg;
+	sim_pin(sim.guest_cpu);
+	if (sim.tx)
+		sim_guest_tx();
+	else
+		sim_guest_rx();
+	return NULL;
+}
+
+static void
+sim_setup(void)
+{
+	struct netmap_kring *kring = &sim.kring, *gk = &sim.gkring;
+	u_int n = sim.num_slots;
+
+	sim.csb = calloc(1, sizeof(*sim.csb));
+	sim.ring = calloc(1, sizeof(*sim.ring) + n * sizeof(struct netmap_slot));
+	sim.stamps = calloc(n, sizeof(*sim.stamps));
+	if (sim.csb == NULL || sim.ring == NULL || sim.stamps == NULL) {
+		D("out of memory");
+		exit(1);
+	}
+	*(uint32_t *)(uintptr_t)&sim.ring->num_slots = n;
+	sim_event_init(&sim.kick);
+	sim_event_init(&sim.irq);
+
+	/* the backend, with a single ring in the simulated direction */
+	sim.parent.num_tx_rings = sim.tx ? 1 : 0;
+	sim.parent.num_rx_rings = sim.tx ? 0 : 1;
+	snprintf(sim.parent.name, sizeof(sim.parent.name), "sim0");
+	sim.pth_na.parent = &sim.parent;
+	sim.pth_na.up.num_tx_rings = sim.parent.num_tx_rings;
+	sim.pth_na.up.num_rx_rings = sim.parent.num_rx_rings;
+	snprintf(sim.pth_na.up.name, sizeof(sim.pth_na.up.name), "sim0-PTN");
+	if (sim.tx)
+		sim.pth_na.up.tx_rings = kring;
+	else
+		sim.pth_na.up.rx_rings = kring;
+
+	kring->ring = sim.ring;
+	kring->na = &sim.parent;
+	kring->nkr_num_slots = n;
+	kring->tx = sim.tx ? NR_TX : NR_RX;
+	kring->nm_sync = sim.tx ? sim_backend_txsync : sim_backend_rxsync;
+	snprintf(kring->name, sizeof(kring->name), "sim0 %s0",
+		sim.tx ? "TX" : "RX");
+	if (sim.tx)
+		kring->nr_hwtail = kring->rtail = n - 1;
+
+	/* the guest view of the same ring */
+	gk->ring = sim.ring;
+	gk->nkr_num_slots = n;
+	gk->tx = kring->tx;
+	gk->nr_hwtail = kring->nr_hwtail;
+	snprintf(gk->name, sizeof(gk->name), "guest %s0",
+		sim.tx ? "TX" : "RX");
+	sim.ring->tail = kring->nr_hwtail;
+}
+
+static void
+sim_report(double secs, struct nm_kthread *kth)
+{
+	struct ptnetmap_stats *st = &ptnet_stats[sim.tx ? NR_TX : NR_RX];
+
+	printf("%s: %llu pkts in %.2f s, %.3f Mpps\n", sim.tx ? "tx" : "rx",
+		(unsigned long long)sim.pkts, secs, sim.pkts / secs / 1e6);
+	printf("latency: avg %llu ns max %llu ns\n",
+		(unsigned long long)(sim.pkts ? sim.lat_sum / sim.pkts : 0),
+		(unsigned long long)sim.lat_max);
+	printf("guest: syncs %lu kicks %lu sleeps %lu irqs %lu\n",
+		sim.guest_syncs, sim.guest_kicks, sim.guest_sleeps,
+		sim.irq.count);
+	printf("host: runs %lu wakeups %lu bwakeups %lu syncs %lu "
+		"(avg batch %.1f) polls %lu sleeps %lu intrs %lu\n",
+		kth->runs, st->wakeups, st->bwakeups,
+		st->syncs, st->syncs ? (double)st->pkts / st->syncs : 0.0,
+		st->polls, st->sleeps, st->intrs);
+	if (sim.rate)
+		printf("wire: %lu interrupts\n", sim.wire_intrs);
+	printf("per packet: %.3f kicks %.3f irqs\n",
+		sim.pkts ? (double)sim.guest_kicks / sim.pkts : 0.0,
+		sim.pkts ? (double)sim.irq.count / sim.pkts : 0.0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	"usage: ptnsim [options]\n"
+	"  -m tx|rx     direction (default tx)\n"
+	"  -n slots     ring size (default 1024)\n"
+	"  -b batch     guest batch (default 32)\n"
+	"  -g ns        guest cost per packet (default 0)\n"
+	"  -h ns        backend cost per packet (default 0)\n"
+	"  -r pps       wire rate (default 0, unlimited)\n"
+	"  -i us        wire interrupt period with -r (default 20)\n"
+	"  -S us        host polling budget, ptnet_spin_max (default %d)\n"
+	"  -B slots     host tx batch cap, ptnet_tx_batch (default %d)\n"
+	"  -d s         duration (default 5)\n"
+	"  -a g,h       pin the guest and the host thread\n",
+	ptnet_spin_max, ptnet_tx_batch);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ptnetmap_cfg *cfg;
+	struct netmap_pt_host_adapter *pth_na = &sim.pth_na;
+	struct ptnetmap_state *ptns;
+	pthread_t guest, wire;
+	uint64_t t1;
+	int ch, error;
+
+	sim.tx = 1;
+	sim.num_slots = 1024;
+	sim.batch = 32;
+	sim.intr_us = 20;
+	sim.duration = 5;
+	sim.guest_cpu = sim.host_cpu = -1;
+
+	while ((ch = getopt(argc, argv, "m:n:b:g:h:r:i:S:B:d:a:")) != -1) {
+		switch (ch) {
+		case 'm':
+			if (!strcmp(optarg, "tx"))
+				sim.tx = 1;
+			else if (!strcmp(optarg, "rx"))
+				sim.tx = 0;
+			else
+				usage();
+			break;
+		case 'n':
+			sim.num_slots = atoi(optarg);
+			break;
+		case 'b':
+			sim.batch = atoi(optarg);
+			break;
+		case 'g':
+			sim.guest_cost = atoi(optarg);
+			break;
+		case 'h':
+			sim.host_cost = atoi(optarg);
+			break;
+		case 'r':
+			sim.rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			sim.intr_us = atoi(optarg);
+			break;
+		case 'S':
+			ptnet_spin_max = atoi(optarg);
+			break;
+		case 'B':
+			ptnet_tx_batch = atoi(optarg);
+			break;
+		case 'd':
+			sim.duration = atoi(optarg);
+			break;
+		case 'a':
+			if (sscanf(optarg, "%d,%d", &sim.guest_cpu,
+					&sim.host_cpu) != 2)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (sim.num_slots < 2 || sim.batch < 1 || sim.duration < 1)
+		usage();
+
+	sim_setup();
+
+	/* what the hypervisor does on NETMAP_PT_HOST_CREATE */
+	cfg = calloc(1, sizeof(*cfg) + sizeof(struct ptnet_ring_cfg));
+	if (cfg == NULL) {
+		D("out of memory");
+		return 1;
+	}
+	cfg->features = PTNETMAP_CFG_FEAT_CSB | PTNETMAP_CFG_FEAT_EVENTFD;
+	cfg->ptrings = sim.csb;
+	cfg->num_rings = 1;
+	cfg->entries[0].ioeventfd = (uintptr_t)&sim.kick;
+	cfg->entries[0].irqfd = (uintptr_t)&sim.irq;
+	error = ptnetmap_create(pth_na, cfg);
+	(free)(cfg);
+	if (error) {
+		D("ptnetmap_create() failed: %d", error);
+		return 1;
+	}
+	ptns = pth_na->ptns;
+	/* the guest driver starts with the interrupts enabled */
+	sim.csb->guest_need_kick = 1;
+
+	sim.t0 = sim_now();
+	error = ptnetmap_start_kthreads(pth_na);
+	if (error) {
+		D("ptnetmap_start_kthreads() failed: %d", error);
+		return 1;
+	}
+	if (sim.rate &&
+	    pthread_create(&wire, NULL, sim_wire_body, NULL)) {
+		D("unable to start the wire thread");
+		return 1;
+	}
+	/*
+	 * A first kick, as the guest driver does when it registers the
+	 * interface: the kthread finds no work and enables the kicks.
+	 */
+	sim_event_signal(&sim.kick);
+	if (pthread_create(&guest, NULL, sim_guest_body, NULL)) {
+		D("unable to start the guest thread");
+		return 1;
+	}
+
+	sleep(sim.duration);
+	sim.stop = 1;
+	pthread_join(guest, NULL);
+	if (sim.rate)
+		pthread_join(wire, NULL);
+	ptnetmap_stop_kthreads(pth_na);
+	t1 = sim_now();
+
+	sim_report((t1 - sim.t0) / 1e9, ptns->kthreads[0]);
+	ptnetmap_delete(pth_na);
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Userspace replacement for the parts of netmap_kern.h, netmap_mem2.h
+ * and bsd_glue.h used by ptnetmap.c, so that ptnsim can compile the
+ * real host and guest sync code.
+ *
+ * Only the fields and functions used by the ptnetmap sync paths are
+ * real. The adapter management code (netmap_get_pt_host_na() and its
+ * callbacks) compiles against stubs that fail, and is never called.
+ */
+
+#ifndef _PTNSIM_GLUE_H_
+#define _PTNSIM_GLUE_H_
+
+/* keep the real headers out */
+#define _NET_NETMAP_KERN_H_
+#define _NET_NETMAP_MEM2_H_
+#define _BSD_GLUE_H
+
+#define WITH_PTNETMAP_HOST
+#define WITH_PTNETMAP_GUEST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <net/if.h>
+#include <net/netmap.h>
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#define mb()		__sync_synchronize()
+#define __user
+
+#define D(_fmt, ...)	fprintf(stderr, "%s [%d] " _fmt "\n",	\
+				__FUNCTION__, __LINE__, ##__VA_ARGS__)
+#define ND(_fmt, ...)	do {} while (0)
+#define RD(lps, _fmt, ...)	do { if (0) D(_fmt, ##__VA_ARGS__); } while (0)
+
+/* CSB accessors, the CSB is plain shared memory here */
+#define get_user(v, p)	({ (v) = NM_ACCESS_ONCE(*(p)); 0; })
+#define put_user(v, p)	({ NM_ACCESS_ONCE(*(p)) = (v); 0; })
+#define copyin(u, k, l)	(memcpy((k), (u), (l)), 0)
+
+#define usleep_range(_1, _2)	usleep(_1)
+
+/* kernel malloc(9)/free(9); the simulator calls (free)(p) directly */
+#define M_DEVBUF	0
+#define M_NOWAIT	0
+#define M_ZERO		0
+#define malloc(_sz, _ty, _fl)	calloc(1, (_sz))
+#define free(_p, _ty)		(free)(_p)
+
+/* sysctls become plain variables */
+#define SYSCTL_DECL(_1)
+#define SYSCTL_INT(_1, _2, _3, _4, _5, _6, _7)
+#define SYSCTL_ULONG(_1, _2, _3, _4, _5, _6, _7)
+#define SYSBEGIN(_1)
+#define SYSEND
+
+#define atomic_add_long(_p, _v)	__atomic_fetch_add((_p), (_v), __ATOMIC_RELAXED)
+
+#define NMG_LOCK()
+#define NMG_UNLOCK()
+
+#define NM_ACCESS_ONCE(x)	(*(volatile __typeof__(x) *)&(x))
+
+extern int netmap_verbose;
+#define NM_VERB_RXSYNC	0x0100
+#define NM_VERB_TXSYNC	0x0200
+
+typedef uint64_t vm_paddr_t;
+
+enum txrx { NR_RX = 0, NR_TX = 1, NR_TXRX };
+#define for_rx_tx(t)	for ((t) = 0; (t) < NR_TXRX; (t)++)
+
+enum {
+	NM_IRQ_PASS = 0,
+	NM_IRQ_COMPLETED = -1,
+};
+
+#define NKR_PENDINTR		0x1
+#define NAF_FORCE_RECLAIM	2
+#define NAF_NETMAP_ON		32
+#define NAF_HOST_RINGS		64
+#define NAF_PTNETMAP_HOST	256
+#define NAF_BUSY		(1U<<31)
+
+struct netmap_adapter;
+struct ifnet;
+
+struct netmap_kring {
+	struct netmap_ring	*ring;
+
+	uint32_t	nr_hwcur;
+	uint32_t	nr_hwtail;
+
+	uint32_t	rhead;
+	uint32_t	rcur;
+	uint32_t	rtail;
+
+	uint32_t	nr_kflags;
+	uint32_t	nkr_num_slots;
+	volatile int	nr_busy;
+
+	struct netmap_adapter *na;
+	int (*nm_sync)(struct netmap_kring *kring, int flags);
+	int (*nm_notify)(struct netmap_kring *kring, int flags);
+	int (*save_notify)(struct netmap_kring *kring, int flags);
+
+	u_int		ring_id;
+	enum txrx	tx;
+	char		name[64];
+};
+
+struct netmap_lut {
+	void	*lut;
+	uint32_t objtotal;
+	uint32_t objsize;
+};
+
+struct netmap_adapter {
+	uint32_t	na_flags;
+	u_int		num_rx_rings;
+	u_int		num_tx_rings;
+	u_int		num_host_rx_rings;
+	u_int		num_host_tx_rings;
+	u_int		num_tx_desc;
+	u_int		num_rx_desc;
+
+	struct netmap_kring	*tx_rings;
+	struct netmap_kring	*rx_rings;
+	void			*tailroom;
+	int			si[NR_TXRX];
+
+	int (*nm_register)(struct netmap_adapter *, int onoff);
+	int (*nm_txsync)(struct netmap_kring *kring, int flags);
+	int (*nm_rxsync)(struct netmap_kring *kring, int flags);
+	int (*nm_notify)(struct netmap_kring *kring, int flags);
+	int (*nm_krings_create)(struct netmap_adapter *);
+	void (*nm_krings_delete)(struct netmap_adapter *);
+	int (*nm_config)(struct netmap_adapter *,
+		u_int *txr, u_int *txd, u_int *rxr, u_int *rxd);
+	void (*nm_dtor)(struct netmap_adapter *);
+
+	void		*nm_mem;
+	struct netmap_lut na_lut;
+	void		*na_private;
+	char		name[64];
+};
+
+struct netmap_pt_host_adapter {
+	struct netmap_adapter up;
+
+	struct netmap_adapter *parent;
+	int (*parent_nm_notify)(struct netmap_kring *kring, int flags);
+	void *ptns;
+};
+
+static inline int
+nm_ptnetmap_host_on(struct netmap_adapter *na)
+{
+	return na && na->na_flags & NAF_PTNETMAP_HOST;
+}
+
+#define NETMAP_OWNED_BY_ANY(na)	((na)->na_flags & NAF_BUSY)
+
+static inline uint32_t
+nm_next(uint32_t i, uint32_t lim)
+{
+	return unlikely (i == lim) ? 0 : i + 1;
+}
+
+static inline uint32_t
+nm_prev(uint32_t i, uint32_t lim)
+{
+	return unlikely (i == 0) ? lim : i - 1;
+}
+
+static inline uint32_t
+nm_kr_rxspace(struct netmap_kring *k)
+{
+	int space = k->nr_hwtail - k->nr_hwcur;
+	if (space < 0)
+		space += k->nkr_num_slots;
+	return space;
+}
+#define nm_kr_txspace(_k) nm_kr_rxspace(_k)
+
+static inline int
+nm_kr_txempty(struct netmap_kring *kring)
+{
+	return kring->rcur == kring->nr_hwtail;
+}
+#define nm_kr_rxempty(_k)	nm_kr_txempty(_k)
+
+static inline int
+nm_kr_tryget(struct netmap_kring *kr, int can_sleep, int *perr)
+{
+	(void)perr;
+	while (__sync_lock_test_and_set(&kr->nr_busy, 1)) {
+		if (!can_sleep)
+			return 1;
+		usleep(1);
+	}
+	return 0;
+}
+
+static inline void
+nm_kr_put(struct netmap_kring *kr)
+{
+	__sync_lock_release(&kr->nr_busy);
+}
+
+/* kthreads, implemented with pthreads in ptnsim.c */
+struct nm_kthread;
+typedef void (*nm_kthread_worker_fn_t)(void *data);
+
+struct nm_kthread_cfg {
+	long				type;
+	struct ptnet_ring_cfg		event;
+	nm_kthread_worker_fn_t		worker_fn;
+	void				*worker_private;
+	int				attach_user;
+};
+struct nm_kthread *nm_os_kthread_create(struct nm_kthread_cfg *cfg);
+int nm_os_kthread_start(struct nm_kthread *);
+void nm_os_kthread_stop(struct nm_kthread *);
+void nm_os_kthread_delete(struct nm_kthread *);
+void nm_os_kthread_wakeup_worker(struct nm_kthread *nmk);
+void nm_os_kthread_send_irq(struct nm_kthread *);
+
+/* adapter management, not simulated */
+#define nm_os_selinfo_init(_si)			do {} while (0)
+#define netmap_update_config(_na)		(EOPNOTSUPP)
+#define netmap_adapter_get(_na)			do {} while (0)
+#define netmap_adapter_put(_na)			do {} while (0)
+#define netmap_attach_common(_na)		(EOPNOTSUPP)
+#define netmap_get_na(_nmr, _na, _ifp, _c)	(EOPNOTSUPP)
+#define if_rele(_ifp)				do {} while (0)
+
+/* guest side prototypes */
+struct ptnet_ring;
+bool netmap_pt_guest_txsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
+			    int flags);
+bool netmap_pt_guest_rxsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
+			    int flags);
+int ptnetmap_ctl(struct nmreq *nmr, struct netmap_adapter *na);
+int netmap_get_pt_host_na(struct nmreq *nmr, struct netmap_adapter **na, int create);
+
+#endif /* _PTNSIM_GLUE_H_ */
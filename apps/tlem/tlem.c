@@ -1385,6 +1385,80 @@ my_random24(void)	/* 24 useful bits */
 	return random() & ((1<<24) - 1);
 }
 
+/*
+ * Some functions take their parameters from a trace file.
+ * The file is a sequence of lines with two fields separated by
+ * blanks or commas; empty lines and text after a '#' are ignored.
+ * load_trace() returns an array with the fields of each line,
+ * or NULL on error. The caller must free() the array after
+ * converting the values.
+ */
+#define TRACE_FIELD	32
+struct _trace_line {
+	char f[2][TRACE_FIELD];
+};
+
+static struct _trace_line *
+load_trace(const char *fname, int *_n)
+{
+	FILE *f;
+	char line[256];
+	struct _trace_line *t = NULL;
+	int n = 0, len = 0, lineno = 0;
+
+	*_n = 0;
+	f = fopen(fname, "r");
+	if (f == NULL) {
+		ED("cannot open %s: %s", fname, strerror(errno));
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *s = strchr(line, '#');
+		char *a, *b, *c, *seps = " \t\r\n,";
+
+		lineno++;
+		if (s)
+			*s = '\0';
+		a = strtok_r(line, seps, &s);
+		if (a == NULL)
+			continue; /* empty line */
+		b = strtok_r(NULL, seps, &s);
+		c = b ? strtok_r(NULL, seps, &s) : NULL;
+		if (b == NULL || c != NULL ||
+		    strlen(a) >= TRACE_FIELD || strlen(b) >= TRACE_FIELD) {
+			ED("%s:%d: need exactly two fields", fname, lineno);
+			goto error;
+		}
+		if (n == len) {
+			void *x;
+
+			len = len ? 2 * len : 64;
+			x = realloc(t, len * sizeof(*t));
+			if (x == NULL) {
+				ED("no memory for %s", fname);
+				goto error;
+			}
+			t = x;
+		}
+		strcpy(t[n].f[0], a);
+		strcpy(t[n].f[1], b);
+		n++;
+	}
+	fclose(f);
+	if (n == 0) {
+		ED("%s: no values", fname);
+		free(t);
+		return NULL;
+	}
+	*_n = n;
+	return t;
+
+error:
+	fclose(f);
+	free(t);
+	return NULL;
+}
+
 
 /*-------------- user-configuration -----------------*/
 
@@ -1462,6 +1536,15 @@ DELAY emulation		-D option_arguments
 			and minimum tmin (corresponds to an exponential
 			distribution with argument 1/(tavg-tmin) )
 
+    empirical,file	empirical distribution read from file.
+			Each line contains a delay and the cumulative
+			probability of delays up to that value, e.g.
+				1ms	0
+				5ms	0.9
+				40ms	1
+			Probabilities must be non decreasing and end at 1.
+			The inverse CDF is tabulated at startup.
+
 
 LOSS emulation		-L option_arguments
 
@@ -1480,6 +1563,13 @@ LOSS emulation		-L option_arguments
     ber,p		uniformly distributed bit error rate p,
 			so actual loss prob. depends on size.
 
+    gilbert,p,r[,h[,k]]	Gilbert-Elliott model. A two-state markov chain
+			moves from the Good to the Bad state with
+			probability p, and back with probability r,
+			on each packet. Packets are lost with probability
+			h (default 1) in the Bad state, and k (default 0)
+			in the Good state. The average burst length is 1/r.
+
 BANDWIDTH emulation	-B option_arguments
 
     Bandwidths are expressed in bits per second, can be followed by a
@@ -1500,6 +1590,14 @@ BANDWIDTH emulation	-B option_arguments
     ether,b		constant bw, including ethernet framing
 			(20 bytes framing + 4 bytes crc)
 
+    trace,file		bandwidth schedule read from file.
+			Each line contains a duration and the bandwidth
+			to use for that interval, e.g.
+				100ms	10G
+				20ms	1G
+			The schedule is repeated cyclically, and
+			q->max_bps is set to the largest value.
+
 #endif /* end of comment block */
 
 /*
@@ -1619,6 +1717,84 @@ exp_delay_run(struct _qs *q, struct _cfg *arg)
 }
 
 
+/*
+ * empirical delay: the file contains points of the cumulative
+ * distribution function (delay, prob). We tabulate the inverse
+ * function at PTS_D_EMP points with linear interpolation, so
+ * the runtime function is the same as for exp_delay_run().
+ */
+static int
+empirical_delay_parse(struct _qs *q, struct _cfg *dst, int ac, char *av[])
+{
+#define	PTS_D_EMP	4096
+	struct _trace_line *tr;
+	uint64_t *t, *x = NULL; /* table of values, delays */
+	double *p = NULL; /* cumulative probabilities */
+	int i, j, n, ret = 1;
+
+	if (strcmp(av[0], "empirical") != 0)
+		return 2; /* not recognised */
+	if (ac != 2)
+		return 1; /* error */
+	tr = load_trace(av[1], &n);
+	if (tr == NULL)
+		return 1; /* error */
+	x = calloc(n, sizeof(*x));
+	p = calloc(n, sizeof(*p));
+	if (x == NULL || p == NULL)
+		goto done;
+	for (i = 0; i < n; i++) {
+		int err;
+
+		x[i] = parse_time(tr[i].f[0]);
+		p[i] = parse_gen(tr[i].f[1], NULL, &err);
+		if (x[i] == U_PARSE_ERR || err || p[i] < 0 || p[i] > 1 ||
+		    (i > 0 && (x[i] < x[i-1] || p[i] < p[i-1]))) {
+			ED("%s: bad entry %d <%s %s>", av[1], i + 1,
+				tr[i].f[0], tr[i].f[1]);
+			goto done;
+		}
+	}
+	if (p[n-1] != 1) {
+		ED("%s: the last probability must be 1", av[1]);
+		goto done;
+	}
+	dst->arg_len = PTS_D_EMP * sizeof(uint64_t);
+	dst->arg = calloc(1, dst->arg_len);
+	if (dst->arg == NULL)
+		goto done; /* no memory */
+	t = (uint64_t *)dst->arg;
+	/* for each point find the first entry with p[j] >= pr */
+	for (i = j = 0; i < PTS_D_EMP; i++) {
+		double pr = (i + 0.5) / PTS_D_EMP;
+
+		while (p[j] < pr)
+			j++;
+		if (j == 0 || p[j] == p[j-1]) {
+			t[i] = x[j];
+		} else {
+			t[i] = x[j-1] + (x[j] - x[j-1]) *
+				(pr - p[j-1]) / (p[j] - p[j-1]);
+		}
+		ND(5, "%d: %lu", i, (_P64)t[i]);
+	}
+	q->max_delay = x[n-1];
+	ret = 0;
+done:
+	free(tr);
+	free(x);
+	free(p);
+	return ret;
+}
+
+static int
+empirical_delay_run(struct _qs *q, struct _cfg *arg)
+{
+	uint64_t *t = (uint64_t *)arg->arg;
+	q->cur_delay = t[my_random24() & (PTS_D_EMP - 1)];
+	return 0;
+}
+
 #define _CFG_END	NULL, 0, {0}
 
 static struct _cfg delay_cfg[] = {
@@ -1628,6 +1804,8 @@ static struct _cfg delay_cfg[] = {
 		"uniform,dmin,dmax # dmin <= dmax", _CFG_END },
 	{ exp_delay_parse, exp_delay_run,
 		"exp,dmin,davg # dmin <= davg", _CFG_END },
+	{ empirical_delay_parse, empirical_delay_run,
+		"empirical,file # lines of delay,cumulative_prob", _CFG_END },
 	{ NULL, NULL, NULL, _CFG_END }
 };
 
@@ -1690,11 +1868,98 @@ ether_bw_run(struct _qs *q, struct _cfg *arg)
 	return 0;
 }
 
+/*
+ * bandwidth schedule from a trace file. Each entry stores the end
+ * time of the interval (relative to the start of the schedule) and
+ * the transmission time per byte, so the runtime function has no
+ * divisions. d[0] is the current entry, d[1] the start time of
+ * the current cycle, d[2] the number of entries, d[3] the period.
+ */
+#define	BW_TT_SHIFT	20	/* fixed point scale for tt per byte */
+struct _bw_sched {
+	uint64_t	end;	/* end of the interval */
+	uint64_t	tt;	/* ns per byte << BW_TT_SHIFT */
+};
+
+static int
+trace_bw_parse(struct _qs *q, struct _cfg *dst, int ac, char *av[])
+{
+	struct _trace_line *tr;
+	struct _bw_sched *s;
+	uint64_t t = 0;
+	int i, n;
+
+	if (strcmp(av[0], "trace") != 0)
+		return 2; /* unrecognised */
+	if (ac != 2)
+		return 1; /* error */
+	tr = load_trace(av[1], &n);
+	if (tr == NULL)
+		return 1; /* error */
+	dst->arg_len = n * sizeof(*s);
+	s = dst->arg = calloc(1, dst->arg_len);
+	if (s == NULL) {
+		free(tr);
+		return 1; /* no memory */
+	}
+	q->max_bps = 0;
+	for (i = 0; i < n; i++) {
+		uint64_t dt = parse_time(tr[i].f[0]);
+		uint64_t bw = parse_bw(tr[i].f[1]);
+
+		if (dt == U_PARSE_ERR || dt == 0 || bw == U_PARSE_ERR ||
+		    bw == 0) {
+			ED("%s: bad entry %d <%s %s>", av[1], i + 1,
+				tr[i].f[0], tr[i].f[1]);
+			free(tr);
+			free(s);
+			dst->arg = NULL;
+			return 1;
+		}
+		t += dt;
+		s[i].end = t;
+		s[i].tt = ((8ULL * TIME_UNITS) << BW_TT_SHIFT) / bw;
+		if (bw > q->max_bps)
+			q->max_bps = bw; /* used to determine queue size */
+	}
+	free(tr);
+	dst->d[2] = n;
+	dst->d[3] = t;
+	return 0;	/* success */
+}
+
+/*
+ * the interval is selected using the queue exit time of the
+ * previous packet, i.e. the time when this one starts transmission.
+ */
+static int
+trace_bw_run(struct _qs *q, struct _cfg *arg)
+{
+	struct _bw_sched *s = arg->arg;
+	uint64_t i = arg->d[0];
+	uint64_t now = q->qt_qout - arg->d[1];
+
+	if (unlikely(now >= arg->d[3])) { /* new cycle, maybe after idle */
+		uint64_t cycles = now / arg->d[3];
+
+		arg->d[1] += cycles * arg->d[3];
+		now -= cycles * arg->d[3];
+		i = 0;
+	}
+	while (now >= s[i].end)
+		i++;
+	arg->d[0] = i;
+	q->cur_tt = (q->cur_len * s[i].tt) >> BW_TT_SHIFT;
+	return 0;
+}
+
 static struct _cfg bw_cfg[] = {
 	{ const_bw_parse, const_bw_run,
 		"constant,bps", _CFG_END },
 	{ ether_bw_parse, ether_bw_run,
 		"ether,bps", _CFG_END },
+	{ trace_bw_parse, trace_bw_run,
+		"trace,file # lines of duration,bps", _CFG_END },
 	{ NULL, NULL, NULL, _CFG_END }
 };
 
@@ -1799,10 +2064,62 @@ const_ber_run(struct _qs *q, struct _cfg *arg)
 	return 0;
 }
 
+/*
+ * Gilbert-Elliott bursty loss. d[0..2] are used as in const_plr
+ * for the nominal loss rate and stats, d[3] is the current state
+ * (0 good, 1 bad), d[4+state] the probability of leaving the state
+ * and d[6+state] the loss probability in the state, all scaled to 2^24.
+ */
+static int
+gilbert_plr_parse(struct _qs *q, struct _cfg *dst, int ac, char *av[])
+{
+	double v[4] = { 0, 0, 1, 0 }; /* p, r, h, k */
+	double pi_bad;
+	int i, err;
+
+	(void)q;
+	if (strcmp(av[0], "gilbert") != 0)
+		return 2; /* unrecognised */
+	if (ac < 3 || ac > 5)
+		return 1; /* error */
+	for (i = 1; i < ac; i++) {
+		v[i-1] = parse_gen(av[i], NULL, &err);
+		if (err || v[i-1] < 0 || v[i-1] > 1)
+			return 1;
+	}
+	if (v[0] + v[1] == 0)
+		return 1; /* no transitions */
+	pi_bad = v[0] / (v[0] + v[1]);	/* steady state prob. of bad */
+	dst->d[0] = (pi_bad * v[2] + (1 - pi_bad) * v[3]) * (1<<24);
+	dst->d[3] = 0; /* start in the good state */
+	dst->d[4] = v[0] * (1<<24);
+	dst->d[5] = v[1] * (1<<24);
+	dst->d[6] = v[3] * (1<<24);
+	dst->d[7] = v[2] * (1<<24);
+	return 0;	/* success */
+}
+
+static int
+gilbert_plr_run(struct _qs *q, struct _cfg *arg)
+{
+	uint64_t st = arg->d[3];
+
+	if (my_random24() < arg->d[4 + st])
+		arg->d[3] = st = st ^ 1;
+	q->cur_drop = my_random24() < arg->d[6 + st];
+#if 1	/* keep stats */
+	arg->d[1]++;
+	arg->d[2] += q->cur_drop;
+#endif
+	return 0;
+}
+
 static struct _cfg loss_cfg[] = {
 	{ const_plr_parse, const_plr_run,
 		"plr,prob # 0 <= prob <= 1", _CFG_END },
 	{ const_ber_parse, const_ber_run,
 		"ber,prob # 0 <= prob <= 1", _CFG_END },
+	{ gilbert_plr_parse, gilbert_plr_run,
+		"gilbert,p,r[,h[,k]] # 0 <= p,r,h,k <= 1", _CFG_END },
 	{ NULL, NULL, NULL, _CFG_END }
 };
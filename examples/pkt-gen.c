@@ -41,6 +41,7 @@
 #include <stdio.h>
 #define NETMAP_WITH_LIBS
 #include <net/netmap_user.h>
+#include <net/netmap_csum.h>
 
 
 #include <ctype.h>	// isprint()
@@ -573,30 +574,16 @@ setaffinity(pthread_t me, int i)
 	return 0;
 }
 
-/* Compute the checksum of the given ip header. */
+/*
+ * Compute the checksum of the given ip header. 'sum' and the return
+ * value are folded, in host byte order.
+ */
 static uint16_t
 checksum(const void *data, uint16_t len, uint32_t sum)
 {
-        const uint8_t *addr = data;
-	uint32_t i;
-
-        /* Checksum all the pairs of bytes first... */
-        for (i = 0; i < (len & ~1U); i += 2) {
-                sum += (u_int16_t)ntohs(*((u_int16_t *)(addr + i)));
-                if (sum > 0xFFFF)
-                        sum -= 0xFFFF;
-        }
-	/*
-	 * If there's a single byte left over, checksum it, too.
-	 * Network byte order is big-endian, so the remaining byte is
-	 * the high byte.
-	 */
-	if (i < len) {
-		sum += addr[i] << 8;
-		if (sum > 0xFFFF)
-			sum -= 0xFFFF;
-	}
-	return sum;
+	sum += ntohs(nm_csum_fold16(nm_csum_partial(data, len)));
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (sum & 0xFFFF) + (sum >> 16);
 }
 
 static u_int16_t
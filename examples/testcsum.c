@@ -7,6 +7,11 @@
  * - the assembly version is uniformly slower
  *
  * In summary the 32-bit version with unrolling is quite fast.
+ *
+ * The nm_* entries are the routines in net/netmap_csum.h, used by the
+ * kernel offloadings and by pkt-gen. Usage:
+ *	testcsum count_M len function [ring_size]	benchmark
+ *	testcsum 0 0 check				regression test
 
 Data on i7-2600
 
@@ -48,6 +53,8 @@ bufs    size    ns/cy
 #include <inttypes.h>
 #include <sys/time.h>
 
+#include <net/netmap_csum.h>
+
 
 volatile uint16_t res;
 
@@ -191,6 +198,50 @@ sum32a(const unsigned char *addr, int count)
 	return REDUCE16(sum);
 }
 
+/*
+ * The routines in net/netmap_csum.h, which are the ones used by the
+ * kernel offloadings and by pkt-gen. The copy variants write to cbuf.
+ */
+#define	MAXLEN 2048
+static unsigned char cbuf[MAXLEN];
+
+uint32_t
+nm_scalar(const unsigned char *addr, int count)
+{
+	return nm_csum_fold16(nm_csum_copy_scalar(addr, NULL, count));
+}
+
+uint32_t
+nm_copy_scalar(const unsigned char *addr, int count)
+{
+	return nm_csum_fold16(nm_csum_copy_scalar(addr, cbuf, count));
+}
+
+uint32_t
+nm_partial(const unsigned char *addr, int count)
+{
+	return nm_csum_fold16(nm_csum_partial(addr, count));
+}
+
+uint32_t
+nm_copy(const unsigned char *addr, int count)
+{
+	return nm_csum_fold16(nm_csum_copy(addr, cbuf, count));
+}
+
+#ifdef NM_CSUM_AVX2
+uint32_t
+nm_avx2(const unsigned char *addr, int count)
+{
+	return nm_csum_fold16(nm_csum_copy_avx2(addr, NULL, count));
+}
+
+uint32_t
+nm_copy_avx2(const unsigned char *addr, int count)
+{
+	return nm_csum_fold16(nm_csum_copy_avx2(addr, cbuf, count));
+}
+#endif /* NM_CSUM_AVX2 */
 
 struct ftab {
 	char *name;
@@ -203,9 +254,72 @@ struct ftab f[] = {
 	{ "sum32", sum32 },
 	{ "sum32u", sum32u },
 	{ "sum32a", sum32a },
+	{ "nm_scalar", nm_scalar },
+	{ "nm_copy_scalar", nm_copy_scalar },
+	{ "nm_partial", nm_partial },
+	{ "nm_copy", nm_copy },
+#ifdef NM_CSUM_AVX2
+	{ "nm_avx2", nm_avx2 },
+	{ "nm_copy_avx2", nm_copy_avx2 },
+#endif /* NM_CSUM_AVX2 */
 	{ NULL, NULL }
 };
 
+/*
+ * Regression test: compare all the functions against sum16 on random
+ * data, for every length up to MAXLEN and a few alignments, and check
+ * that the copy variants reproduce the source. Returns the number of
+ * errors.
+ */
+static int
+check(void)
+{
+	static unsigned char src[MAXLEN + 64];
+	static uint16_t aligned[(MAXLEN + 64) / 2];
+	int i, len, ofs, errors = 0;
+
+	srandom(1);
+	for (i = 0; i < MAXLEN + 64; i++)
+		src[i] = random();
+	for (ofs = 0; ofs < 8; ofs++) {
+		for (len = 0; len <= MAXLEN; len++) {
+			const unsigned char *p = src + ofs;
+			uint32_t ref;
+
+			/* sum16 wants an aligned buffer */
+			memcpy(aligned, p, len);
+			ref = sum16((const unsigned char *)aligned, len);
+			for (i = 1; f[i].name; i++) {
+				/* the old sum* routines want alignment too */
+				const unsigned char *q =
+					strncmp(f[i].name, "sum", 3) ? p :
+					(const unsigned char *)aligned;
+				uint32_t r;
+
+				memset(cbuf, 0, len);
+				r = f[i].fn(q, len);
+				/* 0 and 0xffff are the same in 1's complement */
+				if (r % 0xffff != ref % 0xffff) {
+					if (errors++ < 10)
+						fprintf(stderr, "%s len %d ofs %d: "
+							"%04x, expected %04x\n",
+							f[i].name, len, ofs, r, ref);
+				}
+				if (strstr(f[i].name, "copy") &&
+				    memcmp(cbuf, p, len)) {
+					if (errors++ < 10)
+						fprintf(stderr, "%s len %d ofs %d: "
+							"bad copy\n",
+							f[i].name, len, ofs);
+				}
+			}
+		}
+	}
+	fprintf(stderr, "check %s, %d errors\n",
+		errors ? "FAILED" : "passed", errors);
+	return errors;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -215,11 +329,12 @@ main(int argc, char *argv[])
 	char *fn = argc > 3 ? argv[3] : "sum16";
 	int ring_size = argc > 4 ? atoi(argv[4]) : 0;
 	unsigned char *buf0, *buf;
-#define	MAXLEN 2048
 #define NBUFS	65536	/* 128MB */
 	uint32_t (*fnp)(const unsigned char *, int) = NULL;
 	struct timeval ta, tb;
 
+	if (!strcmp(fn, "check"))
+		return check() ? 1 : 0;
 	if (ring_size < 1 || ring_size > NBUFS)
 		ring_size = 1;
 
@@ -534,9 +534,12 @@ do_if()
 	printf("tx_rings   %u\n", nifp->ni_tx_rings);
 	printf("rx_rings   %u\n", nifp->ni_rx_rings);
 	printf("bufs_head  %u\n", nifp->ni_bufs_head);
-	for (i = 0; i < 5; i++)
+	printf("host_tx_rings %u\n", nifp->ni_host_tx_rings);
+	printf("host_rx_rings %u\n", nifp->ni_host_rx_rings);
+	for (i = 0; i < 3; i++)
 		printf("spare1[%d]  %u\n", i, nifp->ni_spare1[i]);
-	for (i = 0; i < (nifp->ni_tx_rings + nifp->ni_rx_rings + 2); i++)
+	for (i = 0; i < (nifp->ni_tx_rings + nifp->ni_rx_rings +
+			NETMAP_HOST_TX_RINGS(nifp) + NETMAP_HOST_RX_RINGS(nifp)); i++)
 		printf("ring_ofs[%d] %zd\n", i, nifp->ring_ofs[i]);
 }
 
@@ -927,6 +930,9 @@ do_nmr_dump()
 	case NR_REG_PIPE_SLAVE:
 		printf("PIPE_SLAVE(%d)", ringid);
 		break;
+	case NR_REG_ONE_SW:
+		printf("ONE_SW(%d)", ringid);
+		break;
 	default:
 		printf("???");
 		break;
@@ -947,7 +953,8 @@ do_nmr_dump()
 		printf(", PTNETMAP_HOST");
 	}
 	printf("]\n");
-	printf("spare2[0]: %x\n", curr_nmr.spare2[0]);
+	printf("host_tx_rings: %u\n", curr_nmr.nr_host_tx_rings);
+	printf("host_rx_rings: %u\n", curr_nmr.nr_host_rx_rings);
 }
 
 void
@@ -1046,6 +1053,9 @@ do_nmr_flags()
 		} else if (strcmp(arg, "one-nic") == 0) {
 			flags &= ~NR_REG_MASK;
 			flags |= NR_REG_ONE_NIC;
+		} else if (strcmp(arg, "one-sw") == 0) {
+			flags &= ~NR_REG_MASK;
+			flags |= NR_REG_ONE_SW;
 		} else if (strcmp(arg, "pipe-master") == 0) {
 			flags &= ~NR_REG_MASK;
 			flags |= NR_REG_PIPE_MASTER;
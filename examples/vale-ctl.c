@@ -39,6 +39,8 @@
 #include <sys/param.h>
 #include <sys/socket.h>	/* apple needs sockaddr */
 #include <net/if.h>	/* ifreq */
+#include <netinet/in.h>	/* IPPROTO_* */
+#include <arpa/inet.h>	/* inet_pton */
 #include <libgen.h>	/* basename */
 #include <stdlib.h>	/* atoi, free */
 
@@ -55,9 +57,18 @@ void parse_nmr_config(const char* conf, struct nmreq *nmr)
 	if (conf == NULL || ! *conf)
 		return;
 	w = strdup(conf);
-	for (i = 0, tok = strtok(w, ","); tok; i++, tok = strtok(NULL, ",")) {
+	for (i = 0, tok = strtok(w, ","); tok; tok = strtok(NULL, ",")) {
+		/* memory placement for -n, see NETMAP_BDG_NEWIF */
+		if (!strncmp(tok, "node=", 5)) {
+			nmr->nr_arg2 &= ~NETMAP_BDG_NODE_MASK;
+			nmr->nr_arg2 |= (atoi(tok + 5) + 1) & NETMAP_BDG_NODE_MASK;
+			continue;
+		} else if (!strcmp(tok, "huge")) {
+			nmr->nr_arg2 |= NETMAP_BDG_HUGEPAGES;
+			continue;
+		}
 		v = atoi(tok);
-		switch (i) {
+		switch (i++) {
 		case 0:
 			nmr->nr_tx_slots = nmr->nr_rx_slots = v;
 			break;
@@ -75,16 +86,201 @@ void parse_nmr_config(const char* conf, struct nmreq *nmr)
 			break;
 		}
 	}
-	D("txr %d txd %d rxr %d rxd %d",
+	D("txr %d txd %d rxr %d rxd %d node %d%s",
 			nmr->nr_tx_rings, nmr->nr_tx_slots,
-			nmr->nr_rx_rings, nmr->nr_rx_slots);
+			nmr->nr_rx_rings, nmr->nr_rx_slots,
+			(nmr->nr_arg2 & NETMAP_BDG_NODE_MASK) - 1,
+			(nmr->nr_arg2 & NETMAP_BDG_HUGEPAGES) ? " huge" : "");
+	free(w);
+}
+
+/* port name or index to the port index in the bridge */
+static int
+cls_port(int fd, const char *port)
+{
+	struct nmreq nmr;
+	char *end;
+	long v = strtol(port, &end, 10);
+
+	if (*port && *end == '\0')
+		return v;
+	bzero(&nmr, sizeof(nmr));
+	nmr.nr_version = NETMAP_API;
+	nmr.nr_cmd = NETMAP_BDG_LIST;
+	strncpy(nmr.nr_name, port, sizeof(nmr.nr_name) - 1);
+	if (ioctl(fd, NIOCGINFO, &nmr) || nmr.nr_arg2 >= 4095 /* NM_BDG_MAXPORTS */) {
+		D("%s is not a switch port", port);
+		return -1;
+	}
+	return nmr.nr_arg2;
+}
+
+/* a.b.c.d[/len], network byte order */
+static int
+cls_addr(const char *s, uint32_t *addr, uint32_t *mask)
+{
+	char buf[32], *p;
+	int len = 32;
+
+	strncpy(buf, s, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	p = strchr(buf, '/');
+	if (p) {
+		*p++ = '\0';
+		len = atoi(p);
+		if (len < 0 || len > 32)
+			return -1;
+	}
+	if (inet_pton(AF_INET, buf, addr) != 1)
+		return -1;
+	*mask = len ? htonl(0xffffffffu << (32 - len)) : 0;
+	return 0;
+}
+
+/*
+ * Parse a classifier rule, a comma separated list of
+ *	proto=tcp|udp|sctp|icmp|N src=A[/len] dst=A[/len] sport=N dport=N
+ *	prio=N ring=N and one of fwd=port, mirror=port or drop
+ * where port is a port name (e.g. vale0:p1) or index.
+ */
+static int
+parse_cls_rule(int fd, const char *conf, struct nm_cls_rule *r)
+{
+	char *w, *tok, *v;
+	int port, error = 0;
+
+	r->cr_ring = NM_CLS_ANYRING;
+	w = strdup(conf);
+	for (tok = strtok(w, ","); tok && !error; tok = strtok(NULL, ",")) {
+		v = strchr(tok, '=');
+		if (v)
+			*v++ = '\0';
+		if (!strcmp(tok, "drop")) {
+			r->cr_action = NM_CLS_DROP;
+			continue;
+		}
+		if (v == NULL) {
+			error = -1;
+		} else if (!strcmp(tok, "proto")) {
+			if (!strcmp(v, "tcp"))
+				r->cr_proto = IPPROTO_TCP;
+			else if (!strcmp(v, "udp"))
+				r->cr_proto = IPPROTO_UDP;
+			else if (!strcmp(v, "sctp"))
+				r->cr_proto = 132;
+			else if (!strcmp(v, "icmp"))
+				r->cr_proto = IPPROTO_ICMP;
+			else
+				r->cr_proto = atoi(v);
+		} else if (!strcmp(tok, "src")) {
+			error = cls_addr(v, &r->cr_src, &r->cr_src_mask);
+		} else if (!strcmp(tok, "dst")) {
+			error = cls_addr(v, &r->cr_dst, &r->cr_dst_mask);
+		} else if (!strcmp(tok, "sport")) {
+			r->cr_sport = htons(atoi(v));
+		} else if (!strcmp(tok, "dport")) {
+			r->cr_dport = htons(atoi(v));
+		} else if (!strcmp(tok, "prio")) {
+			r->cr_prio = atoi(v);
+		} else if (!strcmp(tok, "ring")) {
+			r->cr_ring = atoi(v);
+		} else if (!strcmp(tok, "fwd") || !strcmp(tok, "mirror")) {
+			r->cr_action = tok[0] == 'f' ? NM_CLS_FWD : NM_CLS_MIRROR;
+			port = cls_port(fd, v);
+			if (port < 0)
+				error = -1;
+			else
+				r->cr_port = port;
+		} else {
+			error = -1;
+		}
+		if (error)
+			D("invalid rule element %s%s%s", tok, v ? "=" : "",
+			    v ? v : "");
+	}
+	free(w);
+	if (!error && r->cr_action == 0) {
+		D("missing action (fwd, mirror or drop)");
+		error = -1;
+	}
+	return error;
+}
+
+static int
+cls_plen(uint32_t mask)
+{
+	int n;
+
+	for (mask = ntohl(mask), n = 0; mask & 0x80000000u; mask <<= 1)
+		n++;
+	return n;
+}
+
+static void
+print_cls_rule(const struct nm_cls_rule *r)
+{
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN], ring[16];
+	static const char *actions[] = { "?", "fwd", "drop", "mirror" };
+
+	inet_ntop(AF_INET, &r->cr_src, src, sizeof(src));
+	inet_ntop(AF_INET, &r->cr_dst, dst, sizeof(dst));
+	if (r->cr_ring == NM_CLS_ANYRING)
+		strcpy(ring, "any");
+	else
+		snprintf(ring, sizeof(ring), "%d", r->cr_ring);
+	D("rule %d prio %d proto %d %s/%d:%d -> %s/%d:%d %s port %d ring %s"
+	    " hits %" PRIu64, r->cr_id, r->cr_prio, r->cr_proto,
+	    src, cls_plen(r->cr_src_mask), ntohs(r->cr_sport),
+	    dst, cls_plen(r->cr_dst_mask), ntohs(r->cr_dport),
+	    actions[r->cr_action <= NM_CLS_MIRROR ? r->cr_action : 0],
+	    r->cr_port, ring, r->cr_hits);
+}
+
+/*
+ * Parse port traffic settings, a comma separated list of
+ *	class=N in=kbit/s in_burst=bytes out=kbit/s out_burst=bytes
+ */
+static int
+parse_qos(const char *conf, struct nm_qos_req *q)
+{
+	char *w, *tok, *v;
+	int error = 0;
+
+	w = strdup(conf);
+	for (tok = strtok(w, ","); tok && !error; tok = strtok(NULL, ",")) {
+		v = strchr(tok, '=');
+		if (v == NULL) {
+			error = -1;
+			D("invalid setting %s", tok);
+			break;
+		}
+		*v++ = '\0';
+		if (!strcmp(tok, "class"))
+			q->qr_class = atoi(v);
+		else if (!strcmp(tok, "in"))
+			q->qr_in_rate = strtoul(v, NULL, 0);
+		else if (!strcmp(tok, "in_burst"))
+			q->qr_in_burst = strtoul(v, NULL, 0);
+		else if (!strcmp(tok, "out"))
+			q->qr_out_rate = strtoul(v, NULL, 0);
+		else if (!strcmp(tok, "out_burst"))
+			q->qr_out_burst = strtoul(v, NULL, 0);
+		else {
+			error = -1;
+			D("invalid setting %s=%s", tok, v);
+		}
+	}
 	free(w);
+	return error;
 }
 
 static int
 bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 {
 	struct nmreq nmr;
+	struct nm_cls_rule rule;
+	struct nm_qos_req qos;
+	uintptr_t req_ptr;
 	int error = 0;
 	int fd = open("/dev/netmap", O_RDWR);
 
@@ -98,7 +294,10 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 	if (name != NULL) /* might be NULL */
 		strncpy(nmr.nr_name, name, sizeof(nmr.nr_name));
 	nmr.nr_cmd = nr_cmd;
-	parse_nmr_config(nmr_config, &nmr);
+	if (nr_cmd != NETMAP_BDG_CLS && nr_cmd != NETMAP_BDG_QOS)
+		parse_nmr_config(nmr_config, &nmr);
+	if (nr_cmd != NETMAP_BDG_NEWIF)
+		nmr.nr_arg2 = 0;
 
 	switch (nr_cmd) {
 	case NETMAP_BDG_DELIF:
@@ -181,6 +380,66 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 				"couldn't start" : "couldn't stop", error);
 		break;
 
+	case NETMAP_BDG_CLS:
+		/* nr_arg is NM_CLS_ADD (-F) or NM_CLS_DEL (-f). Without
+		 * a rule or rule id they list or flush the rules instead.
+		 */
+		bzero(&rule, sizeof(rule));
+		req_ptr = (uintptr_t)&rule;
+		/* the address goes in nr_arg1..nr_arg3 */
+		memcpy(&nmr.nr_arg1, &req_ptr, sizeof(req_ptr));
+		if (nmr_config == NULL && nr_arg == NM_CLS_ADD) {
+			rule.cr_op = NM_CLS_GET;
+			for (; !ioctl(fd, NIOCREGIF, &nmr); rule.cr_id++)
+				print_cls_rule(&rule);
+			break;
+		}
+		if (nmr_config == NULL) {
+			rule.cr_op = NM_CLS_FLUSH;
+		} else if (nr_arg == NM_CLS_DEL) {
+			rule.cr_op = NM_CLS_DEL;
+			rule.cr_id = atoi(nmr_config);
+		} else {
+			rule.cr_op = NM_CLS_ADD;
+			if (parse_cls_rule(fd, nmr_config, &rule)) {
+				error = -1;
+				break;
+			}
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error)
+			perror(name);
+		else if (rule.cr_op == NM_CLS_ADD)
+			D("%s: added rule %d", name, rule.cr_id);
+		break;
+
+	case NETMAP_BDG_QOS:
+		/* read the current settings, change the ones in -C */
+		bzero(&qos, sizeof(qos));
+		qos.qr_op = NM_QOS_GET;
+		req_ptr = (uintptr_t)&qos;
+		memcpy(&nmr.nr_arg1, &req_ptr, sizeof(req_ptr));
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (!error && nmr_config) {
+			if (parse_qos(nmr_config, &qos)) {
+				error = -1;
+				break;
+			}
+			qos.qr_op = NM_QOS_SET;
+			error = ioctl(fd, NIOCREGIF, &nmr);
+		}
+		if (error)
+			perror(name);
+		else if (nmr_config == NULL)
+			D("%s: class %d in %u kbit/s (burst %u) out %u kbit/s"
+			    " (burst %u) drops: in %" PRIu64 " out %" PRIu64
+			    " class %" PRIu64, name, qos.qr_class,
+			    qos.qr_in_rate, qos.qr_in_burst,
+			    qos.qr_out_rate, qos.qr_out_burst,
+			    qos.qr_in_drops, qos.qr_out_drops,
+			    qos.qr_class_drops);
+		break;
+
 	default: /* GINFO */
 		nmr.nr_cmd = nmr.nr_arg1 = nmr.nr_arg2 = 0;
 		error = ioctl(fd, NIOCGINFO, &nmr);
@@ -214,17 +473,28 @@ usage:
 			"\t-n interface	interface name to be created\n"
 			"\t-r interface	interface name to be deleted\n"
 			"\t-l list all or specified bridge's interfaces (default)\n"
-			"\t-C string ring/slot setting of an interface creating by -n\n"
+			"\t-C string ring/slot setting of an interface creating by -n,\n"
+			"\t\t optionally followed by node=N and huge to allocate its\n"
+			"\t\t memory on NUMA node N and in huge pages\n"
 			"\t-p interface start polling. Additional -C x,y,z configures\n"
 			"\t\t x: 0 (REG_ALL_NIC) or 1 (REG_ONE_NIC),\n"
 			"\t\t y: CPU core id for ALL_NIC and core/ring for ONE_NIC\n"
 			"\t\t z: (ONE_NIC only) num of total cores/rings\n"
 			"\t-P interface stop polling\n"
+			"\t-F bridge add the classifier rule given with -C,\n"
+			"\t\t or list the rules. A rule is a comma separated list of\n"
+			"\t\t proto=P,src=A/len,dst=A/len,sport=N,dport=N,prio=N,\n"
+			"\t\t ring=N and one of fwd=port, mirror=port, drop\n"
+			"\t-f bridge delete the classifier rule whose id is given\n"
+			"\t\t with -C, or all the rules\n"
+			"\t-q interface show the rate limits, class and drop counters\n"
+			"\t\t of a port, or change them with -C class=N,in=kbit/s,\n"
+			"\t\t in_burst=bytes,out=kbit/s,out_burst=bytes\n"
 			"", command);
 		return 0;
 	}
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:F:f:q:")) != -1) {
 		if (ch != 'C')
 			name = optarg; /* default */
 		switch (ch) {
@@ -264,6 +534,17 @@ usage:
 		case 'P':
 			nr_cmd = NETMAP_BDG_POLLING_OFF;
 			break;
+		case 'F':
+			nr_cmd = NETMAP_BDG_CLS;
+			nr_arg = NM_CLS_ADD;
+			break;
+		case 'f':
+			nr_cmd = NETMAP_BDG_CLS;
+			nr_arg = NM_CLS_DEL;
+			break;
+		case 'q':
+			nr_cmd = NETMAP_BDG_QOS;
+			break;
 		}
 	}
 	if (optind != argc) {
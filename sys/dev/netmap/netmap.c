@@ -483,6 +483,31 @@ int netmap_adaptive_io = 0;
 int netmap_flags = 0;	/* debug flags */
 static int netmap_fwd = 0;	/* force transparent mode */
 
+/*
+ * Statistics for the packets that the host stack sends to the
+ * host rx rings: packets queued and dropped by netmap_transmit(),
+ * wakeups of the consumer and rxsyncs that imported some packets.
+ * pkts/wakeups is the average number of packets per wakeup.
+ * They are not atomic, so they are only approximate if there
+ * are multiple host rings. Write 0 to reset them.
+ */
+static u_long netmap_host_pkts;
+static u_long netmap_host_drops;
+static u_long netmap_host_wakeups;
+static u_long netmap_host_batches;
+
+/*
+ * Statistics for transparent mode: packets passed from the NIC rx
+ * rings to the host stack (up), and from the host rx rings to the
+ * NIC tx rings (down), packets dropped on the way, and txsyncs
+ * issued by netmap_sw_to_nic().
+ */
+static u_long netmap_fwd_up_pkts;
+static u_long netmap_fwd_up_drops;
+static u_long netmap_fwd_down_pkts;
+static u_long netmap_fwd_down_drops;
+static u_long netmap_fwd_down_kicks;
+
 /*
  * netmap_admode selects the netmap mode to use.
  * Invalid values are reset to NETMAP_ADMODE_BEST
@@ -543,6 +568,15 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit,
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW, &netmap_generic_ringsize, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW, &netmap_generic_rings, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txqdisc, CTLFLAG_RW, &netmap_generic_txqdisc, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, host_pkts, CTLFLAG_RW, &netmap_host_pkts, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, host_drops, CTLFLAG_RW, &netmap_host_drops, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, host_wakeups, CTLFLAG_RW, &netmap_host_wakeups, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, host_batches, CTLFLAG_RW, &netmap_host_batches, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, fwd_up_pkts, CTLFLAG_RW, &netmap_fwd_up_pkts, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, fwd_up_drops, CTLFLAG_RW, &netmap_fwd_up_drops, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, fwd_down_pkts, CTLFLAG_RW, &netmap_fwd_down_pkts, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, fwd_down_drops, CTLFLAG_RW, &netmap_fwd_down_drops, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, fwd_down_kicks, CTLFLAG_RW, &netmap_fwd_down_kicks, 0 , "");
 
 SYSEND;
 
@@ -747,6 +781,29 @@ netmap_update_config(struct netmap_adapter *na)
 	return 1;
 }
 
+/*
+ * The first NIOCREGIF on a NIC may choose the number of host rings,
+ * 0 means one. Other adapters take the host rings of their parent.
+ */
+/* call with NMG_LOCK held */
+static void
+netmap_set_host_rings(struct netmap_adapter *na, struct nmreq *nmr)
+{
+	enum txrx t;
+
+	if (na->active_fds > 0 || na->tx_rings != NULL ||
+	    !(na->na_flags & NAF_HOST_RINGS) ||
+	    na->ifp == NULL || NA(na->ifp) != na)
+		return;
+	for_rx_tx(t) {
+		u_int n = (t == NR_TX ? nmr->nr_host_tx_rings :
+				nmr->nr_host_rx_rings);
+
+		nm_bound_var(&n, 1, 1, NM_HOST_MAXRINGS, NULL);
+		nma_set_host_nrings(na, t, n);
+	}
+}
+
 /* nm_sync callbacks for the host rings */
 static int netmap_txsync_to_host(struct netmap_kring *kring, int flags);
 static int netmap_rxsync_from_host(struct netmap_kring *kring, int flags);
@@ -759,20 +816,20 @@ static int netmap_rxsync_from_host(struct netmap_kring *kring, int flags);
  *                    |          |  } na->num_tx_ring
  *                    |          | /
  *                    +----------+
- *                    |          |    host tx kring
+ *                    |          |    host tx krings (na->num_host_tx_rings)
  * na->rx_rings ----> +----------+
  *                    |          | \
  *                    |          |  } na->num_rx_rings
  *                    |          | /
  *                    +----------+
- *                    |          |    host rx kring
+ *                    |          |    host rx krings (na->num_host_rx_rings)
  *                    +----------+
  * na->tailroom ----->|          | \
  *                    |          |  } tailroom bytes
  *                    |          | /
  *                    +----------+
  *
- * Note: for compatibility, host krings are created even when not needed.
+ * Note: for compatibility, one host kring is created even when not needed.
  * The tailroom space is currently used by vale ports for allocating leases.
  */
 /* call with NMG_LOCK held */
@@ -785,8 +842,8 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 	enum txrx t;
 
 	/* account for the (possibly fake) host rings */
-	n[NR_TX] = na->num_tx_rings + 1;
-	n[NR_RX] = na->num_rx_rings + 1;
+	n[NR_TX] = netmap_all_rings(na, NR_TX);
+	n[NR_RX] = netmap_all_rings(na, NR_RX);
 
 	len = (n[NR_TX] + n[NR_RX]) * sizeof(struct netmap_kring) + tailroom;
 
@@ -871,11 +928,15 @@ netmap_krings_delete(struct netmap_adapter *na)
 void
 netmap_hw_krings_delete(struct netmap_adapter *na)
 {
-	struct mbq *q = &na->rx_rings[na->num_rx_rings].rx_queue;
+	u_int i;
+
+	for (i = na->num_rx_rings; i < netmap_all_rings(na, NR_RX); i++) {
+		struct mbq *q = &na->rx_rings[i].rx_queue;
 
-	ND("destroy sw mbq with len %d", mbq_len(q));
-	mbq_purge(q);
-	mbq_safe_fini(q);
+		ND("destroy sw mbq with len %d", mbq_len(q));
+		mbq_purge(q);
+		mbq_safe_fini(q);
+	}
 	netmap_krings_delete(na);
 }
 
@@ -939,7 +1000,9 @@ netmap_do_unregif(struct netmap_priv_d *priv)
 
 	/* possibily decrement counter of tx_si/rx_si users */
 	netmap_unset_ringid(priv);
-	/* delete the nifp */
+	/* release the extra buffers and delete the nifp */
+	if (priv->np_nifp != NULL)
+		netmap_extra_free_all(priv);
 	netmap_mem_if_delete(na, priv->np_nifp);
 	/* drop the allocator */
 	netmap_mem_deref(na->nm_mem, na);
@@ -1060,14 +1123,16 @@ netmap_send_up(struct ifnet *dst, struct mbq *q)
  * Take packets from hwcur to ring->head marked NS_FORWARD (or forced)
  * and pass them up. Drop remaining packets in the unlikely event
  * of an mbuf shortage.
+ * Returns the number of dropped packets.
  */
-static void
+static u_int
 netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 {
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
-	u_int n;
+	u_int n, drops = 0;
 	struct netmap_adapter *na = kring->na;
+	int nomem = 0;
 
 	for (n = kring->nr_hwcur; n != head; n = nm_next(n, lim)) {
 		struct mbuf *m;
@@ -1075,18 +1140,45 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 
 		if ((slot->flags & NS_FORWARD) == 0 && !force)
 			continue;
-		if (slot->len < 14 || slot->len > NETMAP_BUF_SIZE(na)) {
+		if (nomem || slot->len < 14 || slot->len > NETMAP_BUF_SIZE(na)) {
 			RD(5, "bad pkt at %d len %d", n, slot->len);
+			drops++;
 			continue;
 		}
 		slot->flags &= ~NS_FORWARD; // XXX needed ?
 		/* XXX TODO: adapt to the case of a multisegment packet */
 		m = m_devget(NMB(na, slot), slot->len, 0, na->ifp, NULL);
 
-		if (m == NULL)
-			break;
+		if (m == NULL) {
+			nomem = 1;
+			drops++;
+			continue;
+		}
 		mbq_enqueue(q, m);
 	}
+	return drops;
+}
+
+/*
+ * Transparent mode, NIC to host: pass up the packets collected
+ * by netmap_grab_packets() on the NIC rx rings, as a single chain.
+ * The host tx ring is used as a lock against netmap_txsync_to_host().
+ */
+static void
+netmap_fwd_up(struct netmap_adapter *na, struct mbq *q, int *perr)
+{
+	struct netmap_kring *kring = &na->tx_rings[na->num_tx_rings];
+
+	if (mbq_len(q) == 0)
+		return;
+	if (nm_kr_tryget(kring, 1, perr)) {
+		netmap_fwd_up_drops += mbq_len(q);
+		mbq_purge(q);
+		return;
+	}
+	netmap_fwd_up_pkts += mbq_len(q);
+	netmap_send_up(na->ifp, q);
+	nm_kr_put(kring);
 }
 
 static inline int
@@ -1101,65 +1193,170 @@ static inline int
 nm_may_forward_up(struct netmap_kring *kring)
 {
 	return	_nm_may_forward(kring) &&
-		 kring->ring_id != kring->na->num_rx_rings;
+		 !nm_kring_is_host(kring);
 }
 
 static inline int
 nm_may_forward_down(struct netmap_kring *kring)
 {
 	return	_nm_may_forward(kring) &&
-		 kring->ring_id == kring->na->num_rx_rings;
+		 nm_kring_is_host(kring);
 }
 
 /*
- * Send to the NIC rings packets marked NS_FORWARD between
- * kring->nr_hwcur and kring->rhead
- * Called under kring->rx_queue.lock on the sw rx ring,
+ * Hash of the flow of an ethernet frame, used in transparent mode
+ * to pick the NIC tx ring. It is symmetric, so both directions of
+ * a connection map to the same ring. We use the IPv4/IPv6 addresses,
+ * and the TCP/UDP/SCTP ports when they are in the frame (first
+ * fragment, no IPv6 extension headers), otherwise the MAC addresses.
+ */
+static uint32_t
+nm_fwd_hash(const uint8_t *buf, u_int len)
+{
+	uint32_t h = 0, w;
+	uint16_t etype, sport, dport;
+	u_int l3 = 14, l4 = 0, i;
+	uint8_t proto = 0;
+
+	if (len < 14)
+		return 0;
+	etype = (buf[12] << 8) | buf[13];
+	if (etype == 0x8100 && len >= 18) {
+		etype = (buf[16] << 8) | buf[17];
+		l3 = 18;
+	}
+	if (etype == 0x0800 && len >= l3 + 20 && (buf[l3] >> 4) == 4) {
+		memcpy(&w, buf + l3 + 12, 4);
+		h = w;
+		memcpy(&w, buf + l3 + 16, 4);
+		h ^= w;
+		proto = buf[l3 + 9];
+		/* ports only if not a fragment (MF clear, offset 0), so
+		 * all the fragments of a datagram get the same hash */
+		if ((buf[l3 + 6] & 0x3f) == 0 && buf[l3 + 7] == 0)
+			l4 = l3 + ((buf[l3] & 0xf) << 2);
+	} else if (etype == 0x86dd && len >= l3 + 40) {
+		for (i = 8; i < 40; i += 4) {
+			memcpy(&w, buf + l3 + i, 4);
+			h ^= w;
+		}
+		proto = buf[l3 + 6];
+		l4 = l3 + 40;
+	} else {
+		for (i = 0; i < 6; i++)
+			h ^= (uint32_t)(buf[i] ^ buf[6 + i]) << ((i & 3) * 8);
+	}
+	if (l4 && (proto == 6 || proto == 17 || proto == 132) &&
+	    len >= l4 + 4) {
+		memcpy(&sport, buf + l4, 2);
+		memcpy(&dport, buf + l4 + 2, 2);
+		h ^= (uint32_t)(sport ^ dport) << 8;
+	}
+	h ^= proto;
+	h *= 0x9e3779b1;
+	return h ^ (h >> 16);
+}
+
+static inline void nm_sync_finalize(struct netmap_kring *);
+
+/*
+ * Run a txsync on a NIC tx ring filled by netmap_sw_to_nic(),
+ * as the poll handler would do. Returns non zero if the ring
+ * is in use (the owner will push the packets) or stopped.
+ */
+static int
+netmap_fwd_txsync(struct netmap_kring *kring)
+{
+	struct netmap_ring *ring = kring->ring;
+
+	if (nm_kr_tryget(kring, 0, NULL))
+		return EBUSY;
+	if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+		netmap_ring_reinit(kring);
+	} else if (kring->nm_sync(kring, 0) == 0) {
+		nm_sync_finalize(kring);
+	}
+	nm_kr_put(kring);
+	netmap_fwd_down_kicks++;
+	return 0;
+}
+
+/*
+ * Transparent mode, host to NIC: send to the NIC rings packets
+ * marked NS_FORWARD between kring->nr_hwcur and kring->rhead.
+ * The buffers are swapped with the free ones of the tx ring picked
+ * by nm_fwd_hash(), so the packets of a flow stay in order.
+ * A full tx ring is txsync'ed once to reclaim completed slots,
+ * then the packet is dropped. At the end we txsync all the rings
+ * we have used, so the packets go out right away.
+ * Returns the number of packets left in rings that we could not
+ * sync, which the caller must push with a txsync.
  */
 static u_int
-netmap_sw_to_nic(struct netmap_adapter *na)
+netmap_sw_to_nic(struct netmap_kring *kring)
 {
-	struct netmap_kring *kring = &na->rx_rings[na->num_rx_rings];
+	struct netmap_adapter *na = kring->na;
 	struct netmap_slot *rxslot = kring->ring->slot;
 	u_int i, rxcur = kring->nr_hwcur;
 	u_int const head = kring->rhead;
 	u_int const src_lim = kring->nkr_num_slots - 1;
-	u_int sent = 0;
-
-	/* scan rings to find space, then fill as much as possible */
-	for (i = 0; i < na->num_tx_rings; i++) {
-		struct netmap_kring *kdst = &na->tx_rings[i];
-		struct netmap_ring *rdst = kdst->ring;
-		u_int const dst_lim = kdst->nkr_num_slots - 1;
-
+	u_int const nrings = na->num_tx_rings;
+	u_int sent = 0, left = 0;
+	uint64_t used = 0; /* rings with new packets, modulo 64 */
+
+	for (; rxcur != head; rxcur = nm_next(rxcur, src_lim)) {
+		struct netmap_slot *src, *dst, tmp;
+		struct netmap_kring *kdst;
+		struct netmap_ring *rdst;
+		u_int dst_head;
+
+		src = &rxslot[rxcur];
+		if ((src->flags & NS_FORWARD) == 0 && !netmap_fwd)
+			continue;
+		if (src->len < 14 || src->len > NETMAP_BUF_SIZE(na)) {
+			RD(5, "bad pkt at %d len %d", rxcur, src->len);
+			netmap_fwd_down_drops++;
+			continue;
+		}
+		i = nrings > 1 ? nm_fwd_hash(NMB(na, src), src->len) % nrings : 0;
+		kdst = &na->tx_rings[i];
+		rdst = kdst->ring;
 		/* XXX do we trust ring or kring->rcur,rtail ? */
-		for (; rxcur != head && !nm_ring_empty(rdst);
-		     rxcur = nm_next(rxcur, src_lim) ) {
-			struct netmap_slot *src, *dst, tmp;
-			u_int dst_head = rdst->head;
+		if (nm_ring_empty(rdst) &&
+		    (netmap_fwd_txsync(kdst) || nm_ring_empty(rdst))) {
+			netmap_fwd_down_drops++;
+			continue;
+		}
+		used |= (uint64_t)1 << (i & 63);
+		sent++;
 
-			src = &rxslot[rxcur];
-			if ((src->flags & NS_FORWARD) == 0 && !netmap_fwd)
-				continue;
+		dst_head = rdst->head;
+		dst = &rdst->slot[dst_head];
 
-			sent++;
+		tmp = *src;
 
-			dst = &rdst->slot[dst_head];
+		src->buf_idx = dst->buf_idx;
+		src->flags = NS_BUF_CHANGED;
 
-			tmp = *src;
+		dst->buf_idx = tmp.buf_idx;
+		dst->len = tmp.len;
+		dst->flags = NS_BUF_CHANGED;
 
-			src->buf_idx = dst->buf_idx;
-			src->flags = NS_BUF_CHANGED;
+		rdst->head = rdst->cur = nm_next(dst_head, kdst->nkr_num_slots - 1);
+	}
+	netmap_fwd_down_pkts += sent;
 
-			dst->buf_idx = tmp.buf_idx;
-			dst->len = tmp.len;
-			dst->flags = NS_BUF_CHANGED;
+	/* push the packets out now, rather than on the next txsync */
+	for (i = 0; used && i < nrings; i++) {
+		struct netmap_kring *kdst = &na->tx_rings[i];
 
-			rdst->head = rdst->cur = nm_next(dst_head, dst_lim);
-		}
-		/* if (sent) XXX txsync ? */
+		if (!(used & ((uint64_t)1 << (i & 63))))
+			continue;
+		if (kdst->ring->head != kdst->nr_hwcur &&
+		    netmap_fwd_txsync(kdst))
+			left++;
 	}
-	return sent;
+	return left;
 }
 
 
@@ -1198,7 +1395,14 @@ netmap_txsync_to_host(struct netmap_kring *kring, int flags)
 /*
  * rxsync backend for packets coming from the host stack.
  * They have been put in kring->rx_queue by netmap_transmit().
- * We protect access to the kring using kring->rx_queue.lock
+ * We protect access to the queue and to hwtail using
+ * kring->rx_queue.lock
+ *
+ * The packets that fit in the ring are detached from the queue
+ * in one go, and copied into the slots after releasing the lock,
+ * so that netmap_transmit() is not held up by the copies.
+ * This is safe because the new slots are only exposed to
+ * userspace when we return.
  *
  * This routine also does the selrecord if called from the poll handler
  * (we know because sr != NULL).
@@ -1216,43 +1420,61 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 	u_int const head = kring->rhead;
 	int ret = 0;
 	struct mbq *q = &kring->rx_queue, fq;
+	struct mbuf *m;
 
-	mbq_init(&fq); /* fq holds packets to be freed */
+	mbq_init(&fq); /* fq holds packets to be copied, then freed */
 
 	mbq_lock(q);
 
 	/* First part: import newly received packets */
+	nm_i = kring->nr_hwtail;
 	n = mbq_len(q);
 	if (n) { /* grab packets from the queue */
-		struct mbuf *m;
-		uint32_t stop_i;
-
-		nm_i = kring->nr_hwtail;
-		stop_i = nm_prev(nm_i, lim);
-		while ( nm_i != stop_i && (m = mbq_dequeue(q)) != NULL ) {
-			int len = MBUF_LEN(m);
-			struct netmap_slot *slot = &ring->slot[nm_i];
-
-			m_copydata(m, 0, len, NMB(na, slot));
-			ND("nm %d len %d", nm_i, len);
-			if (netmap_verbose)
-                                D("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
-
-			slot->len = len;
-			slot->flags = kring->nkr_slot_flags;
-			nm_i = nm_next(nm_i, lim);
-			mbq_enqueue(&fq, m);
-		}
-		kring->nr_hwtail = nm_i;
+		/* free slots, up to the one before hwcur */
+		u_int space = kring->nr_hwcur + lim - nm_i;
+
+		if (space > lim)
+			space -= kring->nkr_num_slots;
+		if (n > space)
+			n = space;
+		mbq_dequeue_batch(q, &fq, n);
+		kring->nr_hwtail = nm_i + n;
+		if (kring->nr_hwtail > lim)
+			kring->nr_hwtail -= kring->nkr_num_slots;
+		if (n)
+			netmap_host_batches++;
 	}
 
+	mbq_unlock(q);
+
+	/* now fill the slots from the old hwtail onwards */
+	while ((m = mbq_dequeue(&fq)) != NULL) {
+		int len = MBUF_LEN(m);
+		struct netmap_slot *slot = &ring->slot[nm_i];
+
+		if (mbq_peek(&fq))
+			__builtin_prefetch(mbq_peek(&fq));
+		m_copydata(m, 0, len, NMB(na, slot));
+		ND("nm %d len %d", nm_i, len);
+		if (netmap_verbose)
+                        D("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
+
+		slot->len = len;
+		slot->flags = kring->nkr_slot_flags;
+		nm_i = nm_next(nm_i, lim);
+		m_freem(m);
+	}
+	mbq_fini(&fq);
+
 	/*
 	 * Second part: skip past packets that userspace has released.
+	 * This is also done without the lock, as netmap_sw_to_nic() may
+	 * call the NIC txsync; netmap_transmit() reads hwcur only to
+	 * estimate the free space, and a stale value is conservative.
 	 */
-	nm_i = kring->nr_hwcur;
-	if (nm_i != head) { /* something was released */
+	if (kring->nr_hwcur != head) { /* something was released */
 		if (nm_may_forward_down(kring)) {
-			ret = netmap_sw_to_nic(na);
+			ret = netmap_sw_to_nic(kring);
 			if (ret > 0) {
 				kring->nr_kflags |= NR_FORWARD;
 				ret = 0;
@@ -1261,11 +1483,6 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 		kring->nr_hwcur = head;
 	}
 
-	mbq_unlock(q);
-
-	mbq_purge(&fq);
-	mbq_fini(&fq);
-
 	return ret;
 }
 
@@ -1710,11 +1927,30 @@ netmap_interp_ringid(struct netmap_priv_d *priv, uint16_t ringid, uint32_t flags
 			}
 			priv->np_qfirst[t] = (reg == NR_REG_SW ?
 				nma_get_nrings(na, t) : 0);
-			priv->np_qlast[t] = nma_get_nrings(na, t) + 1;
+			priv->np_qlast[t] = netmap_real_rings(na, t);
 			ND("%s: %s %d %d", reg == NR_REG_SW ? "SW" : "NIC+SW",
 				nm_txrx2str(t),
 				priv->np_qfirst[t], priv->np_qlast[t]);
 			break;
+		case NR_REG_ONE_SW:
+			if (!(na->na_flags & NAF_HOST_RINGS)) {
+				D("host rings not supported");
+				return EINVAL;
+			}
+			if (i >= na->num_host_tx_rings &&
+			    i >= na->num_host_rx_rings) {
+				D("invalid host ring id %d", i);
+				return EINVAL;
+			}
+			/* if not enough rings, use the first one */
+			j = i;
+			if (j >= nma_get_host_nrings(na, t))
+				j = 0;
+			priv->np_qfirst[t] = nma_get_nrings(na, t) + j;
+			priv->np_qlast[t] = priv->np_qfirst[t] + 1;
+			ND("ONE_SW: %s %d %d", nm_txrx2str(t),
+				priv->np_qfirst[t], priv->np_qlast[t]);
+			break;
 		case NR_REG_ONE_NIC:
 			if (i >= na->num_tx_rings && i >= na->num_rx_rings) {
 				D("invalid ring id %d", i);
@@ -2095,6 +2331,7 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 	struct netmap_if *nifp;
 	struct netmap_kring *krings;
 	enum txrx t;
+	struct mbq q;	/* packets from NIC rx rings to the host stack */
 
 	if (cmd == NIOCGINFO || cmd == NIOCREGIF) {
 		/* truncate name */
@@ -2149,6 +2386,8 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			nmr->nr_tx_rings = na->num_tx_rings;
 			nmr->nr_rx_slots = na->num_rx_desc;
 			nmr->nr_tx_slots = na->num_tx_desc;
+			nmr->nr_host_rx_rings = na->num_host_rx_rings;
+			nmr->nr_host_tx_rings = na->num_host_tx_rings;
 		} while (0);
 		netmap_unget_na(na, ifp);
 		NMG_UNLOCK();
@@ -2162,7 +2401,9 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				|| i == NETMAP_BDG_NEWIF
 				|| i == NETMAP_BDG_DELIF
 				|| i == NETMAP_BDG_POLLING_ON
-				|| i == NETMAP_BDG_POLLING_OFF) {
+				|| i == NETMAP_BDG_POLLING_OFF
+				|| i == NETMAP_BDG_CLS
+				|| i == NETMAP_BDG_QOS) {
 			error = netmap_bdg_ctl(nmr, NULL);
 			break;
 		} else if (i == NETMAP_PT_HOST_CREATE || i == NETMAP_PT_HOST_DELETE) {
@@ -2179,6 +2420,20 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			netmap_unget_na(na, ifp);
 			NMG_UNLOCK();
 			break;
+		} else if (i == NETMAP_EXTRA_ALLOC || i == NETMAP_EXTRA_FREE) {
+			/* more extra buffers, or fewer, at runtime */
+			NMG_LOCK();
+			nifp = priv->np_nifp;
+			if (nifp == NULL) {
+				error = ENXIO;
+			} else if (i == NETMAP_EXTRA_ALLOC) {
+				error = netmap_extra_alloc(priv,
+					&nmr->nr_arg3, 0);
+			} else {
+				error = netmap_extra_free(priv, &nmr->nr_arg3);
+			}
+			NMG_UNLOCK();
+			break;
 		} else if (i != 0) {
 			D("nr_cmd must be 0 not %d", i);
 			error = EINVAL;
@@ -2212,6 +2467,7 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				break;
 			}
 
+			netmap_set_host_rings(na, nmr);
 			error = netmap_do_regif(priv, na, nmr->nr_ringid, nmr->nr_flags);
 			if (error) {    /* reg. failed, release priv and ref */
 				netmap_unget_na(na, ifp);
@@ -2225,6 +2481,8 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			nmr->nr_tx_rings = na->num_tx_rings;
 			nmr->nr_rx_slots = na->num_rx_desc;
 			nmr->nr_tx_slots = na->num_tx_desc;
+			nmr->nr_host_rx_rings = na->num_host_rx_rings;
+			nmr->nr_host_tx_rings = na->num_host_tx_rings;
 			error = netmap_mem_get_info(na->nm_mem, &nmr->nr_memsize, &memflags,
 				&nmr->nr_arg2);
 			if (error) {
@@ -2242,8 +2500,8 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 
 			if (nmr->nr_arg3) {
 				D("requested %d extra buffers", nmr->nr_arg3);
-				nmr->nr_arg3 = netmap_extra_alloc(na,
-					&nifp->ni_bufs_head, nmr->nr_arg3);
+				/* short of buffers we just return fewer */
+				netmap_extra_alloc(priv, &nmr->nr_arg3, 1);
 				D("got %d extra buffers", nmr->nr_arg3);
 			}
 			nmr->nr_offset = netmap_mem_if_offset(na->nm_mem, nifp);
@@ -2276,6 +2534,7 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 		krings = NMR(na, t);
 		qfirst = priv->np_qfirst[t];
 		qlast = priv->np_qlast[t];
+		mbq_init(&q);
 
 		for (i = qfirst; i < qlast; i++) {
 			struct netmap_kring *kring = krings + i;
@@ -2303,13 +2562,21 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			} else {
 				if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
 					netmap_ring_reinit(kring);
-				} else if (kring->nm_sync(kring, NAF_FORCE_READ) == 0) {
-					nm_sync_finalize(kring);
+				} else {
+					/* transparent mode, as in netmap_poll() */
+					if (nm_may_forward_up(kring))
+						netmap_fwd_up_drops +=
+						    netmap_grab_packets(kring,
+							&q, netmap_fwd);
+					if (kring->nm_sync(kring, NAF_FORCE_READ) == 0)
+						nm_sync_finalize(kring);
 				}
 				microtime(&ring->ts);
 			}
 			nm_kr_put(kring);
 		}
+		if (cmd == NIOCRXSYNC)
+			netmap_fwd_up(na, &q, NULL);
 
 		break;
 
@@ -2563,7 +2830,8 @@ do_retry_rx:
 			if (nm_may_forward_up(kring)) {
 				ND(10, "forwarding some buffers up %d to %d",
 				    kring->nr_hwcur, ring->cur);
-				netmap_grab_packets(kring, &q, netmap_fwd);
+				netmap_fwd_up_drops +=
+					netmap_grab_packets(kring, &q, netmap_fwd);
 			}
 
 			kring->nr_kflags &= ~NR_FORWARD;
@@ -2607,10 +2875,7 @@ do_retry_rx:
  	 * rings to a single file descriptor.
 	 */
 
-	if (q.head && !nm_kr_tryget(&na->tx_rings[na->num_tx_rings], 1, &revents)) {
-		netmap_send_up(na->ifp, &q);
-		nm_kr_put(&na->tx_rings[na->num_tx_rings]);
-	}
+	netmap_fwd_up(na, &q, &revents);
 
 	return (revents);
 #undef want_tx
@@ -2683,6 +2948,11 @@ netmap_attach_common(struct netmap_adapter *na)
 	if (na->nm_notify == NULL)
 		na->nm_notify = netmap_notify;
 	na->active_fds = 0;
+	/* one host ring pair, unless asked otherwise on NIOCREGIF */
+	if (na->num_host_tx_rings == 0)
+		na->num_host_tx_rings = 1;
+	if (na->num_host_rx_rings == 0)
+		na->num_host_rx_rings = 1;
 
 	if (na->nm_mem == NULL)
 		/* use the global allocator */
@@ -2900,10 +3170,13 @@ int
 netmap_hw_krings_create(struct netmap_adapter *na)
 {
 	int ret = netmap_krings_create(na, 0);
+	u_int i;
+
 	if (ret == 0) {
-		/* initialize the mbq for the sw rx ring */
-		mbq_safe_init(&na->rx_rings[na->num_rx_rings].rx_queue);
-		ND("initialized sw rx queue %d", na->num_rx_rings);
+		/* initialize the mbqs for the sw rx rings */
+		for (i = na->num_rx_rings; i < netmap_all_rings(na, NR_RX); i++)
+			mbq_safe_init(&na->rx_rings[i].rx_queue);
+		ND("initialized sw rx queues %d", na->num_host_rx_rings);
 	}
 	return ret;
 }
@@ -2964,8 +3237,8 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	u_int len = MBUF_LEN(m);
 	u_int error = ENOBUFS;
 	struct mbq *q;
-	int space;
-	int txr;
+	int space, more, notify = 0;
+	u_int txr;
 
 	kring = &na->rx_rings[na->num_rx_rings];
 	// XXX [Linux] we do not need this lock
@@ -2979,19 +3252,25 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	}
 
 	txr = MBUF_TXQ(m);
+	if (txr >= na->num_tx_rings)
+		txr %= na->num_tx_rings;
 	tx_kring = &NMR(na, NR_TX)[txr];
 
-	if (tx_kring->nr_mode == NKR_NETMAP_OFF) {
-		return MBUF_TRANSMIT(na, ifp, m);
-	}
-
+	/* spread the packets over the host rings like the stack
+	 * spreads them over the tx queues */
+	if (na->num_host_rx_rings > 1)
+		kring += MBUF_TXQ(m) % na->num_host_rx_rings;
 	q = &kring->rx_queue;
+	/* m may be gone below, but a wakeup deferred by a previous
+	 * packet must be sent on every path, drops included
+	 */
+	more = MBUF_XMIT_MORE(m);
 
-	// XXX reconsider long packets if we handle fragments
-	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
-		D("%s from_host, drop packet size %d > %d", na->name,
-			len, NETMAP_BUF_SIZE(na));
-		goto done;
+	if (tx_kring->nr_mode == NKR_NETMAP_OFF) {
+		error = MBUF_TRANSMIT(na, ifp, m);
+		m = NULL; /* consumed by the driver */
+		mbq_lock(q);
+		goto wakeup;
 	}
 
 	/* protect against rxsync_from_host(), netmap_sw_to_nic()
@@ -3004,29 +3283,51 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
         space = kring->nr_hwtail - kring->nr_hwcur;
         if (space < 0)
                 space += kring->nkr_num_slots;
-	if (space + mbq_len(q) >= kring->nkr_num_slots - 1) { // XXX
+	// XXX reconsider long packets if we handle fragments
+	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
+		RD(10, "%s from_host, drop packet size %d > %d", na->name,
+			len, NETMAP_BUF_SIZE(na));
+		netmap_host_drops++;
+	} else if (space + mbq_len(q) >= kring->nkr_num_slots - 1) { // XXX
 		RD(10, "%s full hwcur %d hwtail %d qlen %d len %d m %p",
 			na->name, kring->nr_hwcur, kring->nr_hwtail, mbq_len(q),
 			len, m);
+		netmap_host_drops++;
 	} else {
+		/* the consumer has drained the queue, so it needs
+		 * a new wakeup. Any packet enqueued after this one,
+		 * and before the next rxsync, is covered by it.
+		 */
+		if (mbq_len(q) == 0)
+			kring->nkr_host_wakeup = 1;
 		mbq_enqueue(q, m);
 		ND(10, "%s %d bufs in queue len %d m %p",
 			na->name, mbq_len(q), len, m);
-		/* notify outside the lock */
-		m = NULL;
+		netmap_host_pkts++;
 		error = 0;
+		m = NULL; /* now owned by the queue */
+	}
+wakeup:
+	/* defer the wakeup while the stack tells us that more
+	 * packets are coming (e.g. within the same softirq batch)
+	 */
+	if (kring->nkr_host_wakeup && !more) {
+		kring->nkr_host_wakeup = 0;
+		netmap_host_wakeups++;
+		notify = 1;
 	}
 	mbq_unlock(q);
 
-done:
-	if (m)
-		m_freem(m);
-	/* unconditionally wake up listeners */
-	kring->nm_notify(kring, 0);
+	/* notify outside the lock */
+	if (notify)
+		kring->nm_notify(kring, 0);
 	/* this is normally netmap_notify(), but for nics
 	 * connected to a bridge it is netmap_bwrap_intr_notify(),
 	 * that possibly forwards the frames through the switch
 	 */
+done:
+	if (m)
+		m_freem(m);
 
 	return (error);
 }
@@ -115,6 +115,15 @@ nm_os_put_module(void)
 	netmap_use_count--;
 }
 
+uint64_t
+nm_os_get_nsec(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void
 netmap_ifnet_departure_handler(void *arg __unused, struct ifnet *ifp)
 {
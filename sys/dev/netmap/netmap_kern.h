@@ -229,6 +229,11 @@ typedef struct hrtimer{
 
 #endif /* end - platform-specific code */
 
+#ifndef MBUF_XMIT_MORE
+/* no hint that the stack is going to send more packets right away */
+#define MBUF_XMIT_MORE(m)	0
+#endif
+
 #ifndef _WIN32 /* support for emulated sysctl */
 #define SYSBEGIN(x)
 #define SYSEND
@@ -287,6 +292,9 @@ void nm_os_ifnet_unlock(void);
 void nm_os_get_module(void);
 void nm_os_put_module(void);
 
+/* monotonic time in nanoseconds */
+uint64_t nm_os_get_nsec(void);
+
 void netmap_make_zombie(struct ifnet *);
 
 /* passes a packet up to the host stack.
@@ -428,10 +436,20 @@ struct netmap_kring {
 
 	/* The following fields are for VALE switch support */
 	struct nm_bdg_fwd *nkr_ft;
+	volatile uint32_t nkr_bdg_seq;	/* odd while flushing */
 	uint32_t	*nkr_leases;
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
 	uint32_t	nkr_hwlease;
 	uint32_t	nkr_lease_idx;
+	/* token bucket for the port rate limit (see nm_tb_cfg),
+	 * input on tx rings and output on rx rings, with drop
+	 * counters for NETMAP_BDG_QOS. The rx ring state is
+	 * protected by q_lock.
+	 */
+	uint64_t	nkr_tb_tokens;
+	uint64_t	nkr_tb_last;	/* time of the last refill, ns */
+	uint64_t	nkr_rate_drops;
+	uint64_t	nkr_class_drops;
 
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
@@ -451,6 +469,11 @@ struct netmap_kring {
 	struct mbuf	*tx_event;	/* TX event used as a notification */
 	NM_LOCK_T	tx_event_lock;	/* protects the tx_event mbuf */
 	struct mbq	rx_queue;       /* intercepted rx mbufs. */
+	/* host rx rings: a wakeup is due, but netmap_transmit() is
+	 * waiting for the end of the batch. Protected by the
+	 * rx_queue lock.
+	 */
+	int		nkr_host_wakeup;
 
 	uint32_t	users;		/* existing bindings for this ring */
 
@@ -594,6 +617,7 @@ struct netmap_lut {
 	struct lut_entry *lut;
 	uint32_t objtotal;	/* max buffer index */
 	uint32_t objsize;	/* buffer size */
+	char *base;		/* if not NULL, buffer i is at base + i * objsize */
 };
 
 struct netmap_vp_adapter; // forward
@@ -622,7 +646,8 @@ struct netmap_adapter {
 #define NAF_SW_ONLY	2	/* forward packets only to sw adapter */
 #define NAF_BDG_MAYSLEEP 4	/* the bridge is allowed to sleep when
 				 * forwarding packets coming from this
-				 * interface
+				 * interface (unused, VALE never sleeps
+				 * in the data path)
 				 */
 #define NAF_MEM_OWNER	8	/* the adapter uses its own memory area
 				 * that cannot be changed
@@ -649,13 +674,16 @@ struct netmap_adapter {
 
 	u_int num_rx_rings; /* number of adapter receive rings */
 	u_int num_tx_rings; /* number of adapter transmit rings */
+	u_int num_host_rx_rings; /* number of host receive rings */
+	u_int num_host_tx_rings; /* number of host transmit rings */
 
 	u_int num_tx_desc;  /* number of descriptor in each queue */
 	u_int num_rx_desc;
 
 	/* tx_rings and rx_rings are private but allocated
 	 * as a contiguous chunk of memory. Each array has
-	 * N+1 entries, for the adapter queues and for the host queue.
+	 * N+H entries, for the adapter queues and for the host queues
+	 * (at least one, possibly fake, see netmap_all_rings()).
 	 */
 	struct netmap_kring *tx_rings; /* array of TX rings. */
 	struct netmap_kring *rx_rings; /* array of RX rings. */
@@ -822,6 +850,23 @@ nma_set_nrings(struct netmap_adapter *na, enum txrx t, u_int v)
 		na->num_rx_rings = v;
 }
 
+#define NM_HOST_MAXRINGS	64	/* host ring pairs of a NIC */
+
+static __inline u_int
+nma_get_host_nrings(struct netmap_adapter *na, enum txrx t)
+{
+	return (t == NR_TX ? na->num_host_tx_rings : na->num_host_rx_rings);
+}
+
+static __inline void
+nma_set_host_nrings(struct netmap_adapter *na, enum txrx t, u_int v)
+{
+	if (t == NR_TX)
+		na->num_host_tx_rings = v;
+	else
+		na->num_host_rx_rings = v;
+}
+
 static __inline struct netmap_kring*
 NMR(struct netmap_adapter *na, enum txrx t)
 {
@@ -841,6 +886,20 @@ NMR(struct netmap_adapter *na, enum txrx t)
 /*
  * derived netmap adapters for various types of ports
  */
+/*
+ * Token bucket parameters for VALE ports. rate and burst are in
+ * 32.32 fixed point (bytes per ns and bytes), so that the datapath
+ * only needs multiplications. An idle time of burst_ns or more
+ * refills the bucket. rate == 0 means no limit.
+ */
+struct nm_tb_cfg {
+	uint64_t	rate;
+	uint64_t	burst;
+	uint64_t	burst_ns;
+	uint32_t	kbps;		/* as configured */
+	uint32_t	depth;
+};
+
 struct netmap_vp_adapter {	/* VALE software port */
 	struct netmap_adapter up;
 
@@ -858,6 +917,11 @@ struct netmap_vp_adapter {	/* VALE software port */
 	u_int mfs;
 	/* Last source MAC on this port */
 	uint64_t last_smac;
+
+	/* NETMAP_BDG_QOS: rate limits and priority class */
+	struct nm_tb_cfg qos_in;
+	struct nm_tb_cfg qos_out;
+	u_int qos_class;
 };
 
 
@@ -908,10 +972,27 @@ struct netmap_generic_adapter {	/* emulated device */
 };
 #endif  /* WITH_GENERIC */
 
+/* the hardware rings and the host rings, if any */
 static __inline int
 netmap_real_rings(struct netmap_adapter *na, enum txrx t)
 {
-	return nma_get_nrings(na, t) + !!(na->na_flags & NAF_HOST_RINGS);
+	return nma_get_nrings(na, t) + ((na->na_flags & NAF_HOST_RINGS) ?
+		nma_get_host_nrings(na, t) : 0);
+}
+
+/* all the krings, including the fake host ring of adapters without
+ * host rings */
+static __inline int
+netmap_all_rings(struct netmap_adapter *na, enum txrx t)
+{
+	return nma_get_nrings(na, t) + nma_get_host_nrings(na, t);
+}
+
+/* is this one of the host krings ? */
+static __inline int
+nm_kring_is_host(struct netmap_kring *kring)
+{
+	return kring->ring_id >= nma_get_nrings(kring->na, kring->tx);
 }
 
 #ifdef WITH_VALE
@@ -1379,8 +1460,9 @@ int netmap_get_hw_na(struct ifnet *ifp, struct netmap_adapter **na);
  * kernel modules.
  *
  * VALE only supports unicast or broadcast. The lookup
- * function can return 0 .. NM_BDG_MAXPORTS-1 for regular ports,
- * NM_BDG_MAXPORTS for broadcast, NM_BDG_MAXPORTS+1 for unknown.
+ * function can return a port index below the capacity of the switch
+ * for regular ports, NM_BDG_BROADCAST for broadcast, NM_BDG_NOPORT
+ * for unknown.
  * XXX in practice "unknown" might be handled same as broadcast.
  */
 typedef u_int (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
@@ -1396,7 +1478,11 @@ struct netmap_bdg_ops {
 u_int netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		struct netmap_vp_adapter *);
 
-#define	NM_BDG_MAXPORTS		254	/* up to 254 */
+/* Upper limit for the ports of a switch, the actual capacity is
+ * chosen when the switch is created. port * NM_BDG_MAXRINGS + ring
+ * must fit in 16 bits.
+ */
+#define	NM_BDG_MAXPORTS		4095
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
 #define	NM_BDG_NOPORT		(NM_BDG_MAXPORTS+1)
 
@@ -1404,8 +1490,8 @@ u_int netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 
 /* these are redefined in case of no VALE support */
 int netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create);
-struct nm_bridge *netmap_init_bridges2(u_int);
-void netmap_uninit_bridges2(struct nm_bridge *, u_int);
+struct nm_bridge **netmap_init_bridges2(u_int *);
+void netmap_uninit_bridges2(struct nm_bridge **, u_int);
 int netmap_init_bridges(void);
 void netmap_uninit_bridges(void);
 int netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops);
@@ -1444,12 +1530,12 @@ void netmap_monitor_stop(struct netmap_adapter *na);
 #ifdef CONFIG_NET_NS
 struct net *netmap_bns_get(void);
 void netmap_bns_put(struct net *);
-void netmap_bns_getbridges(struct nm_bridge **, u_int *);
+void netmap_bns_getbridges(struct nm_bridge ***, u_int *);
 #else
 #define netmap_bns_get()
 #define netmap_bns_put(_1)
 #define netmap_bns_getbridges(b, n) \
-	do { *b = nm_bridges; *n = NM_BRIDGES; } while (0)
+	do { *b = nm_bridges; *n = nm_num_bridges; } while (0)
 #endif
 
 /* Various prototypes */
@@ -1721,14 +1807,18 @@ struct netmap_obj_pool;
 /*
  * NMB return the virtual address of a buffer (buffer 0 on bad index)
  * PNMB also fills the physical address
+ * When the buffers are virtually contiguous (na_lut.base is set)
+ * the address is computed, saving a load from the (large) lut.
  */
 static inline void *
 NMB(struct netmap_adapter *na, struct netmap_slot *slot)
 {
-	struct lut_entry *lut = na->na_lut.lut;
+	struct netmap_lut *l = &na->na_lut;
 	uint32_t i = slot->buf_idx;
-	return (unlikely(i >= na->na_lut.objtotal)) ?
-		lut[0].vaddr : lut[i].vaddr;
+
+	if (unlikely(i >= l->objtotal))
+		i = 0;
+	return l->base ? l->base + (size_t)i * l->objsize : l->lut[i].vaddr;
 }
 
 static inline void *
@@ -1736,7 +1826,7 @@ PNMB(struct netmap_adapter *na, struct netmap_slot *slot, uint64_t *pp)
 {
 	uint32_t i = slot->buf_idx;
 	struct lut_entry *lut = na->na_lut.lut;
-	void *ret = (i >= na->na_lut.objtotal) ? lut[0].vaddr : lut[i].vaddr;
+	void *ret = NMB(na, slot);
 
 #ifndef _WIN32
 	*pp = (i >= na->na_lut.objtotal) ? lut[0].paddr : lut[i].paddr;
@@ -1774,6 +1864,10 @@ struct netmap_priv_d {
 
 	int		np_refs;	/* use with NMG_LOCK held */
 
+	/* extra buffers allocated through this fd, see netmap_extra_alloc() */
+	uint32_t	*np_xbufs;	/* bitmap, one bit per buffer */
+	uint32_t	np_nxbufs;	/* number of bits set */
+
 	/* pointers to the selinfo to be used for selrecord.
 	 * Either the local or the global one depending on the
 	 * number of rings.
@@ -1894,7 +1988,7 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
-	uint8_t _ft_port;	/* dst port (unused) */
+	uint8_t ft_group;	/* multicast group in the batch, 0 is broadcast */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
@@ -1985,6 +2079,13 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   struct netmap_ring *dst_ring,
 			   u_int *j, u_int lim, u_int *howmany);
 
+u_int bdg_gro_datapath(struct netmap_vp_adapter *na,
+			struct netmap_vp_adapter *dst_na,
+			struct nm_bdg_fwd *ft, struct nm_bdg_fwd *ft_p,
+			u_int *next, u_int brd_next, u_int max_segs,
+			struct netmap_ring *dst_ring,
+			u_int *j, u_int lim, u_int *howmany);
+
 /* persistent virtual port routines */
 int nm_os_vi_persist(const char *, struct ifnet **);
 void nm_os_vi_detach(struct ifnet *);
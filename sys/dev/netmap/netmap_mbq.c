@@ -125,6 +125,34 @@ struct mbuf *mbq_dequeue(struct mbq *q)
     return __mbq_dequeue(q);
 }
 
+
+/* move the first n mbufs of q (or all of them, if fewer) to the
+ * empty queue dst, with a single walk of the list.
+ */
+void mbq_dequeue_batch(struct mbq *q, struct mbq *dst, unsigned int n)
+{
+    struct mbuf *m = q->head;
+    unsigned int i;
+
+    if (n >= (unsigned int)q->count) {
+        dst->head = q->head;
+        dst->tail = q->tail;
+        dst->count = q->count;
+        __mbq_init(q);
+        return;
+    }
+    if (n == 0)
+        return;
+    for (i = 1; i < n; i++)
+        m = m->m_nextpkt;
+    dst->head = q->head;
+    dst->tail = m;
+    dst->count = n;
+    q->head = m->m_nextpkt;
+    q->count -= n;
+    m->m_nextpkt = NULL;
+}
+
 /* XXX seems pointless to have a generic purge */
 static void __mbq_purge(struct mbq *q, int safe)
 {
@@ -61,6 +61,7 @@ void mbq_init(struct mbq *q);
 void mbq_fini(struct mbq *q);
 void mbq_enqueue(struct mbq *q, struct mbuf *m);
 struct mbuf *mbq_dequeue(struct mbq *q);
+void mbq_dequeue_batch(struct mbq *q, struct mbq *dst, unsigned int n);
 void mbq_purge(struct mbq *q);
 
 static inline struct mbuf *
@@ -41,6 +41,10 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 241723 2012-10-19 09:41:45Z gle
 #include <sys/proc.h>
 #include <vm/vm.h>	/* vtophys */
 #include <vm/pmap.h>	/* vtophys */
+#if __FreeBSD_version >= 1200000
+#include <sys/domainset.h>	/* DOMAINSET_PREF */
+#include <vm/vm_phys.h>		/* vm_ndomains */
+#endif
 #include <sys/socket.h> /* sockaddrs */
 #include <sys/selinfo.h>
 #include <sys/sysctl.h>
@@ -72,6 +76,8 @@ MALLOC_DEFINE(M_NETMAP, "netmap", "Network memory map");
 
 #define NETMAP_POOL_MAX_NAMSZ	32
 
+#define NM_HUGEPAGE_SIZE	(1 << 21)	/* 2 MB, as on x86 and arm64 */
+
 
 enum {
 	NETMAP_IF_POOL   = 0,
@@ -84,6 +90,7 @@ enum {
 struct netmap_obj_params {
 	u_int size;
 	u_int num;
+	u_int max;	/* grow on demand up to max objects, 0: never */
 };
 
 struct netmap_obj_pool {
@@ -95,10 +102,12 @@ struct netmap_obj_pool {
 	u_int objtotal;         /* actual total number of objects. */
 	u_int memtotal;		/* actual total memory space */
 	u_int numclusters;	/* actual number of clusters */
+	u_int objmax;		/* lut entries, objtotal may grow up to it */
 
 	u_int objfree;          /* number of free objects. */
 
 	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
+	char *flatbase;		/* contiguous view of the objects, or NULL */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
 	/* ---------------------------------------------------*/
@@ -115,10 +124,15 @@ struct netmap_obj_pool {
 	u_int _clustsize;       /* cluster size */
 	u_int _clustentries;    /* objects per cluster */
 	u_int _numclusters;	/* number of clusters */
+	u_int _maxclusters;	/* clusters we may grow to */
+	u_int _clustalign;	/* clusters fill pages of this size */
+
+	int numa_node;		/* preferred node for the clusters, -1 any */
 
 	/* requested values */
 	u_int r_objtotal;
 	u_int r_objsize;
+	u_int r_objmax;
 };
 
 #define NMA_LOCK_T		NM_MTX_T
@@ -310,6 +324,8 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 }
 
 static int netmap_mem_init_shared_info(struct netmap_mem_d *nmd);
+static void netmap_obj_shrink(struct netmap_obj_pool *);
+static void *netmap_clust_malloc(struct netmap_obj_pool *);
 
 void
 netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
@@ -329,6 +345,7 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 			u_int j;
 
 			p = &nmd->pools[i];
+			netmap_obj_shrink(p);
 			p->objfree = p->objtotal;
 			/*
 			 * Reproduce the net effect of the M_ZERO malloc()
@@ -379,8 +396,9 @@ static int
 netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
 {
 	lut->lut = nmd->pools[NETMAP_BUF_POOL].lut;
-	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
+	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objmax;
 	lut->objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	lut->base = nmd->pools[NETMAP_BUF_POOL].flatbase;
 
 	return 0;
 }
@@ -430,6 +448,7 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.objmaxsize = 4096,
 			.nummin     = 10,	/* don't be stingy */
 			.nummax	    = 10000,	/* XXX very large */
+			.numa_node  = -1,
 		},
 		[NETMAP_RING_POOL] = {
 			.name 	= "netmap_ring",
@@ -437,6 +456,7 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.objmaxsize = 32*PAGE_SIZE,
 			.nummin     = 2,
 			.nummax	    = 1024,
+			.numa_node  = -1,
 		},
 		[NETMAP_BUF_POOL] = {
 			.name	= "netmap_buf",
@@ -444,6 +464,7 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.objmaxsize = 65536,
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
+			.numa_node  = -1,
 		},
 	},
 
@@ -470,6 +491,7 @@ static const struct netmap_mem_d nm_blueprint = {
 			.objmaxsize = 4096,
 			.nummin     = 1,
 			.nummax	    = 100,
+			.numa_node  = -1,
 		},
 		[NETMAP_RING_POOL] = {
 			.name 	= "%s_ring",
@@ -477,6 +499,7 @@ static const struct netmap_mem_d nm_blueprint = {
 			.objmaxsize = 32*PAGE_SIZE,
 			.nummin     = 2,
 			.nummax	    = 1024,
+			.numa_node  = -1,
 		},
 		[NETMAP_BUF_POOL] = {
 			.name	= "%s_buf",
@@ -484,6 +507,7 @@ static const struct netmap_mem_d nm_blueprint = {
 			.objmaxsize = 65536,
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
+			.numa_node  = -1,
 		},
 	},
 
@@ -520,6 +544,19 @@ DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
 
+SYSBEGIN(mem2_grow);
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_max_num,
+    CTLFLAG_RW, &netmap_params[NETMAP_BUF_POOL].max, 0,
+    "Number of netmap bufs the global pool can grow to on demand");
+SYSEND;
+
+static int netmap_flat_lut = 1;
+SYSBEGIN(mem2_flat);
+SYSCTL_INT(_dev_netmap, OID_AUTO, flat_lut,
+    CTLFLAG_RW, &netmap_flat_lut, 0,
+    "Address contiguous netmap bufs without the lut (2: map them if needed)");
+SYSEND;
+
 /* call with NMA_LOCK(&nm_mem) held */
 static int
 nm_mem_assign_id_locked(struct netmap_mem_d *nmd)
@@ -598,6 +635,35 @@ nm_mem_assign_group(struct netmap_mem_d *nmd, struct device *dev)
 	return err;
 }
 
+/*
+ * Growing pools.
+ *
+ * A pool configured with max > num objects starts with the clusters
+ * for num objects, and netmap_obj_malloc() adds more clusters when
+ * it runs out of free objects, until there is room for max.
+ * The lut and the bitmap are sized for max, so indices never change;
+ * the lut entries of the missing clusters point to object 0, as
+ * NMB() does for out of range indices, so that bogus indices from
+ * userspace are harmless. The address space is also reserved for max
+ * (see netmap_obj_memsize()): userspace maps it all at once, and the
+ * pages of the new clusters are served by the page fault handlers,
+ * through netmap_mem_ofstophys(). Offsets of the other pools depend
+ * on memtotal, so only the last pool (buffers) can grow.
+ *
+ * Grown clusters are released when the allocator goes out of use
+ * (see netmap_mem_deref()): before that, some process may still have
+ * their pages mapped.
+ */
+
+/* address space used by the pool, including room to grow */
+static inline u_int
+netmap_obj_memsize(struct netmap_obj_pool *p)
+{
+	if (p->_maxclusters > p->_numclusters)
+		return p->_maxclusters * p->_clustsize;
+	return p->memtotal;
+}
+
 /*
  * First, find the allocator that contains the requested offset,
  * then locate the cluster through a lookup table.
@@ -613,9 +679,12 @@ netmap_mem2_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 	NMA_LOCK(nmd);
 	p = nmd->pools;
 
-	for (i = 0; i < NETMAP_POOLS_NR; offset -= p[i].memtotal, i++) {
-		if (offset >= p[i].memtotal)
+	for (i = 0; i < NETMAP_POOLS_NR;
+			offset -= netmap_obj_memsize(&p[i]), i++) {
+		if (offset >= netmap_obj_memsize(&p[i]))
 			continue;
+		if (offset >= p[i].memtotal)
+			break; /* room to grow, not allocated yet */
 		// now lookup the cluster's address
 #ifndef _WIN32
 		pa = vtophys(p[i].lut[offset / p[i]._objsize].vaddr) +
@@ -759,7 +828,7 @@ netmap_mem2_get_info(struct netmap_mem_d* nmd, u_int* size, u_int *memflags,
 			*size = 0;
 			for (i = 0; i < NETMAP_POOLS_NR; i++) {
 				struct netmap_obj_pool *p = nmd->pools + i;
-				*size += (p->_numclusters * p->_clustsize);
+				*size += (p->_maxclusters * p->_clustsize);
 			}
 		}
 	}
@@ -819,6 +888,68 @@ netmap_mem2_if_offset(struct netmap_mem_d *nmd, const void *addr)
 	return v;
 }
 
+/*
+ * Add clusters to a growing pool, about 1/16 of its current size
+ * (clusters are often just one page). Call with NMA_LOCK held.
+ * We only append to full clusters, otherwise the new objects
+ * would not follow the last one.
+ */
+static int
+netmap_obj_grow(struct netmap_obj_pool *p)
+{
+	u_int i, lim, want = p->objtotal / 16;
+	char *clust;
+
+	if (p->objtotal != p->numclusters * p->_clustentries)
+		return ENOMEM;
+	for (lim = p->objtotal; p->numclusters < p->_maxclusters &&
+			(lim == p->objtotal || lim - p->objtotal < want); ) {
+		clust = netmap_clust_malloc(p);
+		if (clust == NULL) {
+			D("Unable to grow the '%s' allocator", p->name);
+			break;
+		}
+		for (i = lim, lim += p->_clustentries; i < lim;
+				i++, clust += p->_objsize) {
+			p->lut[i].vaddr = clust;
+			p->lut[i].paddr = vtophys(clust);
+			p->bitmap[ (i>>5) ] |=  ( 1 << (i & 31) );
+		}
+		p->numclusters++;
+	}
+	if (lim == p->objtotal)
+		return ENOMEM;
+	p->objfree += lim - p->objtotal;
+	p->objtotal = lim;
+	p->memtotal = p->numclusters * p->_clustsize;
+	if (netmap_verbose)
+		D("'%s' grown to %d clusters (%dKB)", p->name,
+		    p->numclusters, p->memtotal >> 10);
+	return 0;
+}
+
+/*
+ * Release the clusters added by netmap_obj_grow(), which must
+ * not be in use. Call with NMA_LOCK held.
+ */
+static void
+netmap_obj_shrink(struct netmap_obj_pool *p)
+{
+	u_int i, lim;
+
+	while (p->numclusters > p->_numclusters) {
+		lim = p->objtotal;
+		p->objtotal -= p->_clustentries;
+		contigfree(p->lut[p->objtotal].vaddr, p->_clustsize, M_NETMAP);
+		for (i = p->objtotal; i < lim; i++) {
+			p->lut[i] = p->lut[0];
+			p->bitmap[ (i>>5) ] &=  ~( 1 << (i & 31) );
+		}
+		p->numclusters--;
+		p->memtotal -= p->_clustsize;
+	}
+}
+
 /*
  * report the index, and use start position as a hint,
  * otherwise buffer allocation becomes terribly expensive.
@@ -836,7 +967,7 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 		return NULL;
 	}
 
-	if (p->objfree == 0) {
+	if (p->objfree == 0 && netmap_obj_grow(p)) {
 		D("no more %s objects", p->name);
 		return NULL;
 	}
@@ -938,55 +1069,160 @@ netmap_obj_free_va(struct netmap_obj_pool *p, void *vaddr)
 #endif
 
 /*
- * allocate extra buffers in a linked list.
- * returns the actual number.
+ * Extra buffers are owned by the priv that allocated them, which
+ * records them in np_xbufs (one bit per buffer in the pool). Only
+ * owned buffers can be released, so an index planted on the user
+ * visible list cannot free a buffer in use elsewhere. A priv can
+ * own at most NM_EXTRA_MAX buffers.
+ */
+#define NM_EXTRA_MAX(p)		((p)->objtotal / 2)
+#define NM_XBUF_OWNED(priv, j)	((priv)->np_xbufs[(j) / 32] & (1U << ((j) % 32)))
+
+/*
+ * allocate up to *n extra buffers for priv and push them on the
+ * linked list at nifp->ni_bufs_head (0 is the empty list).
+ * *n returns the actual number. Requests beyond NM_EXTRA_MAX fail
+ * with ENOMEM, or are trimmed if partial is set.
  */
-uint32_t
-netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
+int
+netmap_extra_alloc(struct netmap_priv_d *priv, uint32_t *n, int partial)
 {
+	struct netmap_adapter *na = priv->np_na;
 	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t *head = &priv->np_nifp->ni_bufs_head;
+	uint32_t i, max, pos = 0; /* opaque, scan position in the bitmap */
+
+	max = NM_EXTRA_MAX(p) - priv->np_nxbufs;
+	if (*n > max) {
+		if (!partial) {
+			D("%u buffers exceed the limit of %u", *n, max);
+			*n = 0;
+			return ENOMEM;
+		}
+		*n = max;
+	}
+	if (*n == 0)
+		return 0;
+	if (priv->np_xbufs == NULL) {
+		/* the pool does not change while we are bound */
+		priv->np_xbufs = malloc(sizeof(uint32_t) *
+			((p->objtotal + 31) / 32), M_NETMAP, M_NOWAIT | M_ZERO);
+		if (priv->np_xbufs == NULL) {
+			*n = 0;
+			return ENOMEM;
+		}
+	}
 
 	NMA_LOCK(nmd);
 
-	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
+	for (i = 0 ; i < *n; i++) {
 		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
-			D("no more buffers after %d of %d", i, n);
+		uint32_t *b = netmap_buf_malloc(nmd, &pos, head);
+		if (b == NULL) {
+			D("no more buffers after %d of %d", i, *n);
 			*head = cur; /* restore */
 			break;
 		}
 		RD(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
+		*b = cur; /* link to previous head */
+		priv->np_xbufs[*head / 32] |= 1U << (*head % 32);
 	}
+	priv->np_nxbufs += i;
 
 	NMA_UNLOCK(nmd);
 
-	return i;
+	*n = i;
+	return 0;
 }
 
-static void
-netmap_extra_free(struct netmap_adapter *na, uint32_t head)
+/*
+ * free up to *n buffers (all if *n is 0) from the head of the list at
+ * nifp->ni_bufs_head, which is left pointing to the remaining ones.
+ * *n returns the actual number. Stops with EINVAL at the first buffer
+ * that priv does not own.
+ */
+int
+netmap_extra_free(struct netmap_priv_d *priv, uint32_t *n)
 {
-        struct lut_entry *lut = na->na_lut.lut;
+	struct netmap_adapter *na = priv->np_na;
+	struct lut_entry *lut = na->na_lut.lut;
 	struct netmap_mem_d *nmd = na->nm_mem;
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t *head = &priv->np_nifp->ni_bufs_head;
 	uint32_t i, cur, *buf;
+	int error = 0;
+
+	NMA_LOCK(nmd);
 
-	D("freeing the extra list");
-	for (i = 0; head >=2 && head < p->objtotal; i++) {
-		cur = head;
-		buf = lut[head].vaddr;
-		head = *buf;
+	/* each step drops one owned buffer, so a loop cannot last */
+	for (i = 0; *n == 0 || i < *n; i++) {
+		cur = *head;
+		if (cur == 0)
+			break;
+		if (cur >= p->objtotal || priv->np_xbufs == NULL ||
+				!NM_XBUF_OWNED(priv, cur)) {
+			RD(5, "buffer %u not owned", cur);
+			error = EINVAL;
+			break;
+		}
+		buf = lut[cur].vaddr;
+		*head = *buf;
 		*buf = 0;
-		if (netmap_obj_free(p, cur))
+		priv->np_xbufs[cur / 32] &= ~(1U << (cur % 32));
+		priv->np_nxbufs--;
+		netmap_obj_free(p, cur);
+	}
+
+	NMA_UNLOCK(nmd);
+
+	ND("freed %d buffers", i);
+	*n = i;
+	return error;
+}
+
+/*
+ * on unregister, free the owned buffers found on the list and forget
+ * the others. Owned buffers that the application swapped into a ring
+ * stay there and go with the ring, the ones it took out of a ring
+ * are not ours to free and are reclaimed with the allocator.
+ */
+void
+netmap_extra_free_all(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct lut_entry *lut = na->na_lut.lut;
+	struct netmap_mem_d *nmd = na->nm_mem;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t i, cur, next;
+
+	if (priv->np_xbufs == NULL)
+		return;
+
+	NMA_LOCK(nmd);
+
+	cur = priv->np_nifp->ni_bufs_head;
+	/* the list may be anything, bound the walk */
+	for (i = 0; i < p->objtotal && priv->np_nxbufs > 0; i++) {
+		if (cur < 2 || cur >= p->objtotal)
 			break;
+		next = *(uint32_t *)lut[cur].vaddr;
+		if (NM_XBUF_OWNED(priv, cur)) {
+			priv->np_xbufs[cur / 32] &= ~(1U << (cur % 32));
+			priv->np_nxbufs--;
+			netmap_obj_free(p, cur);
+		}
+		cur = next;
 	}
-	if (head != 0)
-		D("breaking with head %d", head);
-	D("freed %d buffers", i);
+	priv->np_nifp->ni_bufs_head = 0;
+
+	NMA_UNLOCK(nmd);
+
+	if (priv->np_nxbufs)
+		D("%u extra buffers not on the free list", priv->np_nxbufs);
+	free(priv->np_xbufs, M_NETMAP);
+	priv->np_xbufs = NULL;
+	priv->np_nxbufs = 0;
 }
 
 
@@ -1069,6 +1305,11 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	if (p->bitmap)
 		free(p->bitmap, M_NETMAP);
 	p->bitmap = NULL;
+#ifdef linux
+	if (p->flatbase && p->lut && p->flatbase != p->lut[0].vaddr)
+		vunmap(p->flatbase);
+#endif
+	p->flatbase = NULL;
 	if (p->lut) {
 		u_int i;
 
@@ -1082,7 +1323,7 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 			if (p->lut[i].vaddr)
 				contigfree(p->lut[i].vaddr, p->_clustsize, M_NETMAP);
 		}
-		bzero(p->lut, sizeof(struct lut_entry) * p->objtotal);
+		bzero(p->lut, sizeof(struct lut_entry) * p->objmax);
 #ifdef linux
 		vfree(p->lut);
 #else
@@ -1091,6 +1332,7 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	}
 	p->lut = NULL;
 	p->objtotal = 0;
+	p->objmax = 0;
 	p->memtotal = 0;
 	p->numclusters = 0;
 	p->objfree = 0;
@@ -1119,9 +1361,15 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
  */
 
 
-/* call with NMA_LOCK held */
+/*
+ * call with NMA_LOCK held. objmax > objtotal makes the pool grow.
+ * clustalign is PAGE_SIZE, or NM_HUGEPAGE_SIZE to ask for clusters
+ * made of whole huge pages (we fall back to pages if objsize does
+ * not allow it).
+ */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+	u_int objsize, u_int objmax, u_int clustalign)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -1131,6 +1379,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	 * detect configuration changes later */
 	p->r_objtotal = objtotal;
 	p->r_objsize = objsize;
+	p->r_objmax = objmax;
 
 #define MAX_CLUSTSIZE	(1<<22)		// 4 MB
 #define LINE_ROUND	NM_CACHE_ALIGN	// 64
@@ -1155,6 +1404,11 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 			objtotal, p->nummin, p->nummax);
 		return EINVAL;
 	}
+	if (objmax > p->nummax) {
+		D("requested objmax %d out of range [%d, %d]",
+			objmax, objtotal, p->nummax);
+		return EINVAL;
+	}
 	/*
 	 * Compute number of objects using a brute-force approach:
 	 * given a max cluster size,
@@ -1163,9 +1417,15 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	 */
 	for (clustentries = 0, i = 1;; i++) {
 		u_int delta, used = i * objsize;
-		if (used > MAX_CLUSTSIZE)
-			break;
-		delta = used % PAGE_SIZE;
+		if (used > MAX_CLUSTSIZE) {
+			if (clustalign == PAGE_SIZE)
+				break;
+			/* no exact fit in huge pages, use normal ones */
+			clustalign = PAGE_SIZE;
+			i = 0;
+			continue;
+		}
+		delta = used % clustalign;
 		if (delta == 0) { // exact solution
 			clustentries = i;
 			break;
@@ -1188,7 +1448,11 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	 */
 	p->_clustentries = clustentries;
 	p->_clustsize = clustsize;
+	p->_clustalign = clustalign;
 	p->_numclusters = (objtotal + clustentries - 1) / clustentries;
+	p->_maxclusters = (objmax + clustentries - 1) / clustentries;
+	if (p->_maxclusters < p->_numclusters)
+		p->_maxclusters = p->_numclusters;
 
 	/* actual values (may be larger than requested) */
 	p->_objsize = objsize;
@@ -1210,6 +1474,43 @@ nm_alloc_lut(u_int nobj)
 	return lut;
 }
 
+/* does NUMA node 'node' exist ? Without NUMA support there is only 0 */
+static int
+nm_numa_node_valid(int node)
+{
+#if defined(linux)
+	return node < MAX_NUMNODES && node_online(node);
+#elif defined(__FreeBSD__) && __FreeBSD_version >= 1200000
+	return node < vm_ndomains;
+#else
+	return node == 0;
+#endif
+}
+
+/*
+ * Allocate a cluster for the pool, from the preferred NUMA node
+ * if any (we take any memory if the node has none).
+ * Huge page clusters are aligned to the huge page size.
+ */
+static void *
+netmap_clust_malloc(struct netmap_obj_pool *p)
+{
+	size_t n = p->_clustsize;
+
+	if (p->numa_node >= 0) {
+#if defined(linux)
+		return contigmalloc_node(n, M_NETMAP, M_NOWAIT | M_ZERO,
+		    p->numa_node, (size_t)0, -1UL, p->_clustalign, 0);
+#elif defined(__FreeBSD__) && __FreeBSD_version >= 1200000
+		return contigmalloc_domainset(n, M_NETMAP,
+		    DOMAINSET_PREF(p->numa_node), M_NOWAIT | M_ZERO,
+		    (vm_paddr_t)0, ~(vm_paddr_t)0, p->_clustalign, 0);
+#endif
+	}
+	return contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
+	    (size_t)0, -1UL, p->_clustalign, 0);
+}
+
 /* call with NMA_LOCK held */
 static int
 netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
@@ -1220,15 +1521,16 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	/* optimistically assume we have enough memory */
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
+	p->objmax = p->_maxclusters * p->_clustentries;
 
-	p->lut = nm_alloc_lut(p->objtotal);
+	p->lut = nm_alloc_lut(p->objmax);
 	if (p->lut == NULL) {
 		D("Unable to create lookup table for '%s'", p->name);
 		goto clean;
 	}
 
-	/* Allocate the bitmap */
-	n = (p->objtotal + 31) / 32;
+	/* Allocate the bitmap, with room to grow */
+	n = (p->objmax + 31) / 32;
 	p->bitmap = malloc(sizeof(uint32_t) * n, M_NETMAP, M_NOWAIT | M_ZERO);
 	if (p->bitmap == NULL) {
 		D("Unable to create bitmap (%d entries) for allocator '%s'", (int)n,
@@ -1253,8 +1555,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * can live with standard malloc, because the hardware will not
 		 * access the pages directly.
 		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		clust = netmap_clust_malloc(p);
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
@@ -1262,6 +1563,11 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 			 */
 			D("Unable to create cluster at %d for '%s' allocator",
 			    i, p->name);
+			if (p->_clustalign != PAGE_SIZE) {
+				/* the caller will retry with pages */
+				p->objtotal = i;
+				goto clean;
+			}
 			if (i < 2) /* nothing to halve */
 				goto out;
 			lim = i / 2;
@@ -1299,6 +1605,9 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	p->memtotal = p->numclusters * p->_clustsize;
 	if (p->objfree == 0)
 		goto clean;
+	/* the objects we do not have yet, see netmap_obj_grow() */
+	for (i = p->objtotal; i < (int)p->objmax; i++)
+		p->lut[i] = p->lut[0];
 	if (netmap_verbose)
 		D("Pre-allocated %d clusters (%d/%dKB) for '%s'",
 		    p->numclusters, p->_clustsize >> 10,
@@ -1311,6 +1620,58 @@ clean:
 	return ENOMEM;
 }
 
+/*
+ * Look for a contiguous view of the objects of a finalized pool, so
+ * that NMB() can compute addresses instead of loading them from the
+ * lut. We have it for free when the clusters are adjacent (e.g. there
+ * is only one). With flat_lut=2, on linux, we also map the clusters of
+ * private allocators one after the other with vmap(): those buffers
+ * are only touched by the CPU, while drivers may need linear addresses
+ * (e.g. for sg_set_buf()). The lut is still used for the physical
+ * addresses, and pools that may grow have no view, as their new
+ * clusters would not follow it. Call with NMA_LOCK held.
+ */
+static void
+netmap_obj_flat_init(struct netmap_obj_pool *p, int can_map)
+{
+	u_int i;
+
+	p->flatbase = NULL;
+	if (!netmap_flat_lut || p->objtotal == 0 || p->objtotal != p->objmax)
+		return;
+	for (i = p->_clustentries; i < p->objtotal; i += p->_clustentries) {
+		if (p->lut[i].vaddr !=
+		    (char *)p->lut[0].vaddr + (size_t)i * p->_objsize)
+			break;
+	}
+	if (i >= p->objtotal) {
+		p->flatbase = p->lut[0].vaddr;
+		return;
+	}
+#ifdef linux
+	if (can_map && netmap_flat_lut > 1) {
+		u_int j, clustpages = p->_clustsize >> PAGE_SHIFT;
+		u_int npages = p->numclusters * clustpages;
+		struct page **pages;
+
+		pages = vmalloc(sizeof(*pages) * npages);
+		if (pages == NULL)
+			return;
+		for (i = 0; i < p->numclusters; i++) {
+			char *clust = p->lut[i * p->_clustentries].vaddr;
+
+			for (j = 0; j < clustpages; j++)
+				pages[i * clustpages + j] =
+					virt_to_page(clust + j * PAGE_SIZE);
+		}
+		p->flatbase = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+		vfree(pages);
+		if (p->flatbase == NULL)
+			D("Unable to map the '%s' allocator", p->name);
+	}
+#endif /* linux */
+}
+
 /* call with lock held */
 static int
 netmap_memory_config_changed(struct netmap_mem_d *nmd)
@@ -1319,7 +1680,8 @@ netmap_memory_config_changed(struct netmap_mem_d *nmd)
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		if (nmd->pools[i].r_objsize != netmap_params[i].size ||
-		    nmd->pools[i].r_objtotal != netmap_params[i].num)
+		    nmd->pools[i].r_objtotal != netmap_params[i].num ||
+		    nmd->pools[i].r_objmax != netmap_params[i].max)
 		    return 1;
 	}
 	return 0;
@@ -1402,7 +1764,7 @@ netmap_mem_init_shared_info(struct netmap_mem_d *nmd)
 
         memcpy(&nms_info->up, &nms_if_blueprint, sizeof(nms_if_blueprint));
 	nms_info->buf_pool_offset = nmd->pools[NETMAP_IF_POOL].memtotal + nmd->pools[NETMAP_RING_POOL].memtotal;
-	nms_info->buf_pool_objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
+	nms_info->buf_pool_objtotal = nmd->pools[NETMAP_BUF_POOL].objmax;
 	nms_info->buf_pool_objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
 	nms_info->totalsize = nmd->nm_totalsize;
 	nms_info->features = NMS_FEAT_BUF_POOL | NMS_FEAT_MEMSIZE;
@@ -1422,11 +1784,13 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
 		if (nmd->lasterr)
 			goto error;
-		nmd->nm_totalsize += nmd->pools[i].memtotal;
+		nmd->nm_totalsize += netmap_obj_memsize(&nmd->pools[i]);
 	}
 	/* buffers 0 and 1 are reserved */
 	nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
 	nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3;
+	netmap_obj_flat_init(&nmd->pools[NETMAP_BUF_POOL],
+	    nmd->flags & NETMAP_MEM_PRIVATE);
 	nmd->flags |= NETMAP_MEM_FINALIZED;
 
 	/* expose info to the ptnetmap guest */
@@ -1482,6 +1846,17 @@ netmap_mem_private_finalize(struct netmap_mem_d *nmd)
 {
 	int err;
 	err = netmap_mem_finalize_all(nmd);
+	if (err == ENOMEM && (nmd->flags & NETMAP_MEM_HUGEPAGES)) {
+		/* huge pages are only a preference */
+		struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+		D("%s: no huge pages, using normal pages", p->name);
+		nmd->flags &= ~NETMAP_MEM_HUGEPAGES;
+		err = netmap_config_obj_allocator(p, p->r_objtotal,
+				p->r_objsize, p->r_objmax, PAGE_SIZE);
+		if (!err)
+			err = netmap_mem_finalize_all(nmd);
+	}
 	if (!err)
 		nmd->active++;
 	return err;
@@ -1501,13 +1876,21 @@ netmap_mem_private_deref(struct netmap_mem_d *nmd)
  */
 struct netmap_mem_d *
 netmap_mem_private_new(const char *name, u_int txr, u_int txd,
-	u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes, int *perr)
+	u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes,
+	int numa_node, int hugepages, int *perr)
 {
 	struct netmap_mem_d *d = NULL;
 	struct netmap_obj_params p[NETMAP_POOLS_NR];
 	int i, err;
 	u_int v, maxd;
 
+	if (numa_node >= 0 && !nm_numa_node_valid(numa_node)) {
+		D("%s: no NUMA node %d", name, numa_node);
+		if (perr)
+			*perr = EINVAL;
+		return NULL;
+	}
+
 	d = malloc(sizeof(struct netmap_mem_d),
 		   M_DEVBUF, M_NOWAIT | M_ZERO);
 	if (d == NULL) {
@@ -1571,10 +1954,15 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 				nm_blueprint.pools[i].name,
 				name);
 		err = netmap_config_obj_allocator(&d->pools[i],
-				p[i].num, p[i].size);
+				p[i].num, p[i].size, 0,
+				(i == NETMAP_BUF_POOL && hugepages) ?
+				NM_HUGEPAGE_SIZE : PAGE_SIZE);
 		if (err)
 			goto error;
+		d->pools[i].numa_node = numa_node;
 	}
+	if (d->pools[NETMAP_BUF_POOL]._clustalign != PAGE_SIZE)
+		d->flags |= NETMAP_MEM_HUGEPAGES;
 
 	d->flags &= ~NETMAP_MEM_FINALIZED;
 
@@ -1614,7 +2002,8 @@ netmap_mem_global_config(struct netmap_mem_d *nmd)
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				netmap_params[i].num, netmap_params[i].size);
+				netmap_params[i].num, netmap_params[i].size,
+				netmap_params[i].max, PAGE_SIZE);
 		if (nmd->lasterr)
 			goto out;
 	}
@@ -1688,13 +2077,13 @@ netmap_free_rings(struct netmap_adapter *na)
 
 	for_rx_tx(t) {
 		u_int i;
-		for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = &NMR(na, t)[i];
 			struct netmap_ring *ring = kring->ring;
 
 			if (ring == NULL)
 				continue;
-			if (i != nma_get_nrings(na, t) || na->na_flags & NAF_HOST_RINGS)
+			if (i < nma_get_nrings(na, t) || na->na_flags & NAF_HOST_RINGS)
 				netmap_free_bufs(na->nm_mem, ring->slot, kring->nkr_num_slots);
 			netmap_ring_free(na->nm_mem, ring);
 			kring->ring = NULL;
@@ -1719,7 +2108,7 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 	for_rx_tx(t) {
 		u_int i;
 
-		for (i = 0; i <= nma_get_nrings(na, t); i++) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = &NMR(na, t)[i];
 			struct netmap_ring *ring = kring->ring;
 			u_int len, ndesc;
@@ -1753,7 +2142,7 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 			ND("%s h %d c %d t %d", kring->name,
 				ring->head, ring->cur, ring->tail);
 			ND("initializing slots for %s_ring", nm_txrx2str(txrx));
-			if (i != nma_get_nrings(na, t) || (na->na_flags & NAF_HOST_RINGS)) {
+			if (i < nma_get_nrings(na, t) || (na->na_flags & NAF_HOST_RINGS)) {
 				/* this is a real ring */
 				if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc)) {
 					D("Cannot allocate buffers for %s_ring", nm_txrx2str(t));
@@ -1812,7 +2201,7 @@ netmap_mem2_if_new(struct netmap_adapter *na)
 	ntot = 0;
 	for_rx_tx(t) {
 		/* account for the (eventually fake) host rings */
-		n[t] = nma_get_nrings(na, t) + 1;
+		n[t] = netmap_all_rings(na, t);
 		ntot += n[t];
 	}
 	/*
@@ -1832,7 +2221,10 @@ netmap_mem2_if_new(struct netmap_adapter *na)
 	/* initialize base fields -- override const */
 	*(u_int *)(uintptr_t)&nifp->ni_tx_rings = na->num_tx_rings;
 	*(u_int *)(uintptr_t)&nifp->ni_rx_rings = na->num_rx_rings;
+	*(u_int *)(uintptr_t)&nifp->ni_host_tx_rings = na->num_host_tx_rings;
+	*(u_int *)(uintptr_t)&nifp->ni_host_rx_rings = na->num_host_rx_rings;
 	strncpy(nifp->ni_name, na->name, (size_t)IFNAMSIZ);
+	nifp->ni_bufs_head = 0;	/* no extra buffers yet */
 
 	/*
 	 * fill the slots for the rx and tx rings. They contain the offset
@@ -1861,8 +2253,6 @@ netmap_mem2_if_delete(struct netmap_adapter *na, struct netmap_if *nifp)
 		/* nothing to do */
 		return;
 	NMA_LOCK(na->nm_mem);
-	if (nifp->ni_bufs_head)
-		netmap_extra_free(na, nifp->ni_bufs_head);
 	netmap_if_free(na->nm_mem, nifp);
 
 	NMA_UNLOCK(na->nm_mem);
@@ -2059,6 +2449,7 @@ netmap_mem_pt_guest_read_shared_info(struct netmap_mem_d *nmd)
 
 	ptnmd->buf_lut.objtotal = nbuffers;
 	ptnmd->buf_lut.objsize = bufsize;
+	ptnmd->buf_lut.base = ptnmd->buf_lut.lut[0].vaddr;
 
         nmd->nm_totalsize = nms_info->totalsize;
 
@@ -2272,7 +2663,7 @@ netmap_mem_pt_guest_rings_create(struct netmap_adapter *na)
 			continue;
 		kring->ring = (struct netmap_ring *)
 			((char *)nifp +
-			 nifp->ring_ofs[i + na->num_tx_rings + 1]);
+			 nifp->ring_ofs[i + na->num_tx_rings + nifp->ni_host_tx_rings]);
 	}
 
 	//error = ptif->ptctl->nm_ptctl(ifp, NET_PARAVIRT_PTCTL_RINGSCREATE);
@@ -135,7 +135,7 @@ int	   netmap_mem_get_info(struct netmap_mem_d *, u_int *size, u_int *memflags,
 ssize_t    netmap_mem_if_offset(struct netmap_mem_d *, const void *vaddr);
 struct netmap_mem_d* netmap_mem_private_new(const char *name,
 	u_int txr, u_int txd, u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes,
-	int* error);
+	int numa_node, int hugepages, int* error);
 void	   netmap_mem_delete(struct netmap_mem_d *);
 
 //#define NM_DEBUG_MEM_PUTGET 1
@@ -172,7 +172,10 @@ int netmap_mem_pt_guest_ifp_del(struct netmap_mem_d *, struct ifnet *);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
+#define NETMAP_MEM_HUGEPAGES	0x8	/* buffer clusters are huge pages */
 
-uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
+int netmap_extra_alloc(struct netmap_priv_d *, uint32_t *n, int partial);
+int netmap_extra_free(struct netmap_priv_d *, uint32_t *n);
+void netmap_extra_free_all(struct netmap_priv_d *);
 
 #endif
@@ -158,11 +158,15 @@ static int
 netmap_monitor_krings_create(struct netmap_adapter *na)
 {
 	int error = netmap_krings_create(na, 0);
+	u_int i;
+
 	if (error)
 		return error;
 	/* override the host rings callbacks */
-	na->tx_rings[na->num_tx_rings].nm_sync = netmap_monitor_txsync;
-	na->rx_rings[na->num_rx_rings].nm_sync = netmap_monitor_rxsync;
+	for (i = na->num_tx_rings; i < netmap_all_rings(na, NR_TX); i++)
+		na->tx_rings[i].nm_sync = netmap_monitor_txsync;
+	for (i = na->num_rx_rings; i < netmap_all_rings(na, NR_RX); i++)
+		na->rx_rings[i].nm_sync = netmap_monitor_rxsync;
 	return 0;
 }
 
@@ -326,7 +330,7 @@ netmap_monitor_stop(struct netmap_adapter *na)
 	for_rx_tx(t) {
 		u_int i;
 
-		for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = &NMR(na, t)[i];
 			u_int j;
 
@@ -837,6 +841,14 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna->up.num_rx_rings = pna->num_rx_rings;
 	if (pna->num_tx_rings > pna->num_rx_rings)
 		mna->up.num_rx_rings = pna->num_tx_rings;
+	/* monitor rings are indexed as the parent rings, so we need
+	 * enough host rings to cover the host rings of the parent
+	 */
+	mna->up.num_host_tx_rings = 1;
+	mna->up.num_host_rx_rings = netmap_all_rings(pna, NR_RX);
+	if (netmap_all_rings(pna, NR_TX) > mna->up.num_host_rx_rings)
+		mna->up.num_host_rx_rings = netmap_all_rings(pna, NR_TX);
+	mna->up.num_host_rx_rings -= mna->up.num_rx_rings;
 	/* by default, the number of slots is the same as in
 	 * the parent rings, but the user may ask for a different
 	 * number
@@ -57,40 +57,91 @@
 
 #include <net/netmap.h>
 #include <dev/netmap/netmap_kern.h>
+#include <net/netmap_csum.h>
 
 
 
+/*
+ * Checksum template of a GSO packet, computed once from the original
+ * header and updated incrementally for each segment with the fields
+ * that change: IPv4 'Total Length' and 'Identification', TCP sequence
+ * number and flags, UDP length, and the pseudo-header length.
+ */
+struct gso_csum_tmpl {
+	uint64_t	ip_sum;	/* IPv4 header w/o tot_len, id, check */
+	uint64_t	l4_sum;	/* pseudo-header w/o length, plus the TCP/UDP
+				 * header w/o seq, flags, len and check */
+};
+
+static void
+gso_csum_tmpl_init(struct gso_csum_tmpl *t, const uint8_t *pkt, u_int ipv4,
+		   u_int iphlen, u_int tcp)
+{
+	const uint8_t *l4 = pkt + iphlen;
+
+	if (ipv4) {
+		const struct nm_iphdr *iph = (const struct nm_iphdr *)pkt;
+
+		t->ip_sum = nm_csum_partial(pkt, 2)
+			  + nm_csum_partial(pkt + 6, 4)
+			  + nm_csum_partial(pkt + 12, iphlen - 12);
+		t->l4_sum = nm_csum_partial(pkt + 12, 8)
+			  + htobe16(iph->protocol);
+	} else {
+		const struct nm_ipv6hdr *ip6h = (const struct nm_ipv6hdr *)pkt;
+
+		t->ip_sum = 0;
+		t->l4_sum = nm_csum_partial(pkt + 8, 32)
+			  + htobe16(ip6h->nexthdr);
+	}
+
+	if (tcp) {
+		u_int thlen = 4 * (((const struct nm_tcphdr *)l4)->doff >> 4);
+
+		/* skip seq (4..7), doff/flags (12..13) and check (16..17) */
+		t->l4_sum += nm_csum_partial(l4, 4)
+			   + nm_csum_partial(l4 + 8, 4)
+			   + nm_csum_partial(l4 + 14, 2)
+			   + nm_csum_partial(l4 + 18, thlen - 18);
+	} else {
+		/* skip len and check */
+		t->l4_sum += nm_csum_partial(l4, 4);
+	}
+}
+
 /* This routine is called by bdg_mismatch_datapath() when it finishes
  * accumulating bytes for a segment, in order to fix some fields in the
  * segment headers (which still contain the same content as the header
  * of the original GSO packet). 'pkt' points to the beginning of the IP
  * header of the segment, while 'len' is the length of the IP packet.
+ * Checksums are derived from the template 't' and from 'payload_sum',
+ * the sum of the segment payload accumulated while copying it.
  */
 static void
 gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
-		u_int idx, u_int segmented_bytes, u_int last_segment)
+		u_int idx, u_int segmented_bytes, u_int last_segment,
+		const struct gso_csum_tmpl *t, uint64_t payload_sum)
 {
 	struct nm_iphdr *iph = (struct nm_iphdr *)(pkt);
 	struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(pkt);
-	uint16_t *check = NULL;
-	uint8_t *check_data = NULL;
+	uint16_t l4len = htobe16(len - iphlen);
+	uint64_t sum = t->l4_sum + l4len + payload_sum;
 
 	if (ipv4) {
 		/* Set the IPv4 "Total Length" field. */
 		iph->tot_len = htobe16(len);
-		ND("ip total length %u", be16toh(ip->tot_len));
+		ND("ip total length %u", be16toh(iph->tot_len));
 
 		/* Set the IPv4 "Identification" field. */
 		iph->id = htobe16(be16toh(iph->id) + idx);
 		ND("ip identification %u", be16toh(iph->id));
 
-		/* Compute and insert the IPv4 header checksum. */
-		iph->check = 0;
-		iph->check = nm_os_csum_ipv4(iph);
+		/* Insert the IPv4 header checksum. */
+		iph->check = nm_csum_wrap(t->ip_sum + iph->tot_len + iph->id);
 		ND("IP csum %x", be16toh(iph->check));
 	} else {
 		/* Set the IPv6 "Payload Len" field. */
-		ip6h->payload_len = htobe16(len-iphlen);
+		ip6h->payload_len = l4len;
 	}
 
 	if (tcp) {
@@ -106,26 +157,23 @@ gso_fix_segment(uint8_t *pkt, size_t len, u_int ipv4, u_int iphlen, u_int tcp,
 			tcph->flags &= ~(0x8 | 0x1);
 		ND("last_segment %u", last_segment);
 
-		check = &tcph->check;
-		check_data = (uint8_t *)tcph;
+		/* Insert the TCP checksum. */
+		sum += nm_csum_partial(&tcph->seq, 4)
+		     + nm_csum_partial(&tcph->doff, 2);
+		tcph->check = nm_csum_wrap(sum);
+		ND("TCP csum %x", be16toh(tcph->check));
 	} else { /* UDP */
 		struct nm_udphdr *udph = (struct nm_udphdr *)(pkt + iphlen);
 
 		/* Set the UDP 'Length' field. */
-		udph->len = htobe16(len-iphlen);
+		udph->len = l4len;
 
-		check = &udph->check;
-		check_data = (uint8_t *)udph;
+		/* Insert the UDP checksum, 0 is sent as all ones. */
+		udph->check = nm_csum_wrap(sum + l4len);
+		if (udph->check == 0)
+			udph->check = 0xFFFF;
+		ND("UDP csum %x", be16toh(udph->check));
 	}
-
-	/* Compute and insert TCP/UDP checksum. */
-	*check = 0;
-	if (ipv4)
-		nm_os_csum_tcpudp_ipv4(iph, check_data, len-iphlen, check);
-	else
-		nm_os_csum_tcpudp_ipv6(ip6h, check_data, len-iphlen, check);
-
-	ND("TCP/UDP csum %x", be16toh(*check));
 }
 
 static int
@@ -254,10 +302,15 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		/* Is this a TCP or an UDP GSO packet? */
 		u_int tcp = ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
 				== VIRTIO_NET_HDR_GSO_UDP) ? 0 : 1;
+		/* Checksum template built from the GSO packet header. */
+		struct gso_csum_tmpl tmpl;
+		/* Sum of the payload of the current segment. */
+		uint64_t payload_sum = 0;
 
 		/* Segment the GSO packet contained into the input slots (frags). */
 		for (;;) {
 			size_t copy;
+			uint16_t csum;
 
 			if (dst_slots >= *howmany) {
 				/* We still have work to do, but we've run out of
@@ -342,6 +395,8 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 
 				ND(3, "gso_hdr_len %u gso_mtu %d", gso_hdr_len,
 								   dst_na->mfs);
+				gso_csum_tmpl_init(&tmpl, gso_hdr + ethhlen,
+						   ipv4, iphlen, tcp);
 
 				/* Advance source pointers. */
 				src += gso_hdr_len;
@@ -361,11 +416,19 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				gso_bytes = gso_hdr_len;
 			}
 
-			/* Fill in data and update source and dest pointers. */
+			/* Fill in data and update source and dest pointers,
+			 * summing the payload while we copy it. The header
+			 * length is even, so a chunk starting at an odd
+			 * offset in the segment has its sum byte swapped.
+			 */
 			copy = src_len;
 			if (gso_bytes + copy > dst_na->mfs)
 				copy = dst_na->mfs - gso_bytes;
-			memcpy(dst + gso_bytes, src, copy);
+			csum = nm_csum_fold16(nm_csum_copy(src,
+						dst + gso_bytes, copy));
+			if (gso_bytes & 1)
+				csum = nm_csum_swab(csum);
+			payload_sum += csum;
 			gso_bytes += copy;
 			src += copy;
 			src_len -= copy;
@@ -380,7 +443,8 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				gso_fix_segment(dst + ethhlen, gso_bytes - ethhlen,
 						ipv4, iphlen, tcp,
 						gso_idx, segmented_bytes,
-						src_len == 0 && ft_p + 1 == ft_end);
+						src_len == 0 && ft_p + 1 == ft_end,
+						&tmpl, payload_sum);
 
 				ND("frame %u completed with %d bytes", gso_idx, (int)gso_bytes);
 				dst_slot->len = gso_bytes;
@@ -389,6 +453,7 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				segmented_bytes += gso_bytes - gso_hdr_len;
 
 				gso_bytes = 0;
+				payload_sum = 0;
 				gso_idx++;
 
 				/* Next destination slot. */
@@ -412,7 +477,9 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		/* Address of a checksum field into a destination slot. */
 		uint16_t *check = NULL;
 		/* Accumulator for an unfolded checksum. */
-		rawsum_t csum = 0;
+		uint64_t csum = 0;
+		/* Bytes summed so far, to track the parity of each slot. */
+		u_int csum_bytes = 0;
 
 		/* Process a non-GSO packet. */
 
@@ -426,25 +493,31 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		}
 
 		while (ft_p != ft_end) {
-			/* Init/update the packet checksum if needed. */
-			if (vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-				if (!dst_slots)
-					csum = nm_os_csum_raw(src + vh->csum_start,
-								src_len - vh->csum_start, 0);
-				else
-					csum = nm_os_csum_raw(src, src_len, csum);
-			}
-
-			/* Round to a multiple of 64 */
-			src_len = (src_len + 63) & ~63;
+			/* The checksum covers the first slot from csum_start. */
+			u_int skip = (check && !dst_slots) ? vh->csum_start : 0;
+			uint16_t s = 0;
 
 			if (ft_p->ft_flags & NS_INDIRECT) {
-				if (copyin(src, dst, src_len)) {
+				/* Round to a multiple of 64 */
+				if (copyin(src, dst, (src_len + 63) & ~63)) {
 					/* Invalid user pointer, pretend len is 0. */
 					dst_len = 0;
+				} else if (check) {
+					s = nm_csum_fold16(nm_csum_partial(dst + skip,
+							src_len - skip));
 				}
+			} else if (check) {
+				/* Copy and update the checksum in a single pass. */
+				memcpy(dst, src, skip);
+				s = nm_csum_fold16(nm_csum_copy(src + skip,
+						dst + skip, src_len - skip));
 			} else {
-				memcpy(dst, src, (int)src_len);
+				/* Round to a multiple of 64 */
+				memcpy(dst, src, (int)((src_len + 63) & ~63));
+			}
+			if (check) {
+				csum += (csum_bytes & 1) ? nm_csum_swab(s) : s;
+				csum_bytes += src_len - skip;
 			}
 			dst_slot->len = dst_len;
 			dst_slots++;
@@ -461,8 +534,8 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		}
 
 		/* Finalize (fold) the checksum if needed. */
-		if (check && vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-			*check = nm_os_csum_fold(csum);
+		if (check) {
+			*check = nm_csum_wrap(csum);
 		}
 		ND(3, "using %u dst_slots", dst_slots);
 
@@ -486,3 +559,335 @@ bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	*j = j_cur;
 	*howmany -= dst_slots;
 }
+
+/*
+ * Receive coalescing (GRO) for destinations using virtio-net headers.
+ *
+ * In-order TCP segments of the same flow, queued one after the other
+ * to the same destination ring within a batch, are merged into a single
+ * multi-slot frame carrying a GSO virtio-net header, so that the guest
+ * sees one packet instead of many. The rules are those of the Linux
+ * GRO engine: same addresses, ports, ack, window and options, only
+ * ACK (and PSH on the last segment) set, consecutive sequence numbers,
+ * all segments but the last one of the same (MSS) size.
+ * Segments without a trusted checksum are verified while they are
+ * copied; the merged frame asks the receiver to complete the TCP
+ * checksum (VIRTIO_NET_HDR_F_NEEDS_CSUM).
+ */
+
+struct nm_gro_pkt {
+	uint8_t		*eth;	/* start of the ethernet header */
+	uint8_t		*l4;	/* start of the TCP header */
+	u_int		l3len;	/* IP header length */
+	u_int		l4len;	/* TCP header length */
+	u_int		plen;	/* TCP payload length */
+	uint32_t	seq;	/* host order */
+	uint8_t		ipv4;
+	uint8_t		flags;	/* TCP flags */
+	uint8_t		trusted; /* checksum need not be verified */
+};
+
+#define NM_TCP_PSH	0x08
+#define NM_TCP_ACK	0x10
+
+/* Decode a single-slot TCP packet, return 0 if it cannot be merged. */
+static int
+gro_parse(struct netmap_vp_adapter *na, const struct nm_bdg_fwd *ft_p,
+	  struct nm_gro_pkt *p)
+{
+	uint8_t *buf = ft_p->ft_buf;
+	u_int len = ft_p->ft_len, tot;
+	u_int vhl = na->up.virt_hdr_len;
+	struct nm_tcphdr *tcph;
+	uint16_t ethertype;
+
+	if (ft_p->ft_frags != 1 || (ft_p->ft_flags & NS_INDIRECT) ||
+	    len < vhl + 14 + 20 + 20)
+		return 0;
+	p->trusted = 0;
+	if (vhl) {
+		struct nm_vnet_hdr *vh = (struct nm_vnet_hdr *)buf;
+
+		if (vh->gso_type != VIRTIO_NET_HDR_GSO_NONE)
+			return 0;
+		p->trusted = !!(vh->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+					     VIRTIO_NET_HDR_F_DATA_VALID));
+		buf += vhl;
+		len -= vhl;
+	}
+	p->eth = buf;
+	ethertype = be16toh(*(uint16_t *)(buf + 12));
+	if (ethertype == 0x0800) {
+		struct nm_iphdr *iph = (struct nm_iphdr *)(buf + 14);
+
+		/* no options, no fragments */
+		if (iph->version_ihl != 0x45 || iph->protocol != 6 ||
+		    (iph->frag_off & htobe16(0x3FFF)))
+			return 0;
+		if (!p->trusted && nm_csum_fold16(nm_csum_partial(iph, 20))
+				!= 0xFFFF)
+			return 0;
+		p->ipv4 = 1;
+		p->l3len = 20;
+		tot = be16toh(iph->tot_len);
+	} else if (ethertype == 0x86DD) {
+		struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(buf + 14);
+
+		if (ip6h->nexthdr != 6)
+			return 0;
+		p->ipv4 = 0;
+		p->l3len = 40;
+		tot = 40 + be16toh(ip6h->payload_len);
+	} else {
+		return 0;
+	}
+	if (tot > len - 14 || tot < p->l3len + 20)
+		return 0;
+	p->l4 = buf + 14 + p->l3len;
+	tcph = (struct nm_tcphdr *)p->l4;
+	p->l4len = 4 * (tcph->doff >> 4);
+	if (p->l4len < 20 || p->l3len + p->l4len >= tot)
+		return 0;
+	p->plen = tot - p->l3len - p->l4len;
+	p->flags = tcph->flags;
+	if ((p->flags & ~NM_TCP_PSH) != NM_TCP_ACK)
+		return 0;
+	p->seq = be32toh(tcph->seq);
+	return 1;
+}
+
+/*
+ * Can 'c' be appended to a frame that starts with 'f' and whose
+ * last segment is 'prev' ?
+ */
+static int
+gro_match(const struct nm_gro_pkt *f, const struct nm_gro_pkt *prev,
+	  const struct nm_gro_pkt *c)
+{
+	const struct nm_tcphdr *pt = (const struct nm_tcphdr *)prev->l4;
+	const struct nm_tcphdr *ct = (const struct nm_tcphdr *)c->l4;
+
+	if (c->ipv4 != f->ipv4 || c->l4len != f->l4len ||
+	    prev->plen != f->plen || c->plen > f->plen ||
+	    (prev->flags & NM_TCP_PSH) || c->seq != prev->seq + prev->plen)
+		return 0;
+	if (memcmp(c->eth, f->eth, 12))
+		return 0;
+	if (c->ipv4) {
+		const struct nm_iphdr *pi = (const struct nm_iphdr *)
+						(prev->eth + 14);
+		const struct nm_iphdr *ci = (const struct nm_iphdr *)
+						(c->eth + 14);
+
+		if (ci->saddr != pi->saddr || ci->daddr != pi->daddr ||
+		    ci->tos != pi->tos || ci->ttl != pi->ttl)
+			return 0;
+		/* the segmenter will rebuild ids as first + index */
+		if (be16toh(ci->id) != (uint16_t)(be16toh(pi->id) + 1) &&
+		    !(ci->frag_off & pi->frag_off & htobe16(0x4000)))
+			return 0;
+	} else {
+		/* version, class, flow label, then addresses */
+		if (memcmp(c->eth + 14, prev->eth + 14, 4) ||
+		    c->eth[14 + 7] != prev->eth[14 + 7] ||
+		    memcmp(c->eth + 14 + 8, prev->eth + 14 + 8, 32))
+			return 0;
+	}
+	/* ports, ack, window and options */
+	return (!memcmp(ct, pt, 4) && ct->ack_seq == pt->ack_seq &&
+		ct->window == pt->window &&
+		!memcmp(ct + 1, pt + 1, c->l4len - 20));
+}
+
+/* Sum of the TCP pseudo-header for a segment with 'l4len' bytes. */
+static inline uint64_t
+gro_pseudo_sum(const struct nm_gro_pkt *p, u_int l4len)
+{
+	uint64_t sum = htobe16(6) + htobe16(l4len);
+
+	if (p->ipv4)
+		return sum + nm_csum_partial(p->eth + 14 + 12, 8);
+	return sum + nm_csum_partial(p->eth + 14 + 8, 32);
+}
+
+/* Output position in the destination ring while building a frame. */
+struct nm_gro_wr {
+	struct netmap_adapter *na;
+	struct netmap_ring *ring;
+	u_int		lim;
+	u_int		j;	/* current slot */
+	u_int		slots;	/* slots used, including the current one */
+	u_int		off;	/* offset in the current slot */
+	uint8_t		*dst;	/* buffer of the current slot */
+};
+
+/*
+ * Append 'len' bytes to the frame and return their sum, taken as if
+ * the block started at an even offset.
+ */
+static uint64_t
+gro_copy(struct nm_gro_wr *w, const uint8_t *src, u_int len)
+{
+	u_int bufsz = NETMAP_BUF_SIZE(w->na), done = 0;
+	uint64_t sum = 0;
+
+	while (done < len) {
+		u_int copy = bufsz - w->off;
+		uint16_t s;
+
+		if (copy == 0) {
+			w->ring->slot[w->j].len = bufsz;
+			w->j = nm_next(w->j, w->lim);
+			w->dst = NMB(w->na, &w->ring->slot[w->j]);
+			w->off = 0;
+			w->slots++;
+			continue;
+		}
+		if (copy > len - done)
+			copy = len - done;
+		s = nm_csum_fold16(nm_csum_copy(src + done, w->dst + w->off,
+						copy));
+		sum += (done & 1) ? nm_csum_swab(s) : s;
+		w->off += copy;
+		done += copy;
+	}
+	return sum;
+}
+
+/*
+ * Try to coalesce 'ft_p' with the packets that follow it in the
+ * destination queue (starting at *next, stopping at brd_next to keep
+ * the ordering with broadcast traffic), up to 'max_segs' segments.
+ * On success the frame is written at *j, *j, *howmany and *next are
+ * updated, and the number of input packets consumed is returned.
+ * 0 means that nothing was done and ft_p must be forwarded as usual.
+ */
+u_int
+bdg_gro_datapath(struct netmap_vp_adapter *na,
+		 struct netmap_vp_adapter *dst_na,
+		 struct nm_bdg_fwd *ft, struct nm_bdg_fwd *ft_p,
+		 u_int *next, u_int brd_next, u_int max_segs,
+		 struct netmap_ring *dst_ring,
+		 u_int *j, u_int lim, u_int *howmany)
+{
+	u_int dvhl = dst_na->up.virt_hdr_len;
+	u_int bufsz = NETMAP_BUF_SIZE(&dst_na->up);
+	struct nm_gro_pkt f, prev, c;
+	struct nm_gro_wr w, saved;
+	u_int hlen, bytes, segs = 1, payload = 0, i, k;
+	u_int last = *next;	/* first packet not merged */
+	struct nm_vnet_hdr *vh;
+	uint8_t *hdr;
+	uint64_t sum;
+
+	if (!gro_parse(na, ft_p, &f))
+		return 0;
+	hlen = 14 + f.l3len + f.l4len;
+	bytes = dvhl + hlen + f.plen;
+	prev = f;
+
+	/* find the run of mergeable packets */
+	while (segs < max_segs && last < brd_next) {
+		struct nm_bdg_fwd *cf = ft + last;
+
+		if (!gro_parse(na, cf, &c) || !gro_match(&f, &prev, &c))
+			break;
+		if (bytes - dvhl - 14 + c.plen > 65535 ||
+		    (bytes + c.plen + bufsz - 1) / bufsz > *howmany)
+			break;
+		bytes += c.plen;
+		prev = c;
+		segs++;
+		last = cf->ft_next;
+	}
+	if (segs < 2)
+		return 0;
+
+	/* first slot: virtio-net header and protocol headers */
+	w.na = &dst_na->up;
+	w.ring = dst_ring;
+	w.lim = lim;
+	w.j = *j;
+	w.slots = 1;
+	w.dst = NMB(w.na, &dst_ring->slot[w.j]);
+	bzero(w.dst, dvhl);
+	w.off = dvhl;
+	hdr = w.dst + dvhl;
+	gro_copy(&w, f.eth, hlen);
+
+	/* payloads, verifying the checksums we cannot trust */
+	for (i = 0, k = ft_p - ft; i < segs; i++) {
+		struct nm_bdg_fwd *cf = ft + k;
+
+		gro_parse(na, cf, &c);
+		saved = w;
+		sum = gro_copy(&w, c.l4 + c.l4len, c.plen);
+		if (!c.trusted) {
+			sum += gro_pseudo_sum(&c, c.l4len + c.plen) +
+			       nm_csum_partial(c.l4, c.l4len);
+			if (nm_csum_fold16(sum) != 0xFFFF) {
+				RD(3, "bad TCP checksum, stop merging");
+				w = saved;
+				break;
+			}
+		}
+		payload += c.plen;
+		prev = c;
+		k = cf->ft_next;
+	}
+	if (i == 0)
+		return 0; /* the first one is bad, take the normal path */
+
+	vh = (struct nm_vnet_hdr *)(hdr - dvhl);
+	if (i == 1) {
+		/* A single segment, headers are unchanged. Keep the
+		 * source virtio-net header if any, otherwise we have
+		 * just verified the checksum. */
+		if (na->up.virt_hdr_len)
+			memcpy(vh, ft_p->ft_buf, sizeof(*vh));
+		else
+			vh->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+	} else {
+		struct nm_tcphdr *tcph = (struct nm_tcphdr *)
+						(hdr + 14 + f.l3len);
+		u_int l4tot = f.l4len + payload;
+
+		if (f.ipv4) {
+			struct nm_iphdr *iph = (struct nm_iphdr *)(hdr + 14);
+
+			iph->tot_len = htobe16(f.l3len + l4tot);
+			iph->check = 0;
+			iph->check = nm_csum_wrap(nm_csum_partial(iph, 20));
+		} else {
+			struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)
+							(hdr + 14);
+
+			ip6h->payload_len = htobe16(l4tot);
+		}
+		tcph->flags |= prev.flags & NM_TCP_PSH;
+		/* the receiver completes the sum, starting from the
+		 * pseudo-header one */
+		tcph->check = nm_csum_fold16(gro_pseudo_sum(&f, l4tot));
+		vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh->gso_type = f.ipv4 ? VIRTIO_NET_HDR_GSO_TCPV4 :
+					VIRTIO_NET_HDR_GSO_TCPV6;
+		vh->hdr_len = hlen;
+		vh->gso_size = f.plen;
+		vh->csum_start = 14 + f.l3len;
+		vh->csum_offset = 16; /* offsetof(struct nm_tcphdr, check) */
+	}
+
+	/* advance the queue past the merged packets */
+	*next = k;
+
+	/* close the chain of slots */
+	dst_ring->slot[w.j].len = w.off;
+	for (k = *j; k != w.j; k = nm_next(k, lim))
+		dst_ring->slot[k].flags = (w.slots << 8) | NS_MOREFRAG;
+	dst_ring->slot[w.j].flags = (w.slots << 8);
+
+	ND(3, "merged %u segments in %u slots", i, w.slots);
+	*j = nm_next(w.j, lim);
+	*howmany -= w.slots;
+	return i;
+}
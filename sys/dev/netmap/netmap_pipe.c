@@ -336,7 +336,7 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 
 		/* update our hidden ring pointers */
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++)
+			for (i = 0; i < netmap_all_rings(na, t); i++)
 				NMR(na, t)[i].save_ring = NMR(na, t)[i].ring;
 		}
 
@@ -350,7 +350,7 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 			goto del_krings2;
 
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(ona, t) + 1; i++)
+			for (i = 0; i < netmap_all_rings(ona, t); i++)
 				NMR(ona, t)[i].save_ring = NMR(ona, t)[i].ring;
 		}
 
@@ -368,7 +368,7 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 		/* recover the hidden rings */
 		ND("%p: case 2, hidden rings", na);
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++)
+			for (i = 0; i < netmap_all_rings(na, t); i++)
 				NMR(na, t)[i].ring = NMR(na, t)[i].save_ring;
 		}
 	}
@@ -427,7 +427,7 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 	ND("%p: onoff %d", na, onoff);
 	if (onoff) {
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
 				if (nm_kring_pending_on(kring))
@@ -440,7 +440,7 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 		if (na->active_fds == 0)
 			na->na_flags &= ~NAF_NETMAP_ON;
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
 				if (nm_kring_pending_off(kring))
@@ -468,7 +468,7 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 		pna->peer->peer_ref = 1;
 		/* hide our rings from netmap_mem_rings_delete */
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
 				NMR(na, t)[i].ring = NULL;
 			}
 		}
@@ -521,7 +521,7 @@ netmap_pipe_krings_delete(struct netmap_adapter *na)
 		return;
 	}
 	for_rx_tx(t) {
-		for (i = 0; i < nma_get_nrings(ona, t) + 1; i++)
+		for (i = 0; i < netmap_all_rings(ona, t); i++)
 			NMR(ona, t)[i].ring = NMR(ona, t)[i].save_ring;
 	}
 	netmap_mem_rings_delete(ona);
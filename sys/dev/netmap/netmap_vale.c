@@ -32,13 +32,13 @@
 NMG_LOCK() serializes all modifications to switches and ports.
 A switch cannot be deleted until all ports are gone.
 
-For each switch, an SX lock (RWlock on linux) protects
-deletion of ports. When configuring or deleting a new port, the
-lock is acquired in exclusive mode (after holding NMG_LOCK).
-When forwarding, the lock is acquired in shared mode (without NMG_LOCK).
-The lock is held throughout the entire forwarding cycle,
-during which the thread may incur in a page fault.
-Hence it is important that sleepable shared locks are used.
+Forwarding takes no lock on the switch. The ports and the lookup
+functions are in a state that is published by pointer and never
+modified: when configuring or deleting a port (holding NMG_LOCK)
+a new copy is published, and the old one is reused only after all
+the forwarding cycles that could see it are over (see nm_bdg_sync()).
+A forwarding cycle may incur in a page fault, this is fine as the
+writer simply waits.
 
 On the rx ring, the per-port lock is grabbed initially to reserve
 a number of slot in the ring, then the lock is released,
@@ -123,9 +123,13 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 /*
  * system parameters (most of them in netmap_kern.h)
  * NM_NAME	prefix for switch port names, default "vale"
- * NM_BDG_MAXPORTS	number of ports
- * NM_BRIDGES	max number of switches in the system.
- *	XXX should become a sysctl or tunable
+ * NM_BDG_MAXPORTS	max number of ports of a switch
+ * bridge_num	max number of switches in the system (or namespace),
+ *		read when the module is loaded (or the namespace created)
+ * bridge_ports	number of ports of a switch, read when the switch
+ *		is created. The forwarding scratch areas are sized
+ *		on this value.
+ * bridge_mcast	IGMP/MLD snooping on the switches created afterwards
  *
  * Switch ports are named valeX:Y where X is the switch name and Y
  * is the port. If Y matches a physical interface name, the port is
@@ -147,7 +151,17 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NM_MULTISEG)
 /* NM_FT_NULL terminates a list of slots in the ft */
 #define NM_FT_NULL		NM_BDG_BATCH_MAX
-#define	NM_BRIDGES		8	/* number of bridges */
+#define	NM_BRIDGES		64	/* default number of bridges */
+#define	NM_BRIDGES_MAX		4096
+#define	NM_BDG_PORTS		254	/* default ports per bridge */
+#define NM_CLS_MAXRULES		256	/* classifier rules per bridge */
+#define NM_CLS_MAXTUPLES	32	/* distinct masks per bridge */
+#define NM_CLS_HASH		512	/* buckets in the rule table */
+#define NM_CLS_CACHE		256	/* flow cache entries per ring */
+#define NM_MCAST_GROUPS		NM_BDG_HASH	/* see nm_bridge_rthash() */
+#define NM_MCAST_PROBES		8	/* max probes in the group table */
+#define NM_MCAST_BATCH		15	/* distinct groups in a batch */
+#define NM_MCAST_WORDS(n)	(((n) + 31) / 32)	/* port bitmap size */
 
 
 /*
@@ -156,14 +170,33 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * last packet in the block may overflow the size.
  */
 static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
+/*
+ * bridge_gro is the max number of TCP segments coalesced into a single
+ * frame for destinations with a virtio-net header, 0 (or 1) disables
+ * receive coalescing. See bdg_gro_datapath().
+ */
+static int bridge_gro = 0;
+static u_int bridge_num = NM_BRIDGES;
+static u_int bridge_ports = NM_BDG_PORTS;
+/*
+ * bridge_mcast enables IGMP/MLD snooping on the bridges created
+ * afterwards, see nm_mcast_lookup(). Otherwise multicast is flooded.
+ */
+static int bridge_mcast = 1;
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_gro, CTLFLAG_RW, &bridge_gro, 0 , "");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_num, CTLFLAG_RW, &bridge_num, 0 , "");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, bridge_ports, CTLFLAG_RW, &bridge_ports, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_mcast, CTLFLAG_RW, &bridge_mcast, 0 , "");
 SYSEND;
 
 static int netmap_vp_create(struct nmreq *, struct ifnet *, struct netmap_vp_adapter **);
 static int netmap_vp_reg(struct netmap_adapter *na, int onoff);
 static int netmap_bwrap_reg(struct netmap_adapter *, int onoff);
+static struct nm_mcast_table *nm_mcast_alloc(u_int nports);
+static void nm_mcast_port_gone(struct nm_bridge *b, int port);
 
 /*
  * For each output interface, nm_bdg_q is used to construct a list.
@@ -183,32 +216,116 @@ struct nm_hash_ent {
 };
 
 /*
- * nm_bridge is a descriptor for a VALE switch.
- * Interfaces for a bridge are all in bdg_ports[].
- * The array has fixed size, an empty entry does not terminate
- * the search, but lookups only occur on attach/detach so we
- * don't mind if they are slow.
- *
- * The bridge is non blocking on the transmit ports: excess
- * packets are dropped if there is no room on the output port.
+ * The classifier (NETMAP_BDG_CLS) does a tuple space search: rules
+ * with the same masks form a tuple, and each tuple is an exact match
+ * lookup of the masked packet key in a shared hash table. Tuples are
+ * sorted by the highest priority of their rules, so the search stops
+ * as soon as no remaining tuple can beat the current match.
+ * Each tx ring has a direct mapped flow cache in front of the search,
+ * which also remembers the flows without a match.
+ */
+struct nm_cls_key {
+	uint32_t	src;
+	uint32_t	dst;
+	uint16_t	sport;
+	uint16_t	dport;
+	uint32_t	proto;
+};
+
+struct nm_cls_ent {
+	struct nm_cls_key key;	/* masked */
+	struct nm_cls_key mask;
+	uint64_t	hits;	/* approximate, updated without locks */
+	uint16_t	id;
+	uint16_t	prio;
+	uint16_t	next;	/* hash chain */
+	uint8_t		tuple;
+	uint8_t		action;
+	uint16_t	port;
+	uint16_t	ring;
+};
+
+struct nm_cls_tuple {
+	struct nm_cls_key mask;
+	uint16_t	max_prio;
+};
+
+#define NM_CLS_NONE	0xffff	/* terminates hash chains, no rule */
+
+struct nm_cls_table {
+	uint32_t	gen;	/* from bdg_cls_gen when published */
+	u_int		nrules;
+	u_int		ntuples;
+	uint16_t	next_id;
+	uint16_t	ht[NM_CLS_HASH];
+	struct nm_cls_tuple tuples[NM_CLS_MAXTUPLES];
+	struct nm_cls_ent rules[NM_CLS_MAXRULES];
+};
+
+/* flow cache entry, in the forwarding scratch area of each tx ring */
+struct nm_cls_cent {
+	struct nm_cls_key key;
+	uint32_t	gen;	/* table gen when filled, 0 is invalid */
+	uint16_t	rule;	/* index in rules[], or NM_CLS_NONE */
+	uint16_t	_pad;
+};
+
+/* a packet (index in the ft) to be copied to another destination */
+struct nm_cls_mirror {
+	uint16_t	mi_pkt;
+	uint16_t	mi_dst;	/* port * NM_BDG_MAXRINGS + ring */
+};
+
+/*
+ * Multicast groups learned by IGMP/MLD snooping, keyed by their MAC
+ * address (groups that map to the same address share an entry), each
+ * with a bitmap of the member ports. Ports that send queries lead to
+ * multicast routers, and get the traffic of all the known groups.
+ * Unknown groups are flooded as before.
+ * There is no aging, members go away with a leave message or when
+ * the port leaves the bridge.
  *
- * bdg_lock protects accesses to the bdg_ports array.
- * This is a rw lock (or equivalent).
+ * The data path snoops under mc_lock and forwards without locks.
+ * Joins and leaves only flip bits, while moving an entry to another
+ * group makes its gen odd until done, so that readers can tell when
+ * their copy of the bitmap is not consistent, see nm_mcast_snap().
+ * Entries never go back to free, so the probe sequences stay valid.
  */
-struct nm_bridge {
-	/* XXX what is the proper alignment/layout ? */
-	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ports */
-	int		bdg_namelen;
-	uint32_t	bdg_active_ports; /* 0 means free */
-	char		bdg_basename[IFNAMSIZ];
+struct nm_mcast_ent {
+	uint64_t	mac;	/* 0 if never used */
+	volatile uint32_t gen;
+	uint32_t	nmemb;	/* bits set in the bitmap */
+};
+
+struct nm_mcast_table {
+	struct mtx	mc_lock;	/* serializes the updates */
+	u_int		mc_words;	/* in each bitmap */
+	uint32_t	*mc_routers;	/* ports where queries come from */
+	uint32_t	*mc_ports;	/* mc_words for each entry */
+	struct nm_mcast_ent mc_ents[NM_MCAST_GROUPS];
+};
+
+/*
+ * The forwarding state of a bridge: the ports and the lookup functions.
+ * The data path uses it without locks, so a published copy is never
+ * modified. Writers change the spare copy and swap the two,
+ * see nm_bdg_publish().
+ * Interfaces for a bridge are all in bdg_ports[].
+ * The array has bdg_max_ports entries, an empty entry does not
+ * terminate the search, but lookups only occur on attach/detach
+ * so we don't mind if they are slow.
+ */
+struct nm_bdg_state {
+	uint32_t	bdg_active_ports;
 
 	/* Indexes of active ports (up to active_ports)
 	 * and all other remaining ports.
+	 * Both arrays have bdg_max_ports entries and are allocated
+	 * together with the bridge.
 	 */
-	uint8_t		bdg_port_index[NM_BDG_MAXPORTS];
-
-	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
+	uint16_t	*bdg_port_index;
 
+	struct netmap_vp_adapter **bdg_ports;
 
 	/*
 	 * The function to decide the destination port.
@@ -220,6 +337,34 @@ struct nm_bridge {
 	 * This function must be set by netmap_bdg_ctl().
 	 */
 	struct netmap_bdg_ops bdg_ops;
+};
+
+/*
+ * nm_bridge is a descriptor for a VALE switch, allocated when the
+ * first port is attached and freed when the last one goes away.
+ *
+ * The bridge is non blocking on the transmit ports: excess
+ * packets are dropped if there is no room on the output port.
+ *
+ * Configuration changes are serialized by NMG_LOCK. bdg_lock is
+ * only used to keep the lookup functions in place while config()
+ * runs (without NMG_LOCK). This is a rw lock (or equivalent).
+ */
+struct nm_bridge {
+	/* XXX what is the proper alignment/layout ? */
+	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ops for config() */
+	int		bdg_namelen;
+	uint32_t	bdg_max_ports;	/* fixed at creation */
+	char		bdg_basename[IFNAMSIZ];
+
+	/* the current forwarding state, and a spare one for writers */
+	struct nm_bdg_state *bdg_state;
+	struct nm_bdg_state *bdg_spare;
+
+	struct nm_bridge **bdg_slot;	/* our entry in the bridges array,
+					 * NULL once the bridge is gone */
+	u_int		bdg_refs;	/* users without NMG_LOCK, see
+					 * netmap_bdg_config() */
 
 	/* the forwarding table, MAC+ports.
 	 * XXX should be changed to an argument to be passed to
@@ -227,6 +372,18 @@ struct nm_bridge {
 	 */
 	struct nm_hash_ent ht[NM_BDG_HASH];
 
+	/* 5-tuple classifier, NULL if there are no rules.
+	 * It is published like bdg_state, the two tables in
+	 * bdg_cls_tables take turns. Each published table has a new
+	 * gen, taken from bdg_cls_gen, which invalidates the flow caches.
+	 */
+	struct nm_cls_table *bdg_cls;
+	struct nm_cls_table *bdg_cls_tables;
+	uint32_t	bdg_cls_gen;
+
+	/* multicast groups, NULL if snooping is disabled */
+	struct nm_mcast_table *bdg_mcast;
+
 #ifdef CONFIG_NET_NS
 	struct net *ns;
 #endif /* CONFIG_NET_NS */
@@ -244,11 +401,11 @@ netmap_bdg_name(struct netmap_vp_adapter *vp)
 
 #ifndef CONFIG_NET_NS
 /*
- * XXX in principle nm_bridges could be created dynamically
- * Right now we have a static array and deletions are protected
- * by an exclusive lock.
+ * Array of pointers to the bridges, NULL entries are free.
+ * Creation and deletion of bridges are protected by NMG_LOCK.
  */
-static struct nm_bridge *nm_bridges;
+static struct nm_bridge **nm_bridges;
+static u_int nm_num_bridges;
 #endif /* !CONFIG_NET_NS */
 
 
@@ -293,8 +450,8 @@ static struct nm_bridge *
 nm_find_bridge(const char *name, int create)
 {
 	int i, l, namelen;
-	struct nm_bridge *b = NULL, *bridges;
-	u_int num_bridges;
+	struct nm_bridge *b = NULL, **bridges, **slot = NULL;
+	u_int num_bridges, nports;
 
 	NMG_LOCK_ASSERT();
 
@@ -318,11 +475,11 @@ nm_find_bridge(const char *name, int create)
 
 	/* lookup the name, remember empty slot if there is one */
 	for (i = 0; i < num_bridges; i++) {
-		struct nm_bridge *x = bridges + i;
+		struct nm_bridge *x = bridges[i];
 
-		if (x->bdg_active_ports == 0) {
-			if (create && b == NULL)
-				b = x;	/* record empty slot */
+		if (x == NULL) {
+			if (create && slot == NULL)
+				slot = &bridges[i];	/* record empty slot */
 		} else if (x->bdg_namelen != namelen) {
 			continue;
 		} else if (strncmp(name, x->bdg_basename, namelen) == 0) {
@@ -331,25 +488,168 @@ nm_find_bridge(const char *name, int create)
 			break;
 		}
 	}
-	if (i == num_bridges && b) { /* name not found, can create entry */
-		/* initialize the bridge */
+	if (i == num_bridges && slot) { /* name not found, can create entry */
+		struct nm_bdg_state *st;
+
+		nports = nm_bound_var(&bridge_ports, NM_BDG_PORTS, 2,
+			NM_BDG_MAXPORTS, "bridge_ports");
+		/* the bridge, two states and their arrays */
+		l = sizeof(*b) + 2 * (sizeof(*st) + nports *
+			(sizeof(st->bdg_ports[0]) +
+			 sizeof(st->bdg_port_index[0])));
+		b = malloc(l, M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (b == NULL)
+			return NULL;
+		/* initialize the bridge, the MAC address table is empty */
+		BDG_RWINIT(b);
+		st = (struct nm_bdg_state *)(b + 1);
+		st[0].bdg_ports = (struct netmap_vp_adapter **)(st + 2);
+		st[1].bdg_ports = st[0].bdg_ports + nports;
+		st[0].bdg_port_index = (uint16_t *)(st[1].bdg_ports + nports);
+		st[1].bdg_port_index = st[0].bdg_port_index + nports;
+		b->bdg_state = &st[0];
+		b->bdg_spare = &st[1];
+		b->bdg_max_ports = nports;
 		strncpy(b->bdg_basename, name, namelen);
 		ND("create new bridge %s with ports %d", b->bdg_basename,
-			b->bdg_active_ports);
+			nports);
 		b->bdg_namelen = namelen;
-		b->bdg_active_ports = 0;
-		for (i = 0; i < NM_BDG_MAXPORTS; i++)
-			b->bdg_port_index[i] = i;
+		for (i = 0; i < nports; i++)
+			st[0].bdg_port_index[i] = i;
 		/* set the default function */
-		b->bdg_ops.lookup = netmap_bdg_learning;
-		/* reset the MAC address table */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		st[0].bdg_ops.lookup = netmap_bdg_learning;
+		if (bridge_mcast)
+			b->bdg_mcast = nm_mcast_alloc(nports);
 		NM_BNS_GET(b);
+		b->bdg_slot = slot;
+		*slot = b;
 	}
 	return b;
 }
 
 
+/* MUST BE CALLED WITH NMG_LOCK() */
+static void
+nm_destroy_bridge(struct nm_bridge *b)
+{
+	ND("freeing bridge %s", b->bdg_basename);
+	if (b->bdg_cls_tables)
+		free(b->bdg_cls_tables, M_DEVBUF);
+	if (b->bdg_mcast) {
+		mtx_destroy(&b->bdg_mcast->mc_lock);
+		free(b->bdg_mcast, M_DEVBUF);
+	}
+	BDG_RWDESTROY(b);
+	free(b, M_DEVBUF);
+}
+
+/*
+ * Release a bridge with no ports left. It cannot be found any more,
+ * but it is only destroyed when the last reference (nm_bdg_get())
+ * is dropped.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_free_bridge(struct nm_bridge *b)
+{
+	NM_BNS_PUT(b);
+	*b->bdg_slot = NULL;
+	b->bdg_slot = NULL;
+	if (b->bdg_refs == 0)
+		nm_destroy_bridge(b);
+}
+
+/*
+ * Keep a bridge from going away while NMG_LOCK is released.
+ * Both MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_bdg_get(struct nm_bridge *b)
+{
+	b->bdg_refs++;
+}
+
+static void
+nm_bdg_put(struct nm_bridge *b)
+{
+	if (--b->bdg_refs == 0 && b->bdg_slot == NULL)
+		nm_destroy_bridge(b);
+}
+
+
+/*
+ * Lockless reconfiguration.
+ * nm_bdg_preflush() takes no locks on the bridge. Each flush reads
+ * b->bdg_state and b->bdg_cls once and uses them until it returns.
+ * Writers (which hold NMG_LOCK) never modify a published state:
+ * they get a copy with nm_bdg_wstate(), change it and install it
+ * with nm_bdg_publish(), which waits until no flush can be using the
+ * old state and then keeps it as the next spare. So attach/detach
+ * neither stalls nor drops traffic on the other ports, and does
+ * not allocate memory.
+ *
+ * Flushes in progress are tracked in nkr_bdg_seq in the source kring,
+ * which is odd while the kring is flushing. nm_bdg_sync() waits until
+ * the counters found odd have changed (a grace period).
+ * The counters are private to each kring, so flushers do not share
+ * any cache line.
+ */
+static void
+nm_bdg_sync(const struct nm_bdg_state *st)
+{
+	u_int i, j, n;
+
+	NMG_LOCK_ASSERT();	/* krings do not go away */
+	mb();	/* the new pointers before the counters */
+	for (j = 0; j < st->bdg_active_ports; j++) {
+		struct netmap_vp_adapter *vpna =
+			st->bdg_ports[st->bdg_port_index[j]];
+		struct netmap_kring *kring = vpna->up.tx_rings;
+
+		if (kring == NULL)
+			continue;	/* not in netmap mode */
+		n = netmap_real_rings(&vpna->up, NR_TX);
+		for (i = 0; i < n; i++) {
+			uint32_t seq = kring[i].nkr_bdg_seq;
+
+			if ((seq & 1) == 0)
+				continue;
+			while (kring[i].nkr_bdg_seq == seq)
+				tsleep(&kring[i], 0, "NM_BDG_SYNC", 1);
+		}
+	}
+}
+
+/* return the spare state, initialized as a copy of the current one */
+static struct nm_bdg_state *
+nm_bdg_wstate(struct nm_bridge *b)
+{
+	struct nm_bdg_state *cur = b->bdg_state, *st = b->bdg_spare;
+
+	NMG_LOCK_ASSERT();
+	st->bdg_active_ports = cur->bdg_active_ports;
+	st->bdg_ops = cur->bdg_ops;
+	memcpy(st->bdg_port_index, cur->bdg_port_index,
+		sizeof(st->bdg_port_index[0]) * b->bdg_max_ports);
+	memcpy(st->bdg_ports, cur->bdg_ports,
+		sizeof(st->bdg_ports[0]) * b->bdg_max_ports);
+	return st;
+}
+
+/* install the state returned by nm_bdg_wstate() */
+static void
+nm_bdg_publish(struct nm_bridge *b)
+{
+	struct nm_bdg_state *old = b->bdg_state;
+
+	mb();	/* the content before the pointer */
+	b->bdg_state = b->bdg_spare;
+	/* the ports leaving the bridge are only in the old state */
+	nm_bdg_sync(old);
+	b->bdg_spare = old;
+}
+
+
 /*
  * Free the forwarding tables for rings attached to switch ports.
  */
@@ -373,19 +673,25 @@ nm_free_bdgfwd(struct netmap_adapter *na)
 
 /*
  * Allocate the forwarding tables for the rings attached to the bridge ports.
+ * The tables depend on the number of ports of the bridge (nports), so
+ * they are reallocated when an open port is attached to a bridge.
+ * The layout is described in nm_bdg_flush().
  */
 static int
-nm_alloc_bdgfwd(struct netmap_adapter *na)
+nm_alloc_bdgfwd(struct netmap_adapter *na, u_int nports)
 {
 	int nrings, l, i, num_dstq;
 	struct netmap_kring *kring;
 
 	NMG_LOCK_ASSERT();
 	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
+	num_dstq = nports * NM_BDG_MAXRINGS + 1;
 	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
 	l += sizeof(struct nm_bdg_q) * num_dstq;
-	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
+	l += sizeof(struct nm_cls_cent) * NM_CLS_CACHE;
+	l += sizeof(struct nm_cls_mirror) * NM_BDG_BATCH_MAX;
+	l += sizeof(uint32_t) * (NM_MCAST_BATCH + 1) * NM_MCAST_WORDS(nports);
+	l += sizeof(uint16_t) * (NM_BDG_BATCH_MAX + nports);
 
 	nrings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
@@ -410,6 +716,439 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 }
 
 
+/* ----- VALE classifier ----- */
+
+static inline void
+nm_cls_mask(struct nm_cls_key *dst, const struct nm_cls_key *k,
+	const struct nm_cls_key *m)
+{
+	dst->src = k->src & m->src;
+	dst->dst = k->dst & m->dst;
+	dst->sport = k->sport & m->sport;
+	dst->dport = k->dport & m->dport;
+	dst->proto = k->proto & m->proto;
+}
+
+static inline int
+nm_cls_key_eq(const struct nm_cls_key *a, const struct nm_cls_key *b)
+{
+	return a->src == b->src && a->dst == b->dst &&
+		a->sport == b->sport && a->dport == b->dport &&
+		a->proto == b->proto;
+}
+
+static inline uint32_t
+nm_cls_hash(const struct nm_cls_key *k, u_int salt)
+{
+	uint32_t h;
+
+	h = k->src * 0x9e3779b1;
+	h ^= k->dst * 0x85ebca6b;
+	h ^= ((uint32_t)k->sport << 16 | k->dport) * 0xc2b2ae35;
+	h ^= (k->proto << 8 | salt) * 0x27d4eb2f;
+	h ^= h >> 15;
+	return h;
+}
+
+static int
+nm_cls_find_tuple(const struct nm_cls_table *t, const struct nm_cls_key *mask)
+{
+	u_int j;
+
+	for (j = 0; j < t->ntuples; j++) {
+		if (nm_cls_key_eq(&t->tuples[j].mask, mask))
+			return j;
+	}
+	return -1;
+}
+
+/*
+ * Recompute tuples and hash chains after the rule array has changed.
+ * There are few rules and this only runs on configuration changes,
+ * so we do not bother with incremental updates.
+ */
+static void
+nm_cls_rebuild(struct nm_cls_table *t)
+{
+	struct nm_cls_ent *r;
+	u_int i, j, h;
+	int k;
+
+	t->ntuples = 0;
+	for (i = 0; i < t->nrules; i++) {
+		r = &t->rules[i];
+		k = nm_cls_find_tuple(t, &r->mask);
+		if (k < 0) {
+			k = t->ntuples++;
+			t->tuples[k].mask = r->mask;
+			t->tuples[k].max_prio = r->prio;
+		} else if (t->tuples[k].max_prio < r->prio) {
+			t->tuples[k].max_prio = r->prio;
+		}
+	}
+	/* insertion sort, highest priority first */
+	for (i = 1; i < t->ntuples; i++) {
+		struct nm_cls_tuple tmp = t->tuples[i];
+
+		for (j = i; j > 0 && t->tuples[j - 1].max_prio < tmp.max_prio; j--)
+			t->tuples[j] = t->tuples[j - 1];
+		t->tuples[j] = tmp;
+	}
+	for (h = 0; h < NM_CLS_HASH; h++)
+		t->ht[h] = NM_CLS_NONE;
+	for (i = 0; i < t->nrules; i++) {
+		r = &t->rules[i];
+		r->tuple = nm_cls_find_tuple(t, &r->mask);
+		h = nm_cls_hash(&r->key, r->tuple) & (NM_CLS_HASH - 1);
+		r->next = t->ht[h];
+		t->ht[h] = i;
+	}
+}
+
+/*
+ * Return the index of the best rule for key k, or NM_CLS_NONE.
+ * Ties between rules with the same priority go to the lower id.
+ */
+static u_int
+nm_cls_search(const struct nm_cls_table *t, const struct nm_cls_key *k)
+{
+	const struct nm_cls_ent *r, *best = NULL;
+	struct nm_cls_key mk;
+	u_int ti, i, h;
+
+	for (ti = 0; ti < t->ntuples; ti++) {
+		const struct nm_cls_tuple *tp = &t->tuples[ti];
+
+		if (best && tp->max_prio < best->prio)
+			break; /* nothing better in the following tuples */
+		nm_cls_mask(&mk, k, &tp->mask);
+		h = nm_cls_hash(&mk, ti) & (NM_CLS_HASH - 1);
+		for (i = t->ht[h]; i != NM_CLS_NONE; i = r->next) {
+			r = &t->rules[i];
+			if (r->tuple != ti || !nm_cls_key_eq(&r->key, &mk))
+				continue;
+			if (best == NULL || r->prio > best->prio ||
+			    (r->prio == best->prio && r->id < best->id))
+				best = r;
+		}
+	}
+	return best ? (u_int)(best - t->rules) : NM_CLS_NONE;
+}
+
+/*
+ * Extract the 5-tuple from an IPv4 packet (possibly with a VLAN tag).
+ * Returns 0 on success, -1 if the packet is not for the classifier.
+ */
+static int
+nm_cls_parse(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+	struct nm_cls_key *k)
+{
+	uint8_t *buf = ft->ft_buf;
+	u_int buf_len = ft->ft_len, vh = na->up.virt_hdr_len;
+	u_int l3 = 14, ihl;
+	uint16_t etype;
+
+	if (buf_len >= vh + 14) {
+		buf += vh;
+		buf_len -= vh;
+	} else if (buf_len == vh && (ft->ft_flags & NS_MOREFRAG)) {
+		/* only header in first fragment */
+		ft++;
+		buf = ft->ft_buf;
+		buf_len = ft->ft_len;
+	} else {
+		return -1;
+	}
+	/* indirect buffers are user memory, leave them to the lookup */
+	if ((ft->ft_flags & NS_INDIRECT) || buf_len < 14 + 20)
+		return -1;
+	etype = (buf[12] << 8) | buf[13];
+	if (etype == 0x8100) {
+		etype = (buf[16] << 8) | buf[17];
+		l3 = 18;
+	}
+	if (etype != 0x0800 || (buf[l3] >> 4) != 4)
+		return -1;
+	ihl = (buf[l3] & 0xf) << 2;
+	if (ihl < 20 || buf_len < l3 + ihl)
+		return -1;
+	memcpy(&k->src, buf + l3 + 12, 4);
+	memcpy(&k->dst, buf + l3 + 16, 4);
+	k->proto = buf[l3 + 9];
+	k->sport = k->dport = 0;
+	/* ports are only in the first IP fragment */
+	if ((k->proto == 6 /* TCP */ || k->proto == 17 /* UDP */ ||
+	     k->proto == 132 /* SCTP */) &&
+	    (buf[l3 + 6] & 0x1f) == 0 && buf[l3 + 7] == 0 &&
+	    buf_len >= l3 + ihl + 4) {
+		memcpy(&k->sport, buf + l3 + ihl, 2);
+		memcpy(&k->dport, buf + l3 + ihl + 2, 2);
+	}
+	return 0;
+}
+
+/*
+ * Classify the packet starting at ft. The flow cache of the ring is
+ * probed first, so established flows cost one lookup; on a miss the
+ * result of the search (including no match) is stored in the cache.
+ * t is the table published when the flush started.
+ */
+static struct nm_cls_ent *
+nm_cls_classify(struct nm_cls_table *t, struct nm_cls_cent *cache,
+	struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na)
+{
+	struct nm_cls_cent *c;
+	struct nm_cls_key k;
+	u_int i;
+
+	if (nm_cls_parse(ft, na, &k))
+		return NULL;
+	c = &cache[nm_cls_hash(&k, 0) & (NM_CLS_CACHE - 1)];
+	if (likely(c->gen == t->gen && nm_cls_key_eq(&c->key, &k))) {
+		i = c->rule;
+	} else {
+		i = nm_cls_search(t, &k);
+		c->key = k;
+		c->gen = t->gen;
+		c->rule = i;
+	}
+	if (i == NM_CLS_NONE)
+		return NULL;
+	t->rules[i].hits++;
+	return &t->rules[i];
+}
+
+/*
+ * Return a copy of the current table (or an empty one) that the
+ * caller can modify and then install with nm_cls_publish().
+ * The two tables are allocated with the first rule.
+ */
+static struct nm_cls_table *
+nm_cls_wtable(struct nm_bridge *b)
+{
+	struct nm_cls_table *t;
+
+	NMG_LOCK_ASSERT();
+	if (b->bdg_cls_tables == NULL) {
+		b->bdg_cls_tables = malloc(2 * sizeof(*t), M_DEVBUF,
+			M_NOWAIT | M_ZERO);
+		if (b->bdg_cls_tables == NULL)
+			return NULL;
+	}
+	t = b->bdg_cls_tables;
+	if (b->bdg_cls == t)
+		t++;
+	if (b->bdg_cls)
+		memcpy(t, b->bdg_cls, sizeof(*t));
+	else
+		bzero(t, sizeof(*t));
+	return t;
+}
+
+/*
+ * Install t (or no table if NULL), with a new gen that invalidates
+ * all flow caches, and wait for the flushes using the old one.
+ */
+static void
+nm_cls_publish(struct nm_bridge *b, struct nm_cls_table *t)
+{
+	if (t != NULL) {
+		if (++b->bdg_cls_gen == 0)
+			b->bdg_cls_gen = 1; /* 0 marks empty cache entries */
+		t->gen = b->bdg_cls_gen;
+	}
+	mb();	/* the content before the pointer */
+	b->bdg_cls = t;
+	nm_bdg_sync(b->bdg_state);
+	if (t == NULL && b->bdg_cls_tables) {
+		/* no need to parse packets any more */
+		free(b->bdg_cls_tables, M_DEVBUF);
+		b->bdg_cls_tables = NULL;
+	}
+}
+
+/*
+ * Remove the rules that send packets to a port which is leaving the
+ * bridge, so that they do not apply to the next port in that slot.
+ * Called with NMG_LOCK held, the spare table is always there.
+ */
+static void
+nm_cls_port_gone(struct nm_bridge *b, int port)
+{
+	struct nm_cls_table *t = b->bdg_cls;
+	u_int i;
+
+	if (t == NULL || port < 0)
+		return;
+	for (i = 0; i < t->nrules; i++) {
+		if (t->rules[i].action != NM_CLS_DROP &&
+		    t->rules[i].port == port)
+			break;
+	}
+	if (i == t->nrules)
+		return;
+	t = nm_cls_wtable(b);
+	for (i = 0; i < t->nrules; ) {
+		if (t->rules[i].action != NM_CLS_DROP &&
+		    t->rules[i].port == port)
+			t->rules[i] = t->rules[--t->nrules];
+		else
+			i++;
+	}
+	nm_cls_rebuild(t);
+	nm_cls_publish(b, t->nrules ? t : NULL);
+}
+
+static int
+nm_cls_find_id(const struct nm_cls_table *t, u_int id)
+{
+	u_int i;
+
+	for (i = 0; i < t->nrules; i++) {
+		if (t->rules[i].id == id)
+			return i;
+	}
+	return -1;
+}
+
+static int
+nm_cls_add(struct nm_bridge *b, struct nm_cls_rule *req)
+{
+	struct nm_cls_table *t = b->bdg_cls;
+	struct nm_cls_ent e;
+
+	if (req->cr_action != NM_CLS_FWD && req->cr_action != NM_CLS_DROP &&
+	    req->cr_action != NM_CLS_MIRROR)
+		return EINVAL;
+	if (req->cr_action != NM_CLS_DROP) {
+		if (req->cr_port >= b->bdg_max_ports ||
+		    b->bdg_state->bdg_ports[req->cr_port] == NULL)
+			return ENXIO;
+		if (req->cr_ring != NM_CLS_ANYRING &&
+		    req->cr_ring >= NM_BDG_MAXRINGS)
+			return EINVAL;
+	}
+
+	bzero(&e, sizeof(e));
+	e.mask.src = req->cr_src_mask;
+	e.mask.dst = req->cr_dst_mask;
+	e.mask.sport = req->cr_sport ? 0xffff : 0;
+	e.mask.dport = req->cr_dport ? 0xffff : 0;
+	e.mask.proto = req->cr_proto ? 0xff : 0;
+	e.key.src = req->cr_src;
+	e.key.dst = req->cr_dst;
+	e.key.sport = req->cr_sport;
+	e.key.dport = req->cr_dport;
+	e.key.proto = req->cr_proto;
+	nm_cls_mask(&e.key, &e.key, &e.mask);
+	e.prio = req->cr_prio;
+	e.action = req->cr_action;
+	e.port = req->cr_port;
+	e.ring = req->cr_ring;
+
+	if (t != NULL && (t->nrules == NM_CLS_MAXRULES ||
+		   (t->ntuples == NM_CLS_MAXTUPLES &&
+		    nm_cls_find_tuple(t, &e.mask) < 0))) {
+		return ENOSPC;
+	}
+	t = nm_cls_wtable(b);
+	if (t == NULL)
+		return ENOMEM;
+	do {
+		e.id = t->next_id++;
+	} while (e.id == NM_CLS_NONE || nm_cls_find_id(t, e.id) >= 0);
+
+	t->rules[t->nrules++] = e;
+	nm_cls_rebuild(t);
+	nm_cls_publish(b, t);
+
+	req->cr_id = e.id;
+	return 0;
+}
+
+/* NETMAP_BDG_CLS, called without NMG_LOCK */
+static int
+nm_bdg_ctl_cls(struct nmreq *nmr)
+{
+	uintptr_t *nmr_rule = (uintptr_t *)&nmr->nr_arg1;
+	struct nm_cls_table *t;
+	struct nm_cls_rule req;
+	struct nm_cls_ent *r;
+	struct nm_bridge *b;
+	int i, error = 0;
+
+	if (copyin((const void *)*nmr_rule, &req, sizeof(req)))
+		return EFAULT;
+	if (strncmp(nmr->nr_name, NM_NAME, strlen(NM_NAME)))
+		return EINVAL;
+
+	NMG_LOCK();
+	b = nm_find_bridge(nmr->nr_name, 0 /* don't create */);
+	if (b == NULL) {
+		NMG_UNLOCK();
+		return ENOENT;
+	}
+	t = b->bdg_cls;
+	switch (req.cr_op) {
+	case NM_CLS_ADD:
+		error = nm_cls_add(b, &req);
+		break;
+
+	case NM_CLS_DEL:
+		i = t ? nm_cls_find_id(t, req.cr_id) : -1;
+		if (i < 0) {
+			error = ENOENT;
+			break;
+		}
+		/* the tables exist if there are rules */
+		t = nm_cls_wtable(b);
+		t->rules[i] = t->rules[--t->nrules];
+		nm_cls_rebuild(t);
+		nm_cls_publish(b, t->nrules ? t : NULL);
+		break;
+
+	case NM_CLS_FLUSH:
+		nm_cls_publish(b, NULL);
+		break;
+
+	case NM_CLS_GET:
+		r = NULL;
+		for (i = 0; t && i < (int)t->nrules; i++) {
+			if (t->rules[i].id >= req.cr_id &&
+			    (r == NULL || t->rules[i].id < r->id))
+				r = &t->rules[i];
+		}
+		if (r == NULL) {
+			error = ENOENT;
+			break;
+		}
+		req.cr_id = r->id;
+		req.cr_prio = r->prio;
+		req.cr_action = r->action;
+		req.cr_proto = r->key.proto;
+		req.cr_src = r->key.src;
+		req.cr_src_mask = r->mask.src;
+		req.cr_dst = r->key.dst;
+		req.cr_dst_mask = r->mask.dst;
+		req.cr_sport = r->key.sport;
+		req.cr_dport = r->key.dport;
+		req.cr_port = r->port;
+		req.cr_ring = r->ring;
+		req.cr_hits = r->hits;
+		break;
+
+	default:
+		error = EINVAL;
+		break;
+	}
+	NMG_UNLOCK();
+	if (!error && (req.cr_op == NM_CLS_ADD || req.cr_op == NM_CLS_GET) &&
+	    copyout(&req, (void *)*nmr_rule, sizeof(req)))
+		error = EFAULT;
+	return error;
+}
+
+
 /* remove from bridge b the ports in slots hw and sw
  * (sw can be -1 if not needed)
  */
@@ -417,25 +1156,23 @@ static void
 netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 {
 	int s_hw = hw, s_sw = sw;
-	int i, lim =b->bdg_active_ports;
-	uint8_t tmp[NM_BDG_MAXPORTS];
+	struct nm_bdg_state *st = nm_bdg_wstate(b);
+	struct netmap_vp_adapter *vpna = st->bdg_ports[s_hw];
+	int i, lim = st->bdg_active_ports;
+	uint16_t *tmp = st->bdg_port_index;
 
 	/*
 	New algorithm:
-	make a copy of bdg_port_index;
+	take a copy of the forwarding state;
 	lookup NA(ifp)->bdg_port and SWNA(ifp)->bdg_port
 	in the array of bdg_port_index, replacing them with
 	entries from the bottom of the array;
 	decrement bdg_active_ports;
-	acquire BDG_WLOCK() and copy back the array.
+	publish the copy, which waits for the flushes in progress.
 	 */
 
 	if (netmap_verbose)
 		D("detach %d and %d (lim %d)", hw, sw, lim);
-	/* make a copy of the list of active ports, update it,
-	 * and then copy back within BDG_WLOCK().
-	 */
-	memcpy(tmp, b->bdg_port_index, sizeof(tmp));
 	for (i = 0; (hw >= 0 || sw >= 0) && i < lim; ) {
 		if (hw >= 0 && tmp[i] == hw) {
 			ND("detach hw %d at %d", hw, i);
@@ -457,23 +1194,23 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 		D("XXX delete failed hw %d sw %d, should panic...", hw, sw);
 	}
 
-	BDG_WLOCK(b);
-	if (b->bdg_ops.dtor)
-		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
-	b->bdg_ports[s_hw] = NULL;
+	st->bdg_ports[s_hw] = NULL;
 	if (s_sw >= 0) {
-		b->bdg_ports[s_sw] = NULL;
+		st->bdg_ports[s_sw] = NULL;
 	}
-	memcpy(b->bdg_port_index, tmp, sizeof(tmp));
-	b->bdg_active_ports = lim;
-	BDG_WUNLOCK(b);
+	st->bdg_active_ports = lim;
+	nm_bdg_publish(b);
+	/* now the port is not used by the data path any more */
+	if (st->bdg_ops.dtor)
+		st->bdg_ops.dtor(vpna);
+	nm_cls_port_gone(b, s_hw);
+	nm_cls_port_gone(b, s_sw);
+	nm_mcast_port_gone(b, s_hw);
+	nm_mcast_port_gone(b, s_sw);
 
 	ND("now %d active ports", lim);
-	if (lim == 0) {
-		ND("marking bridge %s as free", b->bdg_basename);
-		bzero(&b->bdg_ops, sizeof(b->bdg_ops));
-		NM_BNS_PUT(b);
-	}
+	if (lim == 0)
+		nm_free_bridge(b);
 }
 
 /* nm_bdg_ctl callback for VALE ports */
@@ -607,6 +1344,7 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	int error = 0;
 	struct netmap_vp_adapter *vpna, *hostna = NULL;
 	struct nm_bridge *b;
+	struct nm_bdg_state *st;
 	int i, j, cand = -1, cand2 = -1;
 	int needed;
 
@@ -628,15 +1366,14 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 
 	/* Now we are sure that name starts with the bridge's name,
 	 * lookup the port in the bridge. We need to scan the entire
-	 * list. It is not important to hold a WLOCK on the bridge
-	 * during the search because NMG_LOCK already guarantees
-	 * that there are no other possible writers.
+	 * list. NMG_LOCK guarantees that there are no other writers.
 	 */
 
 	/* lookup in the local list of ports */
-	for (j = 0; j < b->bdg_active_ports; j++) {
-		i = b->bdg_port_index[j];
-		vpna = b->bdg_ports[i];
+	st = b->bdg_state;
+	for (j = 0; j < st->bdg_active_ports; j++) {
+		i = st->bdg_port_index[j];
+		vpna = st->bdg_ports[i];
 		// KASSERT(na != NULL);
 		ND("checking %s", vpna->up.name);
 		if (!strcmp(vpna->up.name, nr_name)) {
@@ -651,15 +1388,16 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		return ENXIO;
 	/* yes we should, see if we have space to attach entries */
 	needed = 2; /* in some cases we only need 1 */
-	if (b->bdg_active_ports + needed >= NM_BDG_MAXPORTS) {
-		D("bridge full %d, cannot create new port", b->bdg_active_ports);
-		return ENOMEM;
+	if (st->bdg_active_ports + needed > b->bdg_max_ports) {
+		D("bridge full %d, cannot create new port", st->bdg_active_ports);
+		error = ENOMEM;
+		goto put_bridge;
 	}
 	/* record the next two ports available, but do not allocate yet */
-	cand = b->bdg_port_index[b->bdg_active_ports];
-	cand2 = b->bdg_port_index[b->bdg_active_ports + 1];
+	cand = st->bdg_port_index[st->bdg_active_ports];
+	cand2 = st->bdg_port_index[st->bdg_active_ports + 1];
 	ND("+++ bridge %s port %s used %d avail %d %d",
-		b->bdg_basename, ifname, b->bdg_active_ports, cand, cand2);
+		b->bdg_basename, ifname, st->bdg_active_ports, cand, cand2);
 
 	/*
 	 * try see if there is a matching NIC with this name
@@ -673,7 +1411,8 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		 */
 		if (nmr->nr_cmd) {
 			/* nr_cmd must be 0 for a virtual port */
-			return EINVAL;
+			error = EINVAL;
+			goto put_bridge;
 		}
 
 		/* bdg_netmap_attach creates a struct netmap_adapter */
@@ -681,7 +1420,7 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		if (error) {
 			D("error %d", error);
 			free(ifp, M_DEVBUF);
-			return error;
+			goto put_bridge;
 		}
 		/* shortcut - we can skip get_hw_na(),
 		 * ownership check and nm_bdg_attach()
@@ -701,31 +1440,46 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		hostna = hw->na_hostvp;
 		if (nmr->nr_arg1 != NETMAP_BDG_HOST)
 			hostna = NULL;
+		if (vpna->up.tx_rings) {
+			/* an open persistent port, its forwarding tables
+			 * must be sized for this bridge. No one uses them
+			 * until na_bdg is set.
+			 */
+			nm_free_bdgfwd(&vpna->up);
+			error = nm_alloc_bdgfwd(&vpna->up, b->bdg_max_ports);
+			if (error)
+				goto out;
+		}
 	}
 
-	BDG_WLOCK(b);
+	st = nm_bdg_wstate(b);
 	vpna->bdg_port = cand;
 	ND("NIC  %p to bridge port %d", vpna, cand);
 	/* bind the port to the bridge (virtual ports are not active) */
-	b->bdg_ports[cand] = vpna;
-	vpna->na_bdg = b;
-	b->bdg_active_ports++;
+	st->bdg_ports[cand] = vpna;
+	st->bdg_active_ports++;
 	if (hostna != NULL) {
 		/* also bind the host stack to the bridge */
-		b->bdg_ports[cand2] = hostna;
+		st->bdg_ports[cand2] = hostna;
 		hostna->bdg_port = cand2;
-		hostna->na_bdg = b;
-		b->bdg_active_ports++;
+		st->bdg_active_ports++;
 		ND("host %p to bridge port %d", hostna, cand2);
 	}
+	nm_bdg_publish(b);
+	/* the new ports can flush now, and they see the new state */
+	vpna->na_bdg = b;
+	if (hostna != NULL)
+		hostna->na_bdg = b;
 	ND("if %s refs %d", ifname, vpna->up.na_refcount);
-	BDG_WUNLOCK(b);
 	*na = &vpna->up;
 	netmap_adapter_get(*na);
 	return 0;
 
 out:
 	if_rele(ifp);
+put_bridge:
+	if (b->bdg_state->bdg_active_ports == 0)
+		nm_free_bridge(b);
 
 	return error;
 }
@@ -1078,6 +1832,138 @@ nm_bdg_ctl_polling_stop(struct nmreq *nmr, struct netmap_adapter *na)
 	return 0;
 }
 
+/* ----- VALE rate limits and priority classes ----- */
+
+/*
+ * Convert a rate in kbit/s and a depth in bytes into the fixed
+ * point parameters of the token bucket. Only used on the control
+ * path, the datapath needs no divisions.
+ */
+static int
+nm_tb_config(struct nm_tb_cfg *tb, uint32_t kbps, uint32_t depth)
+{
+	uint64_t bps = (uint64_t)kbps * 125;	/* bytes per second */
+
+	bzero(tb, sizeof(*tb));
+	if (kbps == 0)
+		return 0;
+	if (depth == 0) {
+		/* 10ms worth of traffic, but at least a TSO frame */
+		depth = bps / 100 > (1U << 31) ? (1U << 31) : bps / 100;
+		if (depth < 65536)
+			depth = 65536;
+	} else if (depth > (1U << 31)) {
+		return EINVAL;
+	}
+	tb->rate = ((bps / 1000000000) << 32) +
+		(((bps % 1000000000) << 32) / 1000000000);
+	tb->burst = (uint64_t)depth << 32;
+	tb->burst_ns = (uint64_t)depth * 1000000000 / bps + 1;
+	tb->kbps = kbps;
+	tb->depth = depth;
+	return 0;
+}
+
+/* add the tokens accumulated since the last refill */
+static inline void
+nm_tb_refill(struct netmap_kring *kring, const struct nm_tb_cfg *tb,
+	uint64_t now)
+{
+	uint64_t dt = now - kring->nkr_tb_last;
+
+	kring->nkr_tb_last = now;
+	if (dt >= tb->burst_ns) {
+		kring->nkr_tb_tokens = tb->burst;
+	} else {
+		/* dt * rate < burst <= 2^63, no overflow */
+		kring->nkr_tb_tokens += dt * tb->rate;
+		if (kring->nkr_tb_tokens > tb->burst)
+			kring->nkr_tb_tokens = tb->burst;
+	}
+}
+
+/* total length of the packet starting at ft */
+static inline u_int
+nm_bdg_pkt_len(const struct nm_bdg_fwd *ft)
+{
+	u_int i, len = 0;
+
+	for (i = 0; i < ft->ft_frags; i++)
+		len += ft[i].ft_len;
+	return len;
+}
+
+/* NETMAP_BDG_QOS, called without NMG_LOCK */
+static int
+nm_bdg_ctl_qos(struct nmreq *nmr)
+{
+	uintptr_t *nmr_req = (uintptr_t *)&nmr->nr_arg1;
+	struct nm_tb_cfg in, out;
+	struct netmap_vp_adapter *vpna;
+	struct netmap_adapter *na;
+	struct nm_qos_req req;
+	struct nm_bridge *b;
+	int i, error;
+
+	if (copyin((const void *)*nmr_req, &req, sizeof(req)))
+		return EFAULT;
+	if (req.qr_op == NM_QOS_SET) {
+		if (req.qr_class >= NM_QOS_NCLASSES)
+			return EINVAL;
+		error = nm_tb_config(&in, req.qr_in_rate, req.qr_in_burst);
+		if (!error)
+			error = nm_tb_config(&out, req.qr_out_rate,
+					req.qr_out_burst);
+		if (error)
+			return error;
+	} else if (req.qr_op != NM_QOS_GET) {
+		return EINVAL;
+	}
+
+	NMG_LOCK();
+	error = netmap_get_bdg_na(nmr, &na, 0);
+	if (na == NULL || error) {
+		NMG_UNLOCK();
+		return error ? error : ENXIO;
+	}
+	vpna = (struct netmap_vp_adapter *)na;
+	b = vpna->na_bdg;
+	if (b == NULL) {
+		error = ENXIO;
+	} else if (req.qr_op == NM_QOS_SET) {
+		/* no locking, flushes in progress may use a mix of the
+		 * old and new values, which is harmless.
+		 */
+		vpna->qos_in = in;
+		vpna->qos_out = out;
+		vpna->qos_class = req.qr_class;
+		/* start with full buckets */
+		for (i = 0; na->tx_rings && i < na->num_tx_rings; i++)
+			na->tx_rings[i].nkr_tb_last = 0;
+		for (i = 0; na->rx_rings && i < na->num_rx_rings; i++)
+			na->rx_rings[i].nkr_tb_last = 0;
+	} else {
+		req.qr_class = vpna->qos_class;
+		req.qr_in_rate = vpna->qos_in.kbps;
+		req.qr_in_burst = vpna->qos_in.depth;
+		req.qr_out_rate = vpna->qos_out.kbps;
+		req.qr_out_burst = vpna->qos_out.depth;
+		req.qr_in_drops = req.qr_out_drops = req.qr_class_drops = 0;
+		for (i = 0; na->tx_rings && i < na->num_tx_rings; i++)
+			req.qr_in_drops += na->tx_rings[i].nkr_rate_drops;
+		for (i = 0; na->rx_rings && i < na->num_rx_rings; i++) {
+			req.qr_out_drops += na->rx_rings[i].nkr_rate_drops;
+			req.qr_class_drops += na->rx_rings[i].nkr_class_drops;
+		}
+	}
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+	if (!error && req.qr_op == NM_QOS_GET &&
+	    copyout(&req, (void *)*nmr_req, sizeof(req)))
+		error = EFAULT;
+	return error;
+}
+
 /* Called by either user's context (netmap_ioctl())
  * or external kernel modules (e.g., Openvswitch).
  * Operation is indicated in nmr->nr_cmd.
@@ -1089,7 +1975,7 @@ nm_bdg_ctl_polling_stop(struct nmreq *nmr, struct netmap_adapter *na)
 int
 netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 {
-	struct nm_bridge *b, *bridges;
+	struct nm_bridge *b, **bridges;
 	struct netmap_adapter *na;
 	struct netmap_vp_adapter *vpna;
 	char *name = nmr->nr_name;
@@ -1132,11 +2018,13 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 			}
 
 			error = 0;
-			nmr->nr_arg1 = b - bridges; /* bridge index */
+			for (i = 0; bridges[i] != b; i++)
+				;
+			nmr->nr_arg1 = i; /* bridge index */
 			nmr->nr_arg2 = NM_BDG_NOPORT;
-			for (j = 0; j < b->bdg_active_ports; j++) {
-				i = b->bdg_port_index[j];
-				vpna = b->bdg_ports[i];
+			for (j = 0; j < b->bdg_state->bdg_active_ports; j++) {
+				i = b->bdg_state->bdg_port_index[j];
+				vpna = b->bdg_state->bdg_ports[i];
 				if (vpna == NULL) {
 					D("---AAAAAAAAARGH-------");
 					continue;
@@ -1162,16 +2050,17 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 			j = nmr->nr_arg2;
 
 			NMG_LOCK();
-			for (error = ENOENT; i < NM_BRIDGES; i++) {
-				b = bridges + i;
-				if (j >= b->bdg_active_ports) {
+			for (error = ENOENT; i < num_bridges; i++) {
+				b = bridges[i];
+				if (b == NULL ||
+				    j >= b->bdg_state->bdg_active_ports) {
 					j = 0; /* following bridges scan from 0 */
 					continue;
 				}
 				nmr->nr_arg1 = i;
 				nmr->nr_arg2 = j;
-				j = b->bdg_port_index[j];
-				vpna = b->bdg_ports[j];
+				j = b->bdg_state->bdg_port_index[j];
+				vpna = b->bdg_state->bdg_ports[j];
 				strncpy(name, vpna->up.name, (size_t)IFNAMSIZ);
 				error = 0;
 				break;
@@ -1194,7 +2083,11 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		if (!b) {
 			error = EINVAL;
 		} else {
-			b->bdg_ops = *bdg_ops;
+			nm_bdg_wstate(b)->bdg_ops = *bdg_ops;
+			nm_bdg_publish(b);
+			/* wait for config() calls using the old ops */
+			BDG_WLOCK(b);
+			BDG_WUNLOCK(b);
 		}
 		NMG_UNLOCK();
 		break;
@@ -1224,6 +2117,14 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		NMG_UNLOCK();
 		break;
 
+	case NETMAP_BDG_CLS:
+		error = nm_bdg_ctl_cls(nmr);
+		break;
+
+	case NETMAP_BDG_QOS:
+		error = nm_bdg_ctl_qos(nmr);
+		break;
+
 	case NETMAP_BDG_POLLING_ON:
 	case NETMAP_BDG_POLLING_OFF:
 		NMG_LOCK();
@@ -1257,6 +2158,7 @@ int
 netmap_bdg_config(struct nmreq *nmr)
 {
 	struct nm_bridge *b;
+	bdg_config_fn_t config;
 	int error = EINVAL;
 
 	NMG_LOCK();
@@ -1265,12 +2167,18 @@ netmap_bdg_config(struct nmreq *nmr)
 		NMG_UNLOCK();
 		return error;
 	}
+	nm_bdg_get(b);	/* the last port may leave meanwhile */
 	NMG_UNLOCK();
 	/* Don't call config() with NMG_LOCK() held */
 	BDG_RLOCK(b);
-	if (b->bdg_ops.config != NULL)
-		error = b->bdg_ops.config((struct nm_ifreq *)nmr);
+	/* REGOPS may publish new ops meanwhile, load them once */
+	config = NM_ACCESS_ONCE(b->bdg_state->bdg_ops.config);
+	if (config != NULL)
+		error = config((struct nm_ifreq *)nmr);
 	BDG_RUNLOCK(b);
+	NMG_LOCK();
+	nm_bdg_put(b);
+	NMG_UNLOCK();
 	return error;
 }
 
@@ -1286,6 +2194,7 @@ netmap_vp_krings_create(struct netmap_adapter *na)
 	int error, i;
 	uint32_t *leases;
 	u_int nrx = netmap_real_rings(na, NR_RX);
+	struct nm_bridge *b;
 
 	/*
 	 * Leases are attached to RX rings on vale ports
@@ -1303,7 +2212,8 @@ netmap_vp_krings_create(struct netmap_adapter *na)
 		leases += na->num_rx_desc;
 	}
 
-	error = nm_alloc_bdgfwd(na);
+	b = ((struct netmap_vp_adapter *)na)->na_bdg;
+	error = nm_alloc_bdgfwd(na, b ? b->bdg_max_ports : 0);
 	if (error) {
 		netmap_krings_delete(na);
 		return error;
@@ -1345,18 +2255,13 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 	u_int j = kring->nr_hwcur, lim = kring->nkr_num_slots - 1;
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
-	struct nm_bridge *b = na->na_bdg;
 
-	/* To protect against modifications to the bridge we acquire a
-	 * shared lock, waiting if we can sleep (if the source port is
-	 * attached to a user process) or with a trylock otherwise (NICs).
+	/* No locks: tell the writers that we are using the bridge,
+	 * so that they do not reuse what we see (see nm_bdg_sync()).
 	 */
-	ND("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
-		BDG_RLOCK(b);
-	else if (!BDG_RTRYLOCK(b))
-		return 0;
-	ND(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	kring->nkr_bdg_seq++;
+	mb();	/* the counter before the bridge state */
+	ND(5, "flush %d packets", ((j > end ? lim+1 : 0) + end) - j);
 	ft = kring->nkr_ft;
 
 	for (; likely(j != end); j = nm_next(j, lim)) {
@@ -1405,7 +2310,8 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 	}
 	if (ft_i)
 		ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
-	BDG_RUNLOCK(b);
+	mb();	/* done with the bridge state */
+	kring->nkr_bdg_seq++;
 	return j;
 }
 
@@ -1461,14 +2367,9 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 	enum txrx t;
 	int i;
 
-	/* persistent ports may be put in netmap mode
-	 * before being attached to a bridge
-	 */
-	if (vpna->na_bdg)
-		BDG_WLOCK(vpna->na_bdg);
 	if (onoff) {
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
 				if (nm_kring_pending_on(kring))
@@ -1484,16 +2385,20 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 		if (na->active_fds == 0)
 			na->na_flags &= ~NAF_NETMAP_ON;
 		for_rx_tx(t) {
-			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
 				if (nm_kring_pending_off(kring))
 					kring->nr_mode = NKR_NETMAP_OFF;
 			}
 		}
+		/* persistent ports may be put in netmap mode
+		 * before being attached to a bridge. Otherwise wait
+		 * for the flushes that may still use our rings.
+		 */
+		if (vpna->na_bdg)
+			nm_bdg_sync(vpna->na_bdg->bdg_state);
 	}
-	if (vpna->na_bdg)
-		BDG_WUNLOCK(vpna->na_bdg);
 	return 0;
 }
 
@@ -1559,6 +2464,347 @@ netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 }
 
 
+/* ----- VALE multicast snooping ----- */
+
+static struct nm_mcast_table *
+nm_mcast_alloc(u_int nports)
+{
+	struct nm_mcast_table *mc;
+	u_int words = NM_MCAST_WORDS(nports);
+
+	/* the table, the routers and one bitmap per entry */
+	mc = malloc(sizeof(*mc) + sizeof(uint32_t) * words *
+		(NM_MCAST_GROUPS + 1), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (mc == NULL) {
+		D("no memory for the multicast groups, will flood");
+		return NULL;
+	}
+	mtx_init(&mc->mc_lock, "nm_mcast_lock", NULL, MTX_DEF);
+	mc->mc_words = words;
+	mc->mc_routers = (uint32_t *)(mc + 1);
+	mc->mc_ports = mc->mc_routers + words;
+	return mc;
+}
+
+/* same byte order as the MAC addresses in the forwarding table */
+static inline uint64_t
+nm_mcast_key(const uint8_t *mac)
+{
+	return (uint64_t)mac[0] | (uint64_t)mac[1] << 8 |
+		(uint64_t)mac[2] << 16 | (uint64_t)mac[3] << 24 |
+		(uint64_t)mac[4] << 32 | (uint64_t)mac[5] << 40;
+}
+
+static u_int
+nm_mcast_find(const struct nm_mcast_table *mc, const uint8_t *mac,
+	uint64_t key)
+{
+	u_int i, h = nm_bridge_rthash(mac);
+
+	for (i = 0; i < NM_MCAST_PROBES; i++, h++) {
+		h &= NM_MCAST_GROUPS - 1;
+		if (mc->mc_ents[h].mac == key)
+			return h;
+		if (mc->mc_ents[h].mac == 0)
+			break;
+	}
+	return NM_MCAST_GROUPS;
+}
+
+/*
+ * Add or remove a port from a group. The well known groups of
+ * 224.0.0.0/24 and ff02::/112 (and those that map to the same
+ * addresses) are left out, they must reach everybody.
+ */
+static void
+nm_mcast_update(struct nm_mcast_table *mc, const uint8_t *mac, u_int port,
+	int join)
+{
+	struct nm_mcast_ent *e;
+	uint64_t key = nm_mcast_key(mac);
+	uint32_t *map, bit = 1U << (port & 31);
+	u_int i, h;
+
+	if (mac[3] == 0 && mac[4] == 0 && (mac[0] == 0x01 || mac[2] == 0))
+		return;
+	mtx_lock(&mc->mc_lock);
+	h = nm_mcast_find(mc, mac, key);
+	if (h == NM_MCAST_GROUPS) {
+		if (!join)
+			goto done;
+		/* take a new entry, or one without members */
+		h = nm_bridge_rthash(mac);
+		for (i = 0; i < NM_MCAST_PROBES; i++, h++) {
+			h &= NM_MCAST_GROUPS - 1;
+			if (mc->mc_ents[h].mac == 0 || mc->mc_ents[h].nmemb == 0)
+				break;
+		}
+		if (i == NM_MCAST_PROBES) {
+			RD(5, "no room for group %02x:%02x:%02x:%02x:%02x:%02x",
+				mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+			goto done;
+		}
+		e = &mc->mc_ents[h];
+		map = mc->mc_ports + h * mc->mc_words;
+		e->gen++;
+		mb();	/* odd gen before the change */
+		e->mac = key;
+		for (i = 0; i < mc->mc_words; i++)
+			map[i] = 0;
+		mb();	/* the change before the even gen */
+		e->gen++;
+	}
+	e = &mc->mc_ents[h];
+	map = mc->mc_ports + h * mc->mc_words + (port >> 5);
+	if (join && !(*map & bit)) {
+		*map |= bit;
+		e->nmemb++;
+	} else if (!join && (*map & bit)) {
+		*map &= ~bit;
+		e->nmemb--;
+	}
+done:
+	mtx_unlock(&mc->mc_lock);
+}
+
+static void
+nm_mcast_router(struct nm_mcast_table *mc, u_int port)
+{
+	uint32_t *map = mc->mc_routers + (port >> 5), bit = 1U << (port & 31);
+
+	if (*map & bit)
+		return;
+	mtx_lock(&mc->mc_lock);
+	*map |= bit;
+	mtx_unlock(&mc->mc_lock);
+}
+
+/* an IPv4 group address, from the IGMP message */
+static void
+nm_mcast_update4(struct nm_mcast_table *mc, const uint8_t *g, u_int port,
+	int join)
+{
+	uint8_t mac[6] = { 0x01, 0x00, 0x5e, g[1] & 0x7f, g[2], g[3] };
+
+	if ((g[0] & 0xf0) == 0xe0)
+		nm_mcast_update(mc, mac, port, join);
+}
+
+/* an IPv6 group address, from the MLD message */
+static void
+nm_mcast_update6(struct nm_mcast_table *mc, const uint8_t *g, u_int port,
+	int join)
+{
+	uint8_t mac[6] = { 0x33, 0x33, g[12], g[13], g[14], g[15] };
+
+	if (g[0] == 0xff)
+		nm_mcast_update(mc, mac, port, join);
+}
+
+/*
+ * IGMP messages (RFC 2236, 3376), ip points to the IPv4 header.
+ * Source lists are not tracked, a version 3 record joins the group
+ * unless it asks for no sources at all.
+ */
+static void
+nm_mcast_snoop4(struct nm_mcast_table *mc, const uint8_t *ip, u_int len,
+	u_int port)
+{
+	u_int ihl = (ip[0] & 0xf) << 2, n, off, nsrc;
+	const uint8_t *p, *r;
+
+	if ((ip[0] >> 4) != 4 || ihl < 20 || len < ihl + 8)
+		return;
+	if ((ip[6] & 0x1f) || ip[7])
+		return;	/* fragment */
+	p = ip + ihl;
+	len -= ihl;
+	switch (p[0]) {
+	case 0x11:	/* query */
+		nm_mcast_router(mc, port);
+		break;
+	case 0x12:	/* v1 report */
+	case 0x16:	/* v2 report */
+		nm_mcast_update4(mc, p + 4, port, 1);
+		break;
+	case 0x17:	/* leave */
+		nm_mcast_update4(mc, p + 4, port, 0);
+		break;
+	case 0x22:	/* v3 report */
+		n = (p[6] << 8) | p[7];
+		for (off = 8; n > 0 && off + 8 <= len; n--) {
+			r = p + off;
+			nsrc = (r[2] << 8) | r[3];
+			if (r[0] != 6)	/* BLOCK_OLD_SOURCES leaves it as is */
+				nm_mcast_update4(mc, r + 4, port,
+				    nsrc > 0 || (r[0] != 1 && r[0] != 3));
+			off += 8 + 4 * nsrc + 4 * r[1];
+		}
+		break;
+	}
+}
+
+/*
+ * MLD messages (RFC 2710, 3810), ip points to the IPv6 header.
+ * Returns 1 if the packet is one of them.
+ */
+static int
+nm_mcast_snoop6(struct nm_mcast_table *mc, const uint8_t *ip, u_int len,
+	u_int port)
+{
+	u_int nh, off = 40, n, nsrc;
+	const uint8_t *p, *r;
+
+	if (len < 40 || (ip[0] >> 4) != 6)
+		return 0;
+	nh = ip[6];
+	/* MLD messages carry a router alert option */
+	while (nh == 0 && off + 8 <= len) {
+		nh = ip[off];
+		off += (ip[off + 1] + 1) << 3;
+	}
+	if (nh != 58 /* ICMPv6 */ || off + 8 > len)
+		return 0;
+	p = ip + off;
+	len -= off;
+	switch (p[0]) {
+	case 130:	/* query */
+		nm_mcast_router(mc, port);
+		break;
+	case 131:	/* v1 report */
+	case 132:	/* done */
+		if (len >= 24)
+			nm_mcast_update6(mc, p + 8, port, p[0] == 131);
+		break;
+	case 143:	/* v2 report */
+		n = (p[6] << 8) | p[7];
+		for (off = 8; n > 0 && off + 20 <= len; n--) {
+			r = p + off;
+			nsrc = (r[2] << 8) | r[3];
+			if (r[0] != 6)
+				nm_mcast_update6(mc, r + 4, port,
+				    nsrc > 0 || (r[0] != 1 && r[0] != 3));
+			off += 20 + 16 * nsrc + 4 * r[1];
+		}
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Called by nm_bdg_flush() on the packets that would be flooded.
+ * Returns the entry of the group of the packet, or NM_MCAST_GROUPS
+ * to flood it. IGMP and MLD messages are flooded after updating
+ * the table.
+ */
+static u_int
+nm_mcast_lookup(struct nm_mcast_table *mc, struct nm_bdg_fwd *ft,
+	struct netmap_vp_adapter *na, uint64_t *key)
+{
+	uint8_t *buf = ft->ft_buf;
+	u_int buf_len = ft->ft_len, vh = na->up.virt_hdr_len, l3 = 14;
+	uint16_t etype;
+
+	if (buf_len >= vh + 14) {
+		buf += vh;
+		buf_len -= vh;
+	} else if (buf_len == vh && (ft->ft_flags & NS_MOREFRAG)) {
+		ft++;
+		buf = ft->ft_buf;
+		buf_len = ft->ft_len;
+	} else {
+		return NM_MCAST_GROUPS;
+	}
+	/* indirect buffers are user memory */
+	if ((ft->ft_flags & NS_INDIRECT) || buf_len < 14 || !(buf[0] & 1))
+		return NM_MCAST_GROUPS;
+	*key = nm_mcast_key(buf);
+	if (*key == 0xffffffffffffULL)
+		return NM_MCAST_GROUPS;	/* broadcast */
+	etype = (buf[12] << 8) | buf[13];
+	if (etype == 0x8100 && buf_len >= 18) {
+		etype = (buf[16] << 8) | buf[17];
+		l3 = 18;
+	}
+	if (etype == 0x0800 && buf_len >= l3 + 20 && buf[l3 + 9] == 2) {
+		nm_mcast_snoop4(mc, buf + l3, buf_len - l3, na->bdg_port);
+		return NM_MCAST_GROUPS;
+	}
+	if (etype == 0x86dd &&
+	    nm_mcast_snoop6(mc, buf + l3, buf_len - l3, na->bdg_port))
+		return NM_MCAST_GROUPS;
+	return nm_mcast_find(mc, buf, *key);
+}
+
+/*
+ * Copy the ports of entry h, and the routers, into map.
+ * Returns 0 if the entry changed group in the meantime.
+ */
+static int
+nm_mcast_snap(const struct nm_mcast_table *mc, u_int h, uint64_t key,
+	uint32_t *map)
+{
+	const struct nm_mcast_ent *e = &mc->mc_ents[h];
+	const uint32_t *ports = mc->mc_ports + h * mc->mc_words;
+	uint32_t gen = e->gen;
+	u_int i;
+
+	mb();	/* gen before the content */
+	if ((gen & 1) || e->mac != key)
+		return 0;
+	for (i = 0; i < mc->mc_words; i++)
+		map[i] = ports[i] | mc->mc_routers[i];
+	mb();	/* the content before gen */
+	return e->gen == gen;
+}
+
+/*
+ * Bitmask of the groups of a batch that include a port, bit g for
+ * the group in map[g * words]. Bit 0 (broadcast) is left to the caller.
+ */
+static inline uint32_t
+nm_mcast_mask(const uint32_t *map, u_int num_grp, u_int words, u_int port)
+{
+	uint32_t mask = 0, bit = 1U << (port & 31);
+	u_int g;
+
+	map += port >> 5;
+	for (g = 1; g <= num_grp; g++) {
+		if (map[g * words] & bit)
+			mask |= 1U << g;
+	}
+	return mask;
+}
+
+/*
+ * A port is leaving the bridge, so that it does not pass its
+ * memberships to the next port in that slot. Called with NMG_LOCK held.
+ */
+static void
+nm_mcast_port_gone(struct nm_bridge *b, int port)
+{
+	struct nm_mcast_table *mc = b->bdg_mcast;
+	uint32_t *map, bit;
+	u_int h;
+
+	if (mc == NULL || port < 0)
+		return;
+	bit = 1U << (port & 31);
+	mtx_lock(&mc->mc_lock);
+	mc->mc_routers[port >> 5] &= ~bit;
+	for (h = 0; h < NM_MCAST_GROUPS; h++) {
+		map = mc->mc_ports + h * mc->mc_words + (port >> 5);
+		if (*map & bit) {
+			*map &= ~bit;
+			mc->mc_ents[h].nmemb--;
+		}
+	}
+	mtx_unlock(&mc->mc_lock);
+}
+
+
 /*
  * Available space in the ring. Only used in VALE code
  * and only with is_rx = 1
@@ -1630,10 +2876,22 @@ nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
 	return lease_idx;
 }
 
+/* the next packet in the broadcast queue for the groups in mask */
+static inline u_int
+nm_bdg_brd_next(const struct nm_bdg_fwd *ft, u_int j, uint32_t mask)
+{
+	if (mask == 0)
+		return NM_FT_NULL;
+	while (j != NM_FT_NULL && !(mask & (1U << ft[j].ft_group)))
+		j = ft[j].ft_next;
+	return j;
+}
+
 /*
  *
- * This flush routine supports only unicast and broadcast but a large
- * number of ports, and lets us replace the learn and dispatch functions.
+ * This flush routine supports unicast, broadcast and snooped multicast
+ * and a large number of ports, and lets us replace the learn and
+ * dispatch functions.
  */
 int
 nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
@@ -1641,51 +2899,135 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 {
 	struct nm_bdg_q *dst_ents, *brddst;
 	uint16_t num_dsts = 0, *dsts;
+	struct nm_cls_mirror *mir;
+	struct nm_cls_cent *cls_cache;
 	struct nm_bridge *b = na->na_bdg;
-	u_int i, me = na->bdg_port;
+	/* the state and the classifier do not change under our feet,
+	 * see nm_bdg_sync() */
+	struct nm_bdg_state *st = b->bdg_state;
+	struct nm_cls_table *cls = b->bdg_cls;
+	struct nm_mcast_table *mc = b->bdg_mcast;
+	struct netmap_kring *src_kring = NULL;
+	u_int i, me = na->bdg_port, num_mir = 0;
+	/* multicast groups in the batch, 0 is broadcast */
+	uint32_t *grp_map;
+	uint64_t grp_key[NM_MCAST_BATCH + 1];
+	u_int grp_len[NM_MCAST_BATCH + 1], num_grp = 0;
+	u_int words = NM_MCAST_WORDS(b->bdg_max_ports);
+	u_int brd_ring = ring_nr & (NM_BDG_MAXRINGS - 1);
 
 	/*
 	 * The work area (pointed by ft) is followed by an array of
 	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * queues for each port of the bridge plus one for the
+	 * broadcast traffic.
+	 * Then we have the classifier flow cache, the list of packets
+	 * to be mirrored, the port bitmaps of the multicast groups in
+	 * the batch and the array of destination indexes, which
+	 * has room for the unicast and the broadcast destinations.
 	 */
 	dst_ents = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
+	brddst = dst_ents + b->bdg_max_ports * NM_BDG_MAXRINGS;
+	cls_cache = (struct nm_cls_cent *)(brddst + 1);
+	mir = (struct nm_cls_mirror *)(cls_cache + NM_CLS_CACHE);
+	grp_map = (uint32_t *)(mir + NM_BDG_BATCH_MAX);
+	dsts = (uint16_t *)(grp_map + (NM_MCAST_BATCH + 1) * words);
+	grp_len[0] = 0;
+
+	/* input rate limit, we own the source ring so no locking */
+	if (unlikely(na->qos_in.rate)) {
+		src_kring = &na->up.tx_rings[ring_nr];
+		nm_tb_refill(src_kring, &na->qos_in, nm_os_get_nsec());
+	}
 
 	/* first pass: find a destination for each packet in the batch */
 	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
 		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
 		uint16_t dst_port, d_i;
 		struct nm_bdg_q *d;
+		struct nm_cls_ent *cr = NULL;
 
 		ND("slot %d frags %d", i, ft[i].ft_frags);
 		/* Drop the packet if the virtio-net header is not into the first
 		   fragment nor at the very beginning of the second. */
 		if (unlikely(na->up.virt_hdr_len > ft[i].ft_len))
 			continue;
-		dst_port = b->bdg_ops.lookup(&ft[i], &dst_ring, na);
+		if (unlikely(src_kring != NULL)) {
+			uint64_t c = (uint64_t)nm_bdg_pkt_len(&ft[i]) << 32;
+
+			if (src_kring->nkr_tb_tokens < c) {
+				src_kring->nkr_rate_drops++;
+				continue;
+			}
+			src_kring->nkr_tb_tokens -= c;
+		}
+		if (cls)
+			cr = nm_cls_classify(cls, cls_cache, &ft[i], na);
+		if (cr == NULL) {
+			dst_port = st->bdg_ops.lookup(&ft[i], &dst_ring, na);
+		} else if (cr->action == NM_CLS_DROP) {
+			continue;
+		} else if (cr->action == NM_CLS_FWD) {
+			dst_port = cr->port;
+			if (cr->ring != NM_CLS_ANYRING)
+				dst_ring = cr->ring;
+		} else { /* NM_CLS_MIRROR */
+			if (cr->port != me) {
+				mir[num_mir].mi_pkt = i;
+				mir[num_mir].mi_dst = cr->port * NM_BDG_MAXRINGS +
+				    (cr->ring != NM_CLS_ANYRING ?
+				     cr->ring : ring_nr);
+				num_mir++;
+			}
+			dst_port = st->bdg_ops.lookup(&ft[i], &dst_ring, na);
+		}
 		if (netmap_verbose > 255)
 			RD(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port == NM_BDG_NOPORT)
+		if (dst_port == NM_BDG_NOPORT) {
 			continue; /* this packet is identified to be dropped */
-		else if (unlikely(dst_port > NM_BDG_MAXPORTS))
+		} else if (dst_port == NM_BDG_BROADCAST) {
+			u_int g = 0, h;
+			uint64_t key;
+
+			if (mc && (h = nm_mcast_lookup(mc, &ft[i], na, &key)) !=
+			    NM_MCAST_GROUPS) {
+				/* a known group, its ports are taken once
+				 * per batch. Too many groups are flooded. */
+				for (g = 1; g <= num_grp && grp_key[g] != key; g++)
+					;
+				if (g > num_grp) {
+					if (num_grp < NM_MCAST_BATCH &&
+					    nm_mcast_snap(mc, h, key,
+						grp_map + g * words)) {
+						grp_key[g] = key;
+						grp_len[g] = 0;
+						num_grp++;
+					} else {
+						g = 0;
+					}
+				}
+			}
+			ft[i].ft_group = g;
+			grp_len[g] += ft[i].ft_frags;
+			dst_port = b->bdg_max_ports; /* brddst, see above */
+		} else if (unlikely(dst_port >= b->bdg_max_ports ||
+		    dst_port == me || !st->bdg_ports[dst_port])) {
 			continue;
-		else if (dst_port == NM_BDG_BROADCAST)
-			dst_ring = 0; /* broadcasts always go to ring 0 */
-		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
+		} else if (unlikely(dst_ring >= NM_BDG_MAXRINGS)) {
 			continue;
+		}
 
-		/* get a position in the scratch pad */
-		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
+		/* get a position in the scratch pad, broadcast and
+		 * multicast share a single queue */
+		d_i = dst_port * NM_BDG_MAXRINGS +
+			(dst_port == b->bdg_max_ports ? 0 : dst_ring);
 		d = dst_ents + d_i;
 
 		/* append the first fragment to the list */
 		if (d->bq_head == NM_FT_NULL) { /* new destination */
 			d->bq_head = d->bq_tail = i;
 			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
+			if (d != brddst)
 				dsts[num_dsts++] = d_i;
 		} else {
 			ft[d->bq_tail].ft_next = i;
@@ -1695,21 +3037,23 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 	}
 
 	/*
-	 * Broadcast traffic goes to ring 0 on all destinations.
+	 * Broadcast traffic goes to all destinations, multicast only to
+	 * the ports in its group, on ring brd_ring (the source ring,
+	 * modulo the rings of the destination).
 	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
+	 * We only scan the active ports of the bridge.
 	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
 	if (brddst->bq_head != NM_FT_NULL) {
 		u_int j;
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
+		for (j = 0; likely(j < st->bdg_active_ports); j++) {
 			uint16_t d_i;
-			i = b->bdg_port_index[j];
+			i = st->bdg_port_index[j];
 			if (unlikely(i == me))
 				continue;
-			d_i = i * NM_BDG_MAXRINGS;
+			if (grp_len[0] == 0 &&
+			    !nm_mcast_mask(grp_map, num_grp, words, i))
+				continue;
+			d_i = i * NM_BDG_MAXRINGS + brd_ring;
 			if (dst_ents[d_i].bq_head == NM_FT_NULL)
 				dsts[num_dsts++] = d_i;
 		}
@@ -1717,23 +3061,28 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 
 	ND(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
 	/* second pass: scan destinations */
+pass2:
 	for (i = 0; i < num_dsts; i++) {
 		struct netmap_vp_adapter *dst_na;
 		struct netmap_kring *kring;
 		struct netmap_ring *ring;
 		u_int dst_nr, lim, j, d_i, next, brd_next;
+		uint32_t brd_mask = 0;	/* groups for this destination */
 		u_int needed, howmany;
 		int retry = netmap_txsync_retry;
 		struct nm_bdg_q *d;
 		uint32_t my_start = 0, lease_idx = 0;
 		int nrings;
 		int virt_hdr_mismatch = 0;
+		u_int gro_segs = 0;
+		uint64_t want = 0, budget = 0; /* output rate limit */
+		u_int rate_drops = 0, class_drops = 0;
 
 		d_i = dsts[i];
 		ND("second pass %d port %d", i, d_i);
 		d = dst_ents + d_i;
 		// XXX fix the division
-		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
+		dst_na = st->bdg_ports[d_i/NM_BDG_MAXRINGS];
 		/* protect from the lookup function returning an inactive
 		 * destination port
 		 */
@@ -1752,7 +3101,6 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		}
 
 		/* there is at least one either unicast or broadcast packet */
-		brd_next = brddst->bq_head;
 		next = d->bq_head;
 		/* we need to reserve this many slots. If fewer are
 		 * available, some packets will be dropped.
@@ -1761,7 +3109,19 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		 * we have claimed, so we will need to handle the leftover
 		 * ones when we regain the lock.
 		 */
-		needed = d->bq_len + brddst->bq_len;
+		needed = d->bq_len;
+		if (brddst->bq_head != NM_FT_NULL &&
+		    (d_i & (NM_BDG_MAXRINGS - 1)) == brd_ring) {
+			u_int g;
+
+			brd_mask = 1 | nm_mcast_mask(grp_map, num_grp, words,
+					dst_na->bdg_port);
+			for (g = 0; g <= num_grp; g++) {
+				if (brd_mask & (1U << g))
+					needed += grp_len[g];
+			}
+		}
+		brd_next = nm_bdg_brd_next(ft, brddst->bq_head, brd_mask);
 
 		if (unlikely(dst_na->up.virt_hdr_len != na->up.virt_hdr_len)) {
 			RD(3, "virt_hdr_mismatch, src %d dst %d", na->up.virt_hdr_len,
@@ -1788,6 +3148,27 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			}
 		}
 
+		/* Receive coalescing, for destinations with a virtio-net
+		 * header and sources with either none or the same one.
+		 */
+		if (bridge_gro > 1 && dst_na->up.virt_hdr_len &&
+		    (na->up.virt_hdr_len == 0 || !virt_hdr_mismatch))
+			gro_segs = bridge_gro;
+
+		if (unlikely(dst_na->qos_out.rate)) {
+			/* Count the bytes we want to send, so that we do not
+			 * take more tokens than needed from the bucket.
+			 * Coalescing would hide packets from the accounting.
+			 */
+			for (j = d->bq_head; j != NM_FT_NULL; j = ft[j].ft_next)
+				want += nm_bdg_pkt_len(&ft[j]);
+			for (j = brd_next; j != NM_FT_NULL;
+			     j = nm_bdg_brd_next(ft, ft[j].ft_next, brd_mask))
+				want += nm_bdg_pkt_len(&ft[j]);
+			want <<= 32;
+			gro_segs = 0;
+		}
+
 		ND(5, "pass 2 dst %d is %x %s",
 			i, d_i, is_vp ? "virtual" : "nic/host");
 		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
@@ -1817,8 +3198,27 @@ retry:
 			mtx_unlock(&kring->q_lock);
 			goto cleanup;
 		}
+		if (want) {
+			nm_tb_refill(kring, &dst_na->qos_out, nm_os_get_nsec());
+			budget = kring->nkr_tb_tokens < want ?
+				kring->nkr_tb_tokens : want;
+			kring->nkr_tb_tokens -= budget;
+		}
 		my_start = j = kring->nkr_hwlease;
 		howmany = nm_kr_space(kring, 1);
+		if (na->qos_class) {
+			/* class c may not take the last c/8 of the ring
+			 * (of its size, not of the free slots), which are
+			 * left to the higher priority classes
+			 */
+			u_int reserve = na->qos_class * (kring->nkr_num_slots >> 3);
+			u_int avail = howmany > reserve ? howmany - reserve : 0;
+
+			if (needed > avail)
+				class_drops += (needed < howmany ?
+						needed : howmany) - avail;
+			howmany = avail;
+		}
 		if (needed < howmany)
 			howmany = needed;
 		lease_idx = nm_kr_lease(kring, howmany, 1);
@@ -1832,7 +3232,7 @@ retry:
 		while (howmany > 0) {
 			struct netmap_slot *slot;
 			struct nm_bdg_fwd *ft_p, *ft_end;
-			u_int cnt;
+			u_int cnt, unicast = 0;
 
 			/* find the queue from which we pick next packet.
 			 * NM_FT_NULL is always higher than valid indexes
@@ -1843,17 +3243,35 @@ retry:
 			if (next < brd_next) {
 				ft_p = ft + next;
 				next = ft_p->ft_next;
+				unicast = 1;
 			} else { /* insert broadcast */
 				ft_p = ft + brd_next;
-				brd_next = ft_p->ft_next;
+				brd_next = nm_bdg_brd_next(ft, ft_p->ft_next,
+						brd_mask);
 			}
 			cnt = ft_p->ft_frags; // cnt > 0
 			if (unlikely(cnt > howmany))
 			    break; /* no more space */
+			if (unlikely(want)) {
+				uint64_t c = (uint64_t)nm_bdg_pkt_len(ft_p) << 32;
+
+				if (c > budget) {
+					rate_drops++;
+					if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
+						break;
+					continue;
+				}
+				budget -= c;
+			}
 			if (netmap_verbose && cnt > 1)
 				RD(5, "rx %d frags to %d", cnt, j);
 			ft_end = ft_p + cnt;
-			if (unlikely(virt_hdr_mismatch)) {
+			if (unicast && gro_segs &&
+			    bdg_gro_datapath(na, dst_na, ft, ft_p, &next,
+					brd_next, gro_segs, ring, &j, lim,
+					&howmany)) {
+				/* coalesced with the following packets */
+			} else if (unlikely(virt_hdr_mismatch)) {
 				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
 			} else {
 				howmany -= cnt;
@@ -1923,6 +3341,17 @@ retry:
 		    }
 		    p[lease_idx] = j; /* report I am done */
 
+		    if (unlikely(want)) {
+			/* give back the tokens we did not use */
+			kring->nkr_tb_tokens += budget;
+			if (kring->nkr_tb_tokens > dst_na->qos_out.burst)
+			    kring->nkr_tb_tokens = dst_na->qos_out.burst;
+			budget = 0;
+		    }
+		    kring->nkr_rate_drops += rate_drops;
+		    kring->nkr_class_drops += class_drops;
+		    rate_drops = class_drops = 0;
+
 		    update_pos = kring->nr_hwtail;
 
 		    if (my_start == update_pos) {
@@ -1965,6 +3394,32 @@ cleanup:
 	}
 	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
 	brddst->bq_len = 0;
+	grp_len[0] = 0;
+	num_grp = 0;
+
+	if (num_mir) {
+		/* The queues are empty again and the packets are still
+		 * in the source ring, so we can link the mirrored ones
+		 * into new lists and run the second pass once more.
+		 */
+		num_dsts = 0;
+		for (i = 0; i < num_mir; i++) {
+			u_int p = mir[i].mi_pkt;
+			struct nm_bdg_q *d = dst_ents + mir[i].mi_dst;
+
+			ft[p].ft_next = NM_FT_NULL;
+			if (d->bq_head == NM_FT_NULL) {
+				d->bq_head = d->bq_tail = p;
+				dsts[num_dsts++] = mir[i].mi_dst;
+			} else {
+				ft[d->bq_tail].ft_next = p;
+				d->bq_tail = p;
+			}
+			d->bq_len += ft[p].ft_frags;
+		}
+		num_mir = 0;
+		goto pass2;
+	}
 	return 0;
 }
 
@@ -2093,6 +3548,7 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	struct netmap_adapter *na;
 	int error;
 	u_int npipes = 0;
+	int numa_node = -1, hugepages = 0;
 
 	vpna = malloc(sizeof(*vpna), M_DEVBUF, M_NOWAIT | M_ZERO);
 	if (vpna == NULL)
@@ -2125,6 +3581,11 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	/* validate extra bufs */
 	nm_bound_var(&nmr->nr_arg3, 0, 0,
 			128*NM_BDG_MAXSLOTS, NULL);
+	/* memory placement, only NEWIF uses nr_arg2 for it */
+	if (nmr->nr_cmd == NETMAP_BDG_NEWIF) {
+		numa_node = (int)(nmr->nr_arg2 & NETMAP_BDG_NODE_MASK) - 1;
+		hugepages = (nmr->nr_arg2 & NETMAP_BDG_HUGEPAGES) != 0;
+	}
 	na->num_rx_desc = nmr->nr_rx_slots;
 	vpna->mfs = 1514;
 	vpna->last_smac = ~0llu;
@@ -2148,7 +3609,7 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	na->nm_mem = netmap_mem_private_new(na->name,
 			na->num_tx_rings, na->num_tx_desc,
 			na->num_rx_rings, na->num_rx_desc,
-			nmr->nr_arg3, npipes, &error);
+			nmr->nr_arg3, npipes, numa_node, hugepages, &error);
 	if (na->nm_mem == NULL)
 		goto err;
 	na->nm_bdg_attach = netmap_vp_bdg_attach;
@@ -2336,7 +3797,7 @@ netmap_bwrap_reg(struct netmap_adapter *na, int onoff)
 
 	/* pass down the pending ring state information */
 	for_rx_tx(t) {
-		for (i = 0; i < nma_get_nrings(na, t) + 1; i++)
+		for (i = 0; i < netmap_all_rings(na, t); i++)
 			NMR(hwna, t)[i].nr_pending_mode =
 				NMR(na, t)[i].nr_pending_mode;
 	}
@@ -2348,7 +3809,7 @@ netmap_bwrap_reg(struct netmap_adapter *na, int onoff)
 
 	/* copy up the current ring state information */
 	for_rx_tx(t) {
-		for (i = 0; i < nma_get_nrings(na, t) + 1; i++)
+		for (i = 0; i < netmap_all_rings(na, t); i++)
 			NMR(na, t)[i].nr_mode =
 				NMR(hwna, t)[i].nr_mode;
 	}
@@ -2365,12 +3826,13 @@ netmap_bwrap_reg(struct netmap_adapter *na, int onoff)
 			hwna->rx_rings[i].save_notify = hwna->rx_rings[i].nm_notify;
 			hwna->rx_rings[i].nm_notify = netmap_bwrap_intr_notify;
 		}
-		i = hwna->num_rx_rings; /* for safety */
-		/* save the host ring notify unconditionally */
-		hwna->rx_rings[i].save_notify = hwna->rx_rings[i].nm_notify;
-		if (hostna->na_bdg) {
-			/* also intercept the host ring notify */
-			hwna->rx_rings[i].nm_notify = netmap_bwrap_intr_notify;
+		/* save the host rings notify unconditionally */
+		for (; i < netmap_all_rings(hwna, NR_RX); i++) {
+			hwna->rx_rings[i].save_notify = hwna->rx_rings[i].nm_notify;
+			if (hostna->na_bdg) {
+				/* also intercept the host ring notify */
+				hwna->rx_rings[i].nm_notify = netmap_bwrap_intr_notify;
+			}
 		}
 		if (na->active_fds == 0)
 			na->na_flags |= NAF_NETMAP_ON;
@@ -2380,14 +3842,15 @@ netmap_bwrap_reg(struct netmap_adapter *na, int onoff)
 		if (na->active_fds == 0)
 			na->na_flags &= ~NAF_NETMAP_ON;
 
-		/* reset all notify callbacks (including host ring) */
-		for (i = 0; i <= hwna->num_rx_rings; i++) {
+		/* reset all notify callbacks (including host rings) */
+		for (i = 0; i < netmap_all_rings(hwna, NR_RX); i++) {
 			hwna->rx_rings[i].nm_notify = hwna->rx_rings[i].save_notify;
 			hwna->rx_rings[i].save_notify = NULL;
 		}
 		hwna->na_lut.lut = NULL;
 		hwna->na_lut.objtotal = 0;
 		hwna->na_lut.objsize = 0;
+		hwna->na_lut.base = NULL;
 	}
 
 	return 0;
@@ -2449,7 +3912,7 @@ netmap_bwrap_krings_create(struct netmap_adapter *na)
 	 */
         for_rx_tx(t) {
                 enum txrx r = nm_txrx_swap(t); /* swap NR_TX <-> NR_RX */
-                for (i = 0; i < nma_get_nrings(hwna, r) + 1; i++) {
+                for (i = 0; i < netmap_all_rings(hwna, r); i++) {
                         NMR(na, t)[i].nkr_num_slots = NMR(hwna, r)[i].nkr_num_slots;
                         NMR(na, t)[i].ring = NMR(hwna, r)[i].ring;
                 }
@@ -2461,9 +3924,11 @@ netmap_bwrap_krings_create(struct netmap_adapter *na)
 		 * hostna
 		 */
 		hostna->tx_rings = &na->tx_rings[na->num_tx_rings];
-		hostna->tx_rings[0].na = hostna;
 		hostna->rx_rings = &na->rx_rings[na->num_rx_rings];
-		hostna->rx_rings[0].na = hostna;
+		for_rx_tx(t) {
+			for (i = 0; i < nma_get_host_nrings(na, t); i++)
+				NMR(hostna, t)[i].na = hostna;
+		}
 	}
 
 	return 0;
@@ -2624,6 +4089,7 @@ netmap_bwrap_attach(const char *nr_name, struct netmap_adapter *hwna)
 	for_rx_tx(t) {
 		enum txrx r = nm_txrx_swap(t); /* swap NR_TX <-> NR_RX */
 		nma_set_nrings(na, t, nma_get_nrings(hwna, r));
+		nma_set_host_nrings(na, t, nma_get_host_nrings(hwna, r));
 		nma_set_ndesc(na, t, nma_get_ndesc(hwna, r));
 	}
 	na->nm_dtor = netmap_bwrap_dtor;
@@ -2654,7 +4120,7 @@ netmap_bwrap_attach(const char *nr_name, struct netmap_adapter *hwna)
 		hostna->ifp = hwna->ifp;
 		for_rx_tx(t) {
 			enum txrx r = nm_txrx_swap(t);
-			nma_set_nrings(hostna, t, 1);
+			nma_set_nrings(hostna, t, nma_get_host_nrings(hwna, r));
 			nma_set_ndesc(hostna, t, nma_get_ndesc(hwna, r));
 		}
 		// hostna->nm_txsync = netmap_bwrap_host_txsync;
@@ -2688,31 +4154,32 @@ err_free:
 
 }
 
-struct nm_bridge *
-netmap_init_bridges2(u_int n)
+/*
+ * Allocate the array of bridge pointers, its size (bridge_num)
+ * is returned in *n. Bridges are created on demand.
+ */
+struct nm_bridge **
+netmap_init_bridges2(u_int *n)
 {
-	int i;
-	struct nm_bridge *b;
-
-	b = malloc(sizeof(struct nm_bridge) * n, M_DEVBUF,
+	*n = nm_bound_var(&bridge_num, NM_BRIDGES, 1, NM_BRIDGES_MAX,
+		"bridge_num");
+	return malloc(sizeof(struct nm_bridge *) * *n, M_DEVBUF,
 		M_NOWAIT | M_ZERO);
-	if (b == NULL)
-		return NULL;
-	for (i = 0; i < n; i++)
-		BDG_RWINIT(&b[i]);
-	return b;
 }
 
 void
-netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
+netmap_uninit_bridges2(struct nm_bridge **b, u_int n)
 {
 	int i;
 
 	if (b == NULL)
 		return;
 
-	for (i = 0; i < n; i++)
-		BDG_RWDESTROY(&b[i]);
+	for (i = 0; i < n; i++) {
+		if (b[i] != NULL)	/* should not happen */
+			D("bridge %s still has %d ports", b[i]->bdg_basename,
+				b[i]->bdg_state->bdg_active_ports);
+	}
 	free(b, M_DEVBUF);
 }
 
@@ -2722,7 +4189,7 @@ netmap_init_bridges(void)
 #ifdef CONFIG_NET_NS
 	return netmap_bns_register();
 #else
-	nm_bridges = netmap_init_bridges2(NM_BRIDGES);
+	nm_bridges = netmap_init_bridges2(&nm_num_bridges);
 	if (nm_bridges == NULL)
 		return ENOMEM;
 	return 0;
@@ -2735,7 +4202,7 @@ netmap_uninit_bridges(void)
 #ifdef CONFIG_NET_NS
 	netmap_bns_unregister();
 #else
-	netmap_uninit_bridges2(nm_bridges, NM_BRIDGES);
+	netmap_uninit_bridges2(nm_bridges, nm_num_bridges);
 #endif
 }
 #endif /* WITH_VALE */
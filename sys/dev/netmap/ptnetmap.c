@@ -33,10 +33,12 @@
 #include <sys/kernel.h>
 #include <sys/types.h>
 #include <sys/selinfo.h>
+#include <sys/sysctl.h>
 #include <sys/socket.h>
 #include <net/if.h>
 #include <net/if_var.h>
 #include <machine/bus.h>
+#include <machine/atomic.h>	/* atomic_add_long */
 
 //#define usleep_range(_1, _2)
 #define usleep_range(_1, _2) \
@@ -56,11 +58,6 @@
 /* RX cycle without receive any packets */
 #define PTN_RX_DRY_CYCLES_MAX	10
 
-/* Limit Batch TX to half ring.
- * Currently disabled, since it does not manage NS_MOREFRAG, which
- * results in random drops in the VALE txsync. */
-//#define PTN_TX_BATCH_LIM(_n)	((_n >> 1))
-
 /* XXX: avoid nm_*sync_prologue(). XXX-vin: this should go away,
  *      we should never trust the guest. */
 #define PTN_AVOID_NM_PROLOGUE
@@ -74,100 +71,94 @@
 #endif
 
 
-#undef RATE
-//#define RATE  /* Enables communication statistics. */
-#ifdef RATE
-#define IFRATE(x) x
-struct rate_batch_stats {
-    unsigned long sync;
-    unsigned long sync_dry;
-    unsigned long pkt;
-};
+/*
+ * Adaptive polling.
+ *
+ * When the CSB shows no more work, a kthread keeps polling it for up to
+ * spin microseconds before enabling the guest kicks and going to sleep.
+ * The budget of each ring doubles every time polling finds new work,
+ * so that a ring with steady traffic seldom needs kicks, and halves
+ * when it expires without work. It stays within [1, ptnet_spin_max],
+ * and ptnet_spin_max = 0 disables polling.
+ *
+ * TX batches (slots handed to a single txsync) are capped to half ring
+ * when the average occupancy of the ring is above half ring, so that
+ * the guest sees the first completions while the backend works on the
+ * rest. Packets are never split between two batches.
+ * ptnet_tx_batch > 0 sets a fixed cap, < 0 disables it.
+ */
+static int ptnet_spin_max = 32;	/* us */
+static int ptnet_tx_batch = 0;	/* 0: adaptive */
 
-struct rate_stats {
-    unsigned long gtxk;     /* Guest --> Host Tx kicks. */
-    unsigned long grxk;     /* Guest --> Host Rx kicks. */
-    unsigned long htxk;     /* Host --> Guest Tx kicks. */
-    unsigned long hrxk;     /* Host --> Guest Rx Kicks. */
-    unsigned long btxwu;    /* Backend Tx wake-up. */
-    unsigned long brxwu;    /* Backend Rx wake-up. */
-    struct rate_batch_stats txbs;
-    struct rate_batch_stats rxbs;
+/* average occupancy, in slots << PTN_OCC_SHIFT */
+#define PTN_OCC_SHIFT	3
+
+struct ptnetmap_ring_state {
+    u_int spin;		/* current polling budget, in us */
+    u_int occ;		/* average tx occupancy, see PTN_OCC_SHIFT */
 };
 
-struct rate_context {
-    struct timer_list timer;
-    struct rate_stats new;
-    struct rate_stats old;
+/*
+ * Statistics, per direction. The handlers count into a local copy
+ * and add it to these on exit.
+ */
+struct ptnetmap_stats {
+    u_long wakeups;	/* handler runs (guest kicks + backend wakeups) */
+    u_long bwakeups;	/* backend wakeups */
+    u_long syncs;	/* txsync/rxsync on the backend */
+    u_long pkts;	/* slots moved by the syncs */
+    u_long polls;	/* kicks avoided by polling the CSB */
+    u_long sleeps;	/* kicks enabled before sleeping */
+    u_long intrs;	/* interrupts to the guest */
 };
 
-#define RATE_PERIOD  2
+static struct ptnetmap_stats ptnet_stats[NR_TXRX];
+
+SYSBEGIN(vars_ptnet);
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_INT(_dev_netmap, OID_AUTO, ptnet_spin_max, CTLFLAG_RW, &ptnet_spin_max, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, ptnet_tx_batch, CTLFLAG_RW, &ptnet_tx_batch, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_tx_wakeups, CTLFLAG_RD, &ptnet_stats[NR_TX].wakeups, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_tx_bwakeups, CTLFLAG_RD, &ptnet_stats[NR_TX].bwakeups, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_tx_syncs, CTLFLAG_RD, &ptnet_stats[NR_TX].syncs, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_tx_pkts, CTLFLAG_RD, &ptnet_stats[NR_TX].pkts, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_tx_polls, CTLFLAG_RD, &ptnet_stats[NR_TX].polls, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_tx_sleeps, CTLFLAG_RD, &ptnet_stats[NR_TX].sleeps, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_tx_intrs, CTLFLAG_RD, &ptnet_stats[NR_TX].intrs, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_rx_wakeups, CTLFLAG_RD, &ptnet_stats[NR_RX].wakeups, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_rx_bwakeups, CTLFLAG_RD, &ptnet_stats[NR_RX].bwakeups, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_rx_syncs, CTLFLAG_RD, &ptnet_stats[NR_RX].syncs, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_rx_pkts, CTLFLAG_RD, &ptnet_stats[NR_RX].pkts, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_rx_polls, CTLFLAG_RD, &ptnet_stats[NR_RX].polls, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_rx_sleeps, CTLFLAG_RD, &ptnet_stats[NR_RX].sleeps, 0 , "");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, ptnet_rx_intrs, CTLFLAG_RD, &ptnet_stats[NR_RX].intrs, 0 , "");
+SYSEND;
+
+/* the kthreads of all the rings add to the same counters */
 static void
-rate_callback(unsigned long arg)
+ptnetmap_stats_add(enum txrx t, const struct ptnetmap_stats *st)
 {
-    struct rate_context * ctx = (struct rate_context *)arg;
-    struct rate_stats cur = ctx->new;
-    struct rate_batch_stats *txbs = &cur.txbs;
-    struct rate_batch_stats *rxbs = &cur.rxbs;
-    struct rate_batch_stats *txbs_old = &ctx->old.txbs;
-    struct rate_batch_stats *rxbs_old = &ctx->old.rxbs;
-    uint64_t tx_batch, rx_batch;
-    unsigned long txpkts, rxpkts;
-    unsigned long gtxk, grxk;
-    int r;
-
-    txpkts = txbs->pkt - txbs_old->pkt;
-    rxpkts = rxbs->pkt - rxbs_old->pkt;
-
-    tx_batch = ((txbs->sync - txbs_old->sync) > 0) ?
-	       txpkts / (txbs->sync - txbs_old->sync): 0;
-    rx_batch = ((rxbs->sync - rxbs_old->sync) > 0) ?
-	       rxpkts / (rxbs->sync - rxbs_old->sync): 0;
-
-    /* Fix-up gtxk and grxk estimates. */
-    gtxk = (cur.gtxk - ctx->old.gtxk) - (cur.btxwu - ctx->old.btxwu);
-    grxk = (cur.grxk - ctx->old.grxk) - (cur.brxwu - ctx->old.brxwu);
-
-    printk("txpkts  = %lu Hz\n", txpkts/RATE_PERIOD);
-    printk("gtxk    = %lu Hz\n", gtxk/RATE_PERIOD);
-    printk("htxk    = %lu Hz\n", (cur.htxk - ctx->old.htxk)/RATE_PERIOD);
-    printk("btxw    = %lu Hz\n", (cur.btxwu - ctx->old.btxwu)/RATE_PERIOD);
-    printk("rxpkts  = %lu Hz\n", rxpkts/RATE_PERIOD);
-    printk("grxk    = %lu Hz\n", grxk/RATE_PERIOD);
-    printk("hrxk    = %lu Hz\n", (cur.hrxk - ctx->old.hrxk)/RATE_PERIOD);
-    printk("brxw    = %lu Hz\n", (cur.brxwu - ctx->old.brxwu)/RATE_PERIOD);
-    printk("txbatch = %llu avg\n", tx_batch);
-    printk("rxbatch = %llu avg\n", rx_batch);
-    printk("\n");
-
-    ctx->old = cur;
-    r = mod_timer(&ctx->timer, jiffies +
-            msecs_to_jiffies(RATE_PERIOD * 1000));
-    if (unlikely(r))
-        D("[ptnetmap] Error: mod_timer()\n");
+    struct ptnetmap_stats *g = &ptnet_stats[t];
+
+    atomic_add_long(&g->wakeups, st->wakeups);
+    atomic_add_long(&g->syncs, st->syncs);
+    atomic_add_long(&g->pkts, st->pkts);
+    atomic_add_long(&g->polls, st->polls);
+    atomic_add_long(&g->sleeps, st->sleeps);
+    atomic_add_long(&g->intrs, st->intrs);
 }
 
-static void
-rate_batch_stats_update(struct rate_batch_stats *bf, uint32_t pre_tail,
-		        uint32_t act_tail, uint32_t num_slots)
+/* number of slots moved by a sync, from the old and new tail */
+static inline u_int
+ptnetmap_moved(uint32_t pre_tail, uint32_t act_tail, uint32_t num_slots)
 {
     int n = (int)act_tail - pre_tail;
 
-    if (n) {
-        if (n < 0)
-            n += num_slots;
-
-        bf->sync++;
-        bf->pkt += n;
-    } else {
-        bf->sync_dry++;
-    }
+    if (n < 0)
+        n += num_slots;
+    return n;
 }
 
-#else /* !RATE */
-#define IFRATE(x)
-#endif /* RATE */
-
 struct ptnetmap_state {
     /* Kthreads. */
     struct nm_kthread **kthreads;
@@ -180,7 +171,8 @@ struct ptnetmap_state {
     /* Netmap adapter wrapping the backend. */
     struct netmap_pt_host_adapter *pth_na;
 
-    IFRATE(struct rate_context rate_ctx;)
+    /* Polling and batching state, one per kthread. */
+    struct ptnetmap_ring_state *rstate;
 };
 
 static inline void
@@ -239,6 +231,73 @@ ptring_intr_enable(struct ptnet_ring __user *ptring, uint32_t val)
     CSB_WRITE(ptring, guest_need_kick, val);
 }
 
+/*
+ * Is there some work for the kthread? For TX, new slots from the guest;
+ * for RX, free slots to receive into.
+ */
+#ifndef BUSY_WAIT
+static inline int ptnetmap_norxslots(struct netmap_kring *, uint32_t);
+
+static inline bool
+ptnetmap_ring_busy(struct netmap_kring *kring, struct netmap_ring *g_ring)
+{
+    if (kring->tx == NR_TX)
+        return g_ring->head != kring->rhead;
+    return !ptnetmap_norxslots(kring, g_ring->head);
+}
+
+/*
+ * Poll the CSB (updating g_ring) until there is some work or the budget
+ * of the ring expires, and adjust the budget. Returns true if there is
+ * some work, in which case the guest kicks are still disabled.
+ */
+static bool
+ptnetmap_spin(struct ptnetmap_state *ptns, struct ptnetmap_ring_state *prs,
+              struct netmap_kring *kring, struct ptnet_ring __user *ptring,
+              struct netmap_ring *g_ring)
+{
+    int m = NM_ACCESS_ONCE(ptnet_spin_max);
+    u_int max = m < 0 ? 0 : m;
+    u_int i;
+
+    if (prs->spin > max)
+        prs->spin = max;
+    else if (prs->spin == 0)
+        prs->spin = max ? 1 : 0;
+
+    for (i = 0; i < prs->spin && !ptns->stopped; i++) {
+        usleep_range(1,1);
+        ptnetmap_host_read_kring_csb(ptring, g_ring, kring->nkr_num_slots);
+        if (ptnetmap_ring_busy(kring, g_ring)) {
+            /* traffic is flowing, poll longer next time */
+            prs->spin = (prs->spin > max / 2) ? max : prs->spin * 2;
+            return true;
+        }
+    }
+    if (prs->spin > 1)
+        prs->spin >>= 1;
+    return false;
+}
+#endif /* !BUSY_WAIT */
+
+/*
+ * Maximum number of slots for a TX batch, 0 if there is no limit.
+ * The average occupancy is updated with the current one.
+ */
+static inline u_int
+ptnetmap_tx_batch_lim(struct ptnetmap_ring_state *prs, u_int batch,
+                      u_int num_slots)
+{
+    int lim = NM_ACCESS_ONCE(ptnet_tx_batch);
+
+    prs->occ += batch - (prs->occ >> PTN_OCC_SHIFT);
+    if (lim > 0)
+        return lim;
+    if (lim == 0 && (prs->occ >> PTN_OCC_SHIFT) > (num_slots >> 1))
+        return num_slots >> 1;
+    return 0;
+}
+
 /* Handle TX events: from the guest or from the backend */
 static void
 ptnetmap_tx_handler(void *data)
@@ -247,13 +306,15 @@ ptnetmap_tx_handler(void *data)
     struct netmap_pt_host_adapter *pth_na =
 		(struct netmap_pt_host_adapter *)kring->na->na_private;
     struct ptnetmap_state *ptns = pth_na->ptns;
+    struct ptnetmap_ring_state *prs;
+    struct ptnetmap_stats st;
     struct ptnet_ring __user *ptring;
     struct netmap_ring g_ring;	/* guest ring pointer, copied from CSB */
     bool more_txspace = false;
     struct nm_kthread *kth;
     uint32_t num_slots;
-    int batch;
-    IFRATE(uint32_t pre_tail);
+    uint32_t pre_tail;
+    u_int batch, lim;
 
     if (unlikely(!ptns)) {
         D("ERROR ptnetmap state is NULL");
@@ -270,12 +331,13 @@ ptnetmap_tx_handler(void *data)
         return;
     }
 
-    /* This is a guess, to be fixed in the rate callback. */
-    IFRATE(ptns->rate_ctx.new.gtxk++);
+    bzero(&st, sizeof(st));
+    st.wakeups++;
 
     /* Get TX ptring pointer from the CSB. */
     ptring = ptns->ptrings + kring->ring_id;
     kth = ptns->kthreads[kring->ring_id];
+    prs = ptns->rstate + kring->ring_id;
 
     num_slots = kring->nkr_num_slots;
     g_ring.head = kring->rhead;
@@ -289,22 +351,22 @@ ptnetmap_tx_handler(void *data)
     for (;;) {
 	/* If guest moves ahead too fast, let's cut the move so
 	 * that we don't exceed our batch limit. */
-        batch = g_ring.head - kring->nr_hwcur;
-        if (batch < 0)
-            batch += num_slots;
-
-#ifdef PTN_TX_BATCH_LIM
-        if (batch > PTN_TX_BATCH_LIM(num_slots)) {
-            uint32_t head_lim = kring->nr_hwcur + PTN_TX_BATCH_LIM(num_slots);
+        batch = ptnetmap_moved(kring->nr_hwcur, g_ring.head, num_slots);
+        lim = ptnetmap_tx_batch_lim(prs, batch, num_slots);
+        if (lim && batch > lim) {
+            uint32_t head_lim = kring->nr_hwcur + lim;
 
             if (head_lim >= num_slots)
                 head_lim -= num_slots;
+            /* do not split a packet */
+            while (head_lim != g_ring.head &&
+                   (kring->ring->slot[nm_prev(head_lim, num_slots - 1)].flags
+                    & NS_MOREFRAG))
+                head_lim = nm_next(head_lim, num_slots - 1);
             ND(1, "batch: %d head: %d head_lim: %d", batch, g_ring.head,
 						     head_lim);
-            g_ring.head = head_lim;
-	    batch = PTN_TX_BATCH_LIM(num_slots);
+            g_ring.head = g_ring.cur = head_lim;
         }
-#endif /* PTN_TX_BATCH_LIM */
 
         if (nm_kr_txspace(kring) <= (num_slots >> 1)) {
             g_ring.flags |= NAF_FORCE_RECLAIM;
@@ -325,7 +387,7 @@ ptnetmap_tx_handler(void *data)
             ptnetmap_kring_dump("pre txsync", kring);
 	}
 
-        IFRATE(pre_tail = kring->rtail);
+        pre_tail = kring->rtail;
         if (unlikely(kring->nm_sync(kring, g_ring.flags))) {
             /* Reenable notifications. */
             ptring_kick_enable(ptring, 1);
@@ -346,8 +408,8 @@ ptnetmap_tx_handler(void *data)
 	    more_txspace = true;
         }
 
-        IFRATE(rate_batch_stats_update(&ptns->rate_ctx.new.txbs, pre_tail,
-				      kring->rtail, num_slots));
+        st.syncs++;
+        st.pkts += ptnetmap_moved(pre_tail, kring->rtail, num_slots);
 
         if (unlikely(netmap_verbose & NM_VERB_TXSYNC)) {
             ptnetmap_kring_dump("post txsync", kring);
@@ -359,7 +421,7 @@ ptnetmap_tx_handler(void *data)
             /* Disable guest kick to avoid sending unnecessary kicks */
             ptring_intr_enable(ptring, 0);
             nm_os_kthread_send_irq(kth);
-            IFRATE(ptns->rate_ctx.new.htxk++);
+            st.intrs++;
             more_txspace = false;
         }
 #endif
@@ -368,13 +430,18 @@ ptnetmap_tx_handler(void *data)
 #ifndef BUSY_WAIT
         if (g_ring.head == kring->rhead) {
             /*
-             * No more packets to transmit. We enable notifications and
-             * go to sleep, waiting for a kick from the guest when new
-             * new slots are ready for transmission.
+             * No more packets to transmit. We keep polling the CSB for
+             * a while, then we enable notifications and go to sleep,
+             * waiting for a kick from the guest when new slots are
+             * ready for transmission.
              */
-            usleep_range(1,1);
+            if (ptnetmap_spin(ptns, prs, kring, ptring, &g_ring)) {
+                st.polls++;
+                continue;
+            }
             /* Reenable notifications. */
             ptring_kick_enable(ptring, 1);
+            st.sleeps++;
             /* Doublecheck. */
             ptnetmap_host_read_kring_csb(ptring, &g_ring, num_slots);
             if (g_ring.head != kring->rhead) {
@@ -404,8 +471,9 @@ ptnetmap_tx_handler(void *data)
     if (more_txspace && ptring_intr_enabled(ptring)) {
         ptring_intr_enable(ptring, 0);
         nm_os_kthread_send_irq(kth);
-        IFRATE(ptns->rate_ctx.new.htxk++);
+        st.intrs++;
     }
+    ptnetmap_stats_add(NR_TX, &st);
 }
 
 /*
@@ -429,13 +497,15 @@ ptnetmap_rx_handler(void *data)
     struct netmap_pt_host_adapter *pth_na =
 		(struct netmap_pt_host_adapter *)kring->na->na_private;
     struct ptnetmap_state *ptns = pth_na->ptns;
+    struct ptnetmap_ring_state *prs;
+    struct ptnetmap_stats st;
     struct ptnet_ring __user *ptring;
     struct netmap_ring g_ring;	/* guest ring pointer, copied from CSB */
     struct nm_kthread *kth;
     uint32_t num_slots;
     int dry_cycles = 0;
     bool some_recvd = false;
-    IFRATE(uint32_t pre_tail);
+    uint32_t pre_tail;
 
     if (unlikely(!ptns || !ptns->pth_na)) {
         D("ERROR ptnetmap state %p, ptnetmap host adapter %p", ptns,
@@ -453,12 +523,13 @@ ptnetmap_rx_handler(void *data)
 	return;
     }
 
-    /* This is a guess, to be fixed in the rate callback. */
-    IFRATE(ptns->rate_ctx.new.grxk++);
+    bzero(&st, sizeof(st));
+    st.wakeups++;
 
     /* Get RX ptring pointer from the CSB. */
     ptring = ptns->ptrings + (pth_na->up.num_tx_rings + kring->ring_id);
     kth = ptns->kthreads[pth_na->up.num_tx_rings + kring->ring_id];
+    prs = ptns->rstate + (pth_na->up.num_tx_rings + kring->ring_id);
 
     num_slots = kring->nkr_num_slots;
     g_ring.head = kring->rhead;
@@ -488,7 +559,7 @@ ptnetmap_rx_handler(void *data)
         if (unlikely(netmap_verbose & NM_VERB_RXSYNC))
             ptnetmap_kring_dump("pre rxsync", kring);
 
-        IFRATE(pre_tail = kring->rtail);
+        pre_tail = kring->rtail;
 
         if (unlikely(kring->nm_sync(kring, g_ring.flags))) {
             /* Reenable notifications. */
@@ -510,8 +581,8 @@ ptnetmap_rx_handler(void *data)
             dry_cycles++;
         }
 
-        IFRATE(rate_batch_stats_update(&ptns->rate_ctx.new.rxbs, pre_tail,
-	                               kring->rtail, num_slots));
+        st.syncs++;
+        st.pkts += ptnetmap_moved(pre_tail, kring->rtail, num_slots);
 
         if (unlikely(netmap_verbose & NM_VERB_RXSYNC))
             ptnetmap_kring_dump("post rxsync", kring);
@@ -522,7 +593,7 @@ ptnetmap_rx_handler(void *data)
             /* Disable guest kick to avoid sending unnecessary kicks */
             ptring_intr_enable(ptring, 0);
             nm_os_kthread_send_irq(kth);
-            IFRATE(ptns->rate_ctx.new.hrxk++);
+            st.intrs++;
             some_recvd = false;
         }
 #endif
@@ -531,13 +602,18 @@ ptnetmap_rx_handler(void *data)
 #ifndef BUSY_WAIT
         if (ptnetmap_norxslots(kring, g_ring.head)) {
             /*
-             * No more slots available for reception. We enable notification and
-             * go to sleep, waiting for a kick from the guest when new receive
-	     * slots are available.
+             * No more slots available for reception. We keep polling
+             * the CSB for a while, then we enable notification and go
+             * to sleep, waiting for a kick from the guest when new
+             * receive slots are available.
              */
-            usleep_range(1,1);
+            if (ptnetmap_spin(ptns, prs, kring, ptring, &g_ring)) {
+                st.polls++;
+                continue;
+            }
             /* Reenable notifications. */
             ptring_kick_enable(ptring, 1);
+            st.sleeps++;
             /* Doublecheck. */
             ptnetmap_host_read_kring_csb(ptring, &g_ring, num_slots);
             if (!ptnetmap_norxslots(kring, g_ring.head)) {
@@ -571,8 +647,9 @@ ptnetmap_rx_handler(void *data)
     if (some_recvd && ptring_intr_enabled(ptring)) {
         ptring_intr_enable(ptring, 0);
         nm_os_kthread_send_irq(kth);
-        IFRATE(ptns->rate_ctx.new.hrxk++);
+        st.intrs++;
     }
+    ptnetmap_stats_add(NR_RX, &st);
 }
 
 #ifdef DEBUG
@@ -796,13 +873,17 @@ ptnetmap_create(struct netmap_pt_host_adapter *pth_na,
         return EINVAL;
     }
 
-    ptns = malloc(sizeof(*ptns) + num_rings * sizeof(*ptns->kthreads),
-		  M_DEVBUF, M_NOWAIT | M_ZERO);
+    ptns = malloc(sizeof(*ptns) + num_rings * (sizeof(*ptns->kthreads) +
+		  sizeof(*ptns->rstate)), M_DEVBUF, M_NOWAIT | M_ZERO);
     if (!ptns) {
         return ENOMEM;
     }
 
     ptns->kthreads = (struct nm_kthread **)(ptns + 1);
+    ptns->rstate = (struct ptnetmap_ring_state *)(ptns->kthreads + num_rings);
+    for (i = 0; i < num_rings; i++) {
+        ptns->rstate[i].spin = 1;
+    }
     ptns->stopped = true;
 
     /* Cross-link data structures. */
@@ -841,14 +922,6 @@ ptnetmap_create(struct netmap_pt_host_adapter *pth_na,
         pth_na->up.tx_rings[i].nm_notify = nm_pt_host_notify;
     }
 
-#ifdef RATE
-    memset(&ptns->rate_ctx, 0, sizeof(ptns->rate_ctx));
-    setup_timer(&ptns->rate_ctx.timer, &rate_callback,
-            (unsigned long)&ptns->rate_ctx);
-    if (mod_timer(&ptns->rate_ctx.timer, jiffies + msecs_to_jiffies(1500)))
-        D("[ptn] Error: mod_timer()\n");
-#endif
-
     DBG(D("[%s] ptnetmap configuration DONE", pth_na->up.name));
 
     return 0;
@@ -896,8 +969,6 @@ ptnetmap_delete(struct netmap_pt_host_adapter *pth_na)
 	ptns->kthreads[i] = NULL;
     }
 
-    IFRATE(del_timer(&ptns->rate_ctx.timer));
-
     free(ptns, M_DEVBUF);
 
     pth_na->ptns = NULL;
@@ -993,11 +1064,11 @@ nm_pt_host_notify(struct netmap_kring *kring, int flags)
 	/* Notify kthreads (wake up if needed) */
 	if (kring->tx == NR_TX) {
 		ND(1, "TX backend irq");
-		IFRATE(ptns->rate_ctx.new.btxwu++);
+		atomic_add_long(&ptnet_stats[NR_TX].bwakeups, 1);
 	} else {
 		k += pth_na->up.num_tx_rings;
 		ND(1, "RX backend irq");
-		IFRATE(ptns->rate_ctx.new.brxwu++);
+		atomic_add_long(&ptnet_stats[NR_RX].bwakeups, 1);
 	}
 	nm_os_kthread_wakeup_worker(ptns->kthreads[k]);
 
@@ -1187,6 +1258,8 @@ netmap_get_pt_host_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
     //XXX pth_na->up.na_flags = parent->na_flags;
     pth_na->up.num_rx_rings = parent->num_rx_rings;
     pth_na->up.num_tx_rings = parent->num_tx_rings;
+    pth_na->up.num_host_rx_rings = parent->num_host_rx_rings;
+    pth_na->up.num_host_tx_rings = parent->num_host_tx_rings;
     pth_na->up.num_tx_desc = parent->num_tx_desc;
     pth_na->up.num_rx_desc = parent->num_rx_desc;
 
@@ -75,12 +75,12 @@
     +===============+                 /        | buf_idx, len  | slot[1]
     | txring_ofs[0] | (rel.to nifp)--'         | flags, ptr    |
     | txring_ofs[1] |                          +---------------+
-     (tx+1 entries)                           (num_slots entries)
+     (tx+htx entries)                         (num_slots entries)
     | txring_ofs[t] |                          | buf_idx, len  | slot[n-1]
     +---------------+                          | flags, ptr    |
     | rxring_ofs[0] |                          +---------------+
     | rxring_ofs[1] |
-     (rx+1 entries)
+     (rx+hrx entries)
     | rxring_ofs[r] |
     +---------------+
 
@@ -90,6 +90,7 @@
  *
  * There is one netmap_ring per physical NIC ring, plus one tx/rx ring
  * pair attached to the host stack (this pair is unused for non-NIC ports).
+ * NICs can have more than one host ring pair, see nr_host_tx_rings.
  *
  * All physical/host stack ports share the same memory region,
  * so that zero-copy can be implemented between them.
@@ -113,7 +114,9 @@
  *
  *   The buffers are linked to each other using the first uint32_t
  *   as the index. On close, ni_bufs_head must point to the list of
- *   buffers to be released.
+ *   buffers to be released. Only the buffers allocated through this
+ *   file descriptor are released, a buffer swapped into a ring is
+ *   released with the ring.
  *
  * + NIOCREGIF can request space for extra rings (and buffers)
  *   allocated in the same memory space. The number of extra rings
@@ -129,10 +132,19 @@
  * + NIOCREGIF can also attach to 'monitor' rings that replicate
  *   the content of specific rings, also from the same memory space.
  *
+ * + NIOCREGIF can ask for more than one host ring pair, in
+ *   nr_host_tx_rings and nr_host_rx_rings, so that the traffic
+ *   to and from the host stack is spread over several rings.
+ *   The rings are found using ni_host_tx_rings and ni_host_rx_rings
+ *   in the netmap_if, see NETMAP_RXRING(). These fields were spare
+ *   before, so kernels without this feature return 0 in them (and in
+ *   nr_host_*_rings) which must be read as 1.
+ *
  *   Extra flags in nr_flags support the above functions.
  *   Application libraries may use the following naming scheme:
  *	netmap:foo			all NIC ring pairs
- *	netmap:foo^			only host ring pair
+ *	netmap:foo^			only host ring pairs
+ *	netmap:foo^k			the k-th host ring pair
  *	netmap:foo+			all NIC ring + host ring pairs
  *	netmap:foo-k			the k-th NIC ring pair
  *	netmap:foo{k			PIPE ring pair k, master side
@@ -332,12 +344,14 @@ struct netmap_if {
 	const uint32_t	ni_rx_rings;	/* number of HW rx rings */
 
 	uint32_t	ni_bufs_head;	/* head index for extra bufs */
-	uint32_t	ni_spare1[5];
+	const uint32_t	ni_host_tx_rings; /* number of host tx rings, 0 is 1 */
+	const uint32_t	ni_host_rx_rings; /* number of host rx rings, 0 is 1 */
+	uint32_t	ni_spare1[3];
 	/*
 	 * The following array contains the offset of each netmap ring
 	 * from this structure, in the following order:
-	 * NIC tx rings (ni_tx_rings); host tx ring (1); extra tx rings;
-	 * NIC rx rings (ni_rx_rings); host tx ring (1); extra rx rings.
+	 * NIC tx rings (ni_tx_rings); host tx rings (ni_host_tx_rings);
+	 * NIC rx rings (ni_rx_rings); host rx rings (ni_host_rx_rings).
 	 *
 	 * The area is filled up by the kernel on NIOCREGIF,
 	 * and then only read by userspace code.
@@ -434,6 +448,13 @@ struct netmap_if {
  *
  * nr_arg3 (in/out)	number of extra buffers to be allocated.
  *
+ * nr_host_tx_rings, nr_host_rx_rings (in/out)
+ *		The number of host rings of a NIC. Like nr_tx_rings,
+ *		they are only honored by the first NIOCREGIF on the
+ *		interface, 0 means one ring. Packets from the host stack
+ *		are spread over the host rx rings by their tx queue.
+ *		NR_REG_ONE_SW binds the host ring pair in NETMAP_RING_MASK.
+ *
  *
  *
  * nr_cmd (in)	if non-zero indicates a special command:
@@ -457,10 +478,44 @@ struct netmap_if {
  *	NETMAP_BDG_NEWIF
  *		create a persistent VALE port with name nr_name.
  *		Used by vale-ctl -n ...
+ *	    nr_arg2 may select where the private memory of the port
+ *		is allocated: NUMA node + 1 in NETMAP_BDG_NODE_MASK
+ *		(0 means any node) and NETMAP_BDG_HUGEPAGES to put the
+ *		buffers in huge pages when possible. Both are hints,
+ *		used by vale-ctl -n ... -C ...,node=N,huge
  *
  *	NETMAP_BDG_DELIF
  *		delete a persistent VALE port. Used by vale-ctl -d ...
  *
+ *	NETMAP_BDG_CLS
+ *		add, remove or list the classifier rules of the switch
+ *		nr_name. nr_arg1..nr_arg3 hold the address of a
+ *		struct nm_cls_rule, whose cr_op selects the operation.
+ *		Used by vale-ctl -F and -f ...
+ *
+ *	NETMAP_BDG_QOS
+ *		set or get the rate limits, the priority class and the
+ *		drop counters of the VALE port nr_name. nr_arg1..nr_arg3
+ *		hold the address of a struct nm_qos_req.
+ *		Used by vale-ctl -q ...
+ *
+ *	NETMAP_EXTRA_ALLOC
+ *		on a file descriptor already bound with NIOCREGIF,
+ *		allocate nr_arg3 more extra buffers and push them
+ *		on the list at nifp->ni_bufs_head. A file descriptor
+ *		can hold at most half of the buffer pool, larger
+ *		requests fail with ENOMEM.
+ *
+ *	NETMAP_EXTRA_FREE
+ *		on a bound file descriptor, release up to nr_arg3
+ *		buffers (all if 0) from the head of the list at
+ *		nifp->ni_bufs_head, which is updated. Only buffers
+ *		allocated through the same file descriptor can be
+ *		released, the first other index stops with EINVAL.
+ *	    Both return the number of buffers moved in nr_arg3.
+ *		See nm_bufs_alloc() and struct nm_bufcache in
+ *		netmap_user.h.
+ *
  * nr_arg1, nr_arg2, nr_arg3  (in/out)		command specific
  *
  *
@@ -505,14 +560,22 @@ struct nmreq {
 #define NETMAP_BDG_POLLING_ON	10	/* delete polling kthread */
 #define NETMAP_BDG_POLLING_OFF	11	/* delete polling kthread */
 #define NETMAP_VNET_HDR_GET	12      /* get the port virtio-net-hdr length */
+#define NETMAP_BDG_CLS		13	/* VALE classifier rules */
+#define NETMAP_BDG_QOS		14	/* VALE port rate limits and class */
+#define NETMAP_EXTRA_ALLOC	15	/* get more extra buffers */
+#define NETMAP_EXTRA_FREE	16	/* release extra buffers */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
 
 	uint16_t	nr_arg2;
-	uint32_t	nr_arg3;	/* req. extra buffers in NIOCREGIF */
+#define NETMAP_BDG_NODE_MASK	0x0fff	/* NEWIF: NUMA node + 1, 0 any */
+#define NETMAP_BDG_HUGEPAGES	0x8000	/* NEWIF: buffers in huge pages */
+	uint32_t	nr_arg3;	/* req. extra buffers in NIOCREGIF
+					 * and NETMAP_EXTRA_* */
 	uint32_t	nr_flags;
 	/* various modes, extends nr_ringid */
-	uint32_t	spare2[1];
+	uint16_t	nr_host_tx_rings;	/* number of host tx rings */
+	uint16_t	nr_host_rx_rings;	/* number of host rx rings */
 };
 
 #define NR_REG_MASK		0xf /* values for nr_flags */
@@ -523,6 +586,7 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 	NR_REG_ONE_NIC	= 4,
 	NR_REG_PIPE_MASTER = 5,
 	NR_REG_PIPE_SLAVE = 6,
+	NR_REG_ONE_SW	= 7,
 };
 /* monitor uses the NR_REG to select the rings to monitor */
 #define NR_MONITOR_TX	0x100
@@ -542,6 +606,76 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
  * NETMAP_VNET_HDR_GET command to figure out the header length. */
 #define NR_ACCEPT_VNET_HDR	0x8000
 
+/*
+ * A 5-tuple rule for the VALE classifier (NETMAP_BDG_CLS).
+ * Addresses and ports are in network byte order. A zero mask,
+ * protocol or port matches anything. IPv4 packets are looked up
+ * before the learning (or external) lookup function, and the
+ * matching rule with the highest cr_prio decides what to do:
+ *	NM_CLS_FWD	send to port cr_port, ring cr_ring
+ *	NM_CLS_DROP	drop the packet
+ *	NM_CLS_MIRROR	forward as usual, and also send a copy
+ *			to port cr_port, ring cr_ring
+ * cr_port is the port index reported by NETMAP_BDG_LIST, and
+ * cr_ring can be NM_CLS_ANYRING to keep the ring of the sender.
+ * Rules referring to a port are removed when the port leaves
+ * the switch.
+ */
+struct nm_cls_rule {
+	uint16_t	cr_op;
+#define NM_CLS_ADD	1	/* add a rule, return its id in cr_id */
+#define NM_CLS_DEL	2	/* remove rule cr_id */
+#define NM_CLS_FLUSH	3	/* remove all rules */
+#define NM_CLS_GET	4	/* get the first rule with id >= cr_id */
+	uint16_t	cr_id;
+	uint16_t	cr_prio;	/* higher values win */
+	uint8_t		cr_action;
+#define NM_CLS_FWD	1
+#define NM_CLS_DROP	2
+#define NM_CLS_MIRROR	3
+	uint8_t		cr_proto;	/* IP protocol */
+	uint32_t	cr_src;
+	uint32_t	cr_src_mask;
+	uint32_t	cr_dst;
+	uint32_t	cr_dst_mask;
+	uint16_t	cr_sport;
+	uint16_t	cr_dport;
+	uint16_t	cr_port;
+	uint16_t	cr_ring;
+#define NM_CLS_ANYRING	0xffff
+	uint64_t	cr_hits;	/* matched packets, out */
+};
+
+/*
+ * Traffic control for a VALE port (NETMAP_BDG_QOS).
+ * The input limit applies to the traffic that the port sends into
+ * the switch, the output limit to the traffic the switch delivers
+ * to the port. Limits are token buckets with a rate in kbit/s
+ * (0 means unlimited) and a depth in bytes (0 picks a default),
+ * enforced on each ring of the port.
+ * The class is a strict priority: when a destination ring fills up,
+ * packets from class c ports are dropped as long as fewer than
+ * c/8 of the ring slots are free, so the last slots are left to
+ * the higher priority classes (0 is the highest).
+ */
+struct nm_qos_req {
+	uint16_t	qr_op;
+#define NM_QOS_SET	1
+#define NM_QOS_GET	2
+	uint8_t		qr_class;
+#define NM_QOS_NCLASSES	4
+	uint8_t		qr_spare;
+	uint32_t	qr_in_rate;	/* kbit/s */
+	uint32_t	qr_in_burst;	/* bytes */
+	uint32_t	qr_out_rate;	/* kbit/s */
+	uint32_t	qr_out_burst;	/* bytes */
+	uint32_t	qr_spare2;
+	/* counters, out */
+	uint64_t	qr_in_drops;	/* packets over the input rate */
+	uint64_t	qr_out_drops;	/* packets over the output rate */
+	uint64_t	qr_class_drops;	/* slots refused by the class limit */
+};
+
 
 /*
  * Windows does not have _IOWR(). _IO(), _IOW() and _IOR() are defined
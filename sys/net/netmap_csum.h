@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * $FreeBSD$
+ *
+ * Internet checksum (RFC 1071) routines shared by the kernel
+ * (VALE offloadings) and by userspace tools.
+ *
+ * Partial sums are unfolded 64 bit values of the 16 bit words taken
+ * in memory order, so the result of nm_csum_wrap() can be stored in
+ * a header field as is, on any endianness. Use ntohs() on a folded
+ * sum to get the conventional (big endian) value.
+ *
+ *	uint64_t nm_csum_partial(const void *p, size_t len)
+ *		sum of the bytes in [p, p+len)
+ *	uint64_t nm_csum_copy(const void *src, void *dst, size_t len)
+ *		copy len bytes and return their sum, in a single pass
+ *	uint16_t nm_csum_fold16(uint64_t sum)
+ *		fold a partial sum to 16 bits
+ *	uint16_t nm_csum_wrap(uint64_t sum)
+ *		fold and complement, ready to be stored in a header
+ *	uint16_t nm_csum_swab(uint16_t sum)
+ *		adjust the folded sum of a block starting at an odd offset
+ *
+ * Partial sums of blocks that start at even offsets can be added.
+ * Userspace programs built for x86_64 with gcc or clang use an AVX2
+ * implementation when the cpu supports it, selected at runtime.
+ * In the kernel we stick to the 64 bit scalar code, which does not
+ * need to save the vector state.
+ */
+
+#ifndef _NET_NETMAP_CSUM_H_
+#define _NET_NETMAP_CSUM_H_
+
+#if !defined(_KERNEL) && !defined(__KERNEL__)
+#include <stdint.h>
+#include <string.h>	/* memcpy */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NM_CSUM_AVX2
+#include <immintrin.h>
+#endif /* __x86_64__ */
+#endif /* !_KERNEL */
+
+/* blocks shorter than this are not worth the vector setup */
+#define NM_CSUM_AVX2_MIN	128
+
+static inline uint16_t
+nm_csum_fold16(uint64_t sum)
+{
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+static inline uint16_t
+nm_csum_wrap(uint64_t sum)
+{
+	return (uint16_t)~nm_csum_fold16(sum);
+}
+
+static inline uint16_t
+nm_csum_swab(uint16_t sum)
+{
+	return (uint16_t)((sum << 8) | (sum >> 8));
+}
+
+/*
+ * Scalar kernel. The main loop moves 64 bit words and keeps two
+ * accumulators (with their carry counts) so that the adds run in
+ * parallel with the loads; 2^32 and 2^64 are both 1 modulo 0xFFFF,
+ * so the wide sums fold to the same result as a word by word sum.
+ * If dst is not NULL the data is also copied there.
+ */
+static inline uint64_t
+nm_csum_copy_scalar(const uint8_t *src, uint8_t *dst, size_t len)
+{
+	uint64_t s0 = 0, s1 = 0, c0 = 0, c1 = 0;
+	uint64_t w0, w1;
+	uint32_t w32;
+	uint16_t w16;
+
+	for (; len >= 16; src += 16, len -= 16) {
+		memcpy(&w0, src, 8);
+		memcpy(&w1, src + 8, 8);
+		if (dst) {
+			memcpy(dst, &w0, 8);
+			memcpy(dst + 8, &w1, 8);
+			dst += 16;
+		}
+		s0 += w0;
+		c0 += (s0 < w0);
+		s1 += w1;
+		c1 += (s1 < w1);
+	}
+	if (len >= 8) {
+		memcpy(&w0, src, 8);
+		if (dst) {
+			memcpy(dst, &w0, 8);
+			dst += 8;
+		}
+		s0 += w0;
+		c0 += (s0 < w0);
+		src += 8;
+		len -= 8;
+	}
+	c1 += (s0 & 0xFFFFFFFF) + (s0 >> 32) + (s1 & 0xFFFFFFFF) + (s1 >> 32);
+	if (len >= 4) {
+		memcpy(&w32, src, 4);
+		if (dst) {
+			memcpy(dst, &w32, 4);
+			dst += 4;
+		}
+		c1 += w32;
+		src += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&w16, src, 2);
+		if (dst) {
+			memcpy(dst, &w16, 2);
+			dst += 2;
+		}
+		c1 += w16;
+		src += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* the trailing byte is the first one of a 16 bit word */
+		w16 = 0;
+		memcpy(&w16, src, 1);
+		if (dst)
+			*dst = *src;
+		c1 += w16;
+	}
+	return c0 + c1;
+}
+
+#ifdef NM_CSUM_AVX2
+/*
+ * AVX2 kernel: each 32 byte block is split in its low and high 16 bit
+ * halves, which are added to eight 32 bit lanes, using two accumulators
+ * to break the dependency chain. Lanes grow by at most 2 * 0xFFFF per
+ * block, so they are flushed to 64 bit lanes before they can overflow.
+ * Whatever is left after the last full block goes through the scalar
+ * code (at an even offset, as 32 is even).
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+nm_csum_avx2_add(__m256i acc, __m256i v)
+{
+	const __m256i lo16 = _mm256_set1_epi32(0xFFFF);
+
+	return _mm256_add_epi32(acc, _mm256_add_epi32(
+		_mm256_and_si256(v, lo16), _mm256_srli_epi32(v, 16)));
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t
+nm_csum_copy_avx2(const uint8_t *src, uint8_t *dst, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc64 = zero;
+	uint64_t lanes[4];
+
+	while (len >= 32) {
+		__m256i a0 = zero, a1 = zero, v0, v1;
+		size_t n = len / 64;
+
+		if (n > 16384)
+			n = 16384;
+		len -= n * 64;
+		for (; n > 0; n--, src += 64) {
+			v0 = _mm256_loadu_si256((const __m256i *)src);
+			v1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+			if (dst) {
+				_mm256_storeu_si256((__m256i *)dst, v0);
+				_mm256_storeu_si256((__m256i *)(dst + 32), v1);
+				dst += 64;
+			}
+			a0 = nm_csum_avx2_add(a0, v0);
+			a1 = nm_csum_avx2_add(a1, v1);
+		}
+		if (len >= 32 && len < 64) {
+			/* last odd block */
+			v0 = _mm256_loadu_si256((const __m256i *)src);
+			if (dst) {
+				_mm256_storeu_si256((__m256i *)dst, v0);
+				dst += 32;
+			}
+			a0 = nm_csum_avx2_add(a0, v0);
+			src += 32;
+			len -= 32;
+		}
+		a0 = _mm256_add_epi64(_mm256_unpacklo_epi32(a0, zero),
+				      _mm256_unpackhi_epi32(a0, zero));
+		a1 = _mm256_add_epi64(_mm256_unpacklo_epi32(a1, zero),
+				      _mm256_unpackhi_epi32(a1, zero));
+		acc64 = _mm256_add_epi64(acc64, _mm256_add_epi64(a0, a1));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, acc64);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		nm_csum_copy_scalar(src, dst, len);
+}
+
+static inline int
+nm_csum_use_avx2(void)
+{
+	static int use_avx2 = -1;
+
+	if (use_avx2 < 0)
+		use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return use_avx2;
+}
+#endif /* NM_CSUM_AVX2 */
+
+static inline uint64_t
+nm_csum_copy(const void *src, void *dst, size_t len)
+{
+#ifdef NM_CSUM_AVX2
+	if (len >= NM_CSUM_AVX2_MIN && nm_csum_use_avx2())
+		return nm_csum_copy_avx2(src, dst, len);
+#endif /* NM_CSUM_AVX2 */
+	return nm_csum_copy_scalar(src, dst, len);
+}
+
+static inline uint64_t
+nm_csum_partial(const void *p, size_t len)
+{
+	return nm_csum_copy(p, NULL, len);
+}
+
+#endif /* _NET_NETMAP_CSUM_H_ */
@@ -108,8 +108,15 @@
 #define NETMAP_TXRING(nifp, index) _NETMAP_OFFSET(struct netmap_ring *, \
 	nifp, (nifp)->ring_ofs[index] )
 
+/* kernels without multiple host rings leave the counts at 0 */
+#define NETMAP_HOST_TX_RINGS(nifp)				\
+	((nifp)->ni_host_tx_rings ? (nifp)->ni_host_tx_rings : 1)
+#define NETMAP_HOST_RX_RINGS(nifp)				\
+	((nifp)->ni_host_rx_rings ? (nifp)->ni_host_rx_rings : 1)
+
 #define NETMAP_RXRING(nifp, index) _NETMAP_OFFSET(struct netmap_ring *,	\
-	nifp, (nifp)->ring_ofs[index + (nifp)->ni_tx_rings + 1] )
+	nifp, (nifp)->ring_ofs[index + (nifp)->ni_tx_rings +		\
+		NETMAP_HOST_TX_RINGS(nifp)] )
 
 #define NETMAP_BUF(ring, index)				\
 	((char *)(ring) + (ring)->buf_ofs + ((index)*(ring)->nr_buf_size))
@@ -302,7 +309,8 @@ typedef void (*nm_cb_t)(u_char *, const struct nm_pkthdr *, const u_char *d);
  *
  * ifname	(netmap:foo or vale:foo) is the port name
  *		a suffix can indicate the follwing:
- *		^		bind the host (sw) ring pair
+ *		^		bind the host (sw) ring pairs
+ *		^NN		bind individual host ring pair
  *		*		bind host and NIC ring pairs (transparent)
  *		-NN		bind individual NIC ring pair
  *		{NN		bind master side of pipe NN
@@ -370,6 +378,82 @@ static int nm_inject(struct nm_desc *, const void *, size_t);
 static int nm_dispatch(struct nm_desc *, int, nm_cb_t, u_char *);
 static u_char *nm_nextpkt(struct nm_desc *, struct nm_pkthdr *);
 
+/*
+ * Burst API, to handle arrays of packets with a single call.
+ *
+ * nm_recv_burst() fills up to n descriptors with the packets available
+ *	in the rx rings, starting from cur_rx_ring, and releases them
+ *	to the kernel (head and cur are updated once per ring).
+ *	Buffers are valid until the next rx sync (ioctl or poll).
+ * nm_recv_burst_hold() is the same but only advances cur, so the
+ *	application keeps the buffers across syncs until it calls
+ * nm_rx_release(), which returns all the buffers of the ring of b
+ *	up to and including b. Buffers of a ring are returned in order.
+ * nm_send_burst() copies up to n packets in the tx rings, starting
+ *	from cur_tx_ring, and returns the number of packets queued.
+ *	The kernel is notified at the next tx sync.
+ *
+ * nm_tx_reserve() and nm_tx_commit() are a zero-copy alternative to
+ *	nm_inject()/nm_send_burst(). nm_tx_reserve() returns up to n free
+ *	tx slots across the rings, with buf pointing into netmap memory
+ *	and len set to the buffer size, without moving the ring pointers.
+ *	The application builds packets in place, sets len (and NS_MOREFRAG
+ *	on all but the last slot of a multi-slot packet, which must not
+ *	cross a ring boundary), then passes the used descriptors, in the
+ *	order they were reserved, to nm_tx_commit(). Slots of a ring can
+ *	be left unused only at its end. nm_tx_commit() returns the number
+ *	of packets committed; a trailing incomplete chain is not sent.
+ */
+struct nm_bufdesc {
+	char		*buf;	/* packet data */
+	uint32_t	len;	/* packet length */
+	uint16_t	ring;	/* ring index */
+	uint16_t	flags;	/* slot flags */
+	uint32_t	slot;	/* slot index */
+};
+
+static int nm_recv_burst(struct nm_desc *, struct nm_bufdesc *, int);
+static int nm_recv_burst_hold(struct nm_desc *, struct nm_bufdesc *, int);
+static void nm_rx_release(struct nm_desc *, const struct nm_bufdesc *);
+static int nm_send_burst(struct nm_desc *, const struct nm_bufdesc *, int);
+static int nm_tx_reserve(struct nm_desc *, struct nm_bufdesc *, int);
+static int nm_tx_commit(struct nm_desc *, const struct nm_bufdesc *, int);
+
+/*
+ * Extra buffers at runtime (see NETMAP_EXTRA_ALLOC in netmap.h).
+ *
+ * nm_bufs_alloc() gets n more extra buffers, nm_bufs_free() releases
+ *	up to n of them (all if 0). Both return the number of buffers
+ *	moved, or -1 on error. The buffers are on the list at
+ *	d->nifp->ni_bufs_head, linked through their first uint32_t.
+ *	The list belongs to the descriptor, so threads that need extra
+ *	buffers should use a descriptor each (e.g. one per ring), and
+ *	nm_bufs_free() fails with EINVAL at a buffer obtained elsewhere.
+ *
+ * struct nm_bufcache is a free buffer cache on top of the list, for
+ *	applications that hold packets for a variable time (reassembly,
+ *	delay lines, overflow queues).
+ * nm_bufcache_init() counts the buffers already on the list, e.g.
+ *	those requested with nr_arg3 at open time.
+ * nm_buf_get() returns the index of a free buffer, 0 if none, and gets
+ *	'batch' buffers from the kernel when the cache is empty.
+ * nm_buf_put() gives a buffer back to the cache, and releases 'batch'
+ *	buffers to the kernel when the cache holds more than 'max'.
+ */
+struct nm_bufcache {
+	struct nm_desc	*d;
+	uint32_t	count;	/* buffers on the list */
+	uint32_t	batch;	/* buffers moved per ioctl */
+	uint32_t	max;	/* high watermark */
+};
+
+static int nm_bufs_alloc(struct nm_desc *, uint32_t);
+static int nm_bufs_free(struct nm_desc *, uint32_t);
+static void nm_bufcache_init(struct nm_bufcache *, struct nm_desc *,
+	uint32_t batch, uint32_t max);
+static uint32_t nm_buf_get(struct nm_bufcache *);
+static void nm_buf_put(struct nm_bufcache *, uint32_t);
+
 #ifdef _WIN32
 
 intptr_t _get_osfhandle(int); /* defined in io.h in windows */
@@ -638,9 +722,14 @@ nm_open(const char *ifname, const struct nmreq *req,
 		switch (p_state) {
 		case P_START:
 			switch (*port) {
-			case '^': /* only SW ring */
-				nr_flags = NR_REG_SW;
-				p_state = P_RNGSFXOK;
+			case '^': /* only SW rings, or one of them */
+				if (port[1] >= '0' && port[1] <= '9') {
+					nr_flags = NR_REG_ONE_SW;
+					p_state = P_GETNUM;
+				} else {
+					nr_flags = NR_REG_SW;
+					p_state = P_RNGSFXOK;
+				}
 				break;
 			case '*': /* NIC and SW */
 				nr_flags = NR_REG_NIC_SW;
@@ -770,6 +859,8 @@ nm_open(const char *ifname, const struct nmreq *req,
 			d->req.nr_rx_slots = parent->req.nr_rx_slots;
 			d->req.nr_tx_rings = parent->req.nr_tx_rings;
 			d->req.nr_rx_rings = parent->req.nr_rx_rings;
+			d->req.nr_host_tx_rings = parent->req.nr_host_tx_rings;
+			d->req.nr_host_rx_rings = parent->req.nr_host_rx_rings;
 		}
 		if (new_flags & NM_OPEN_IFNAME) {
 			D("overriding ifname %s ringid 0x%x flags 0x%x",
@@ -788,6 +879,11 @@ nm_open(const char *ifname, const struct nmreq *req,
 		snprintf(errmsg, MAXERRMSG, "NIOCREGIF failed: %s", strerror(errno));
 		goto fail;
 	}
+	/* older kernels do not report the host rings, they have one */
+	if (d->req.nr_host_tx_rings == 0)
+		d->req.nr_host_tx_rings = 1;
+	if (d->req.nr_host_rx_rings == 0)
+		d->req.nr_host_rx_rings = 1;
 
         /* if parent is defined, do nm_mmap() even if NM_OPEN_NO_MMAP is set */
 	if ((!(new_flags & NM_OPEN_NO_MMAP) || parent) && nm_mmap(d, parent)) {
@@ -798,8 +894,15 @@ nm_open(const char *ifname, const struct nmreq *req,
 	nr_reg = d->req.nr_flags & NR_REG_MASK;
 
 	if (nr_reg ==  NR_REG_SW) { /* host stack */
-		d->first_tx_ring = d->last_tx_ring = d->req.nr_tx_rings;
-		d->first_rx_ring = d->last_rx_ring = d->req.nr_rx_rings;
+		d->first_tx_ring = d->req.nr_tx_rings;
+		d->first_rx_ring = d->req.nr_rx_rings;
+		d->last_tx_ring = d->first_tx_ring + d->req.nr_host_tx_rings - 1;
+		d->last_rx_ring = d->first_rx_ring + d->req.nr_host_rx_rings - 1;
+	} else if (nr_reg == NR_REG_ONE_SW) { /* one host ring pair */
+		d->first_tx_ring = d->last_tx_ring = d->req.nr_tx_rings +
+			(d->req.nr_ringid & NETMAP_RING_MASK);
+		d->first_rx_ring = d->last_rx_ring = d->req.nr_rx_rings +
+			(d->req.nr_ringid & NETMAP_RING_MASK);
 	} else if (nr_reg ==  NR_REG_ALL_NIC) { /* only nic */
 		d->first_tx_ring = 0;
 		d->first_rx_ring = 0;
@@ -808,8 +911,8 @@ nm_open(const char *ifname, const struct nmreq *req,
 	} else if (nr_reg ==  NR_REG_NIC_SW) {
 		d->first_tx_ring = 0;
 		d->first_rx_ring = 0;
-		d->last_tx_ring = d->req.nr_tx_rings;
-		d->last_rx_ring = d->req.nr_rx_rings;
+		d->last_tx_ring = d->req.nr_tx_rings + d->req.nr_host_tx_rings - 1;
+		d->last_rx_ring = d->req.nr_rx_rings + d->req.nr_host_rx_rings - 1;
 	} else if (nr_reg == NR_REG_ONE_NIC) {
 		/* XXX check validity */
 		d->first_tx_ring = d->last_tx_ring =
@@ -859,7 +962,13 @@ nm_close(struct nm_desc *d)
 	 */
 	static void *__xxzt[] __attribute__ ((unused))  =
 		{ (void *)nm_open, (void *)nm_inject,
-		  (void *)nm_dispatch, (void *)nm_nextpkt } ;
+		  (void *)nm_dispatch, (void *)nm_nextpkt,
+		  (void *)nm_recv_burst, (void *)nm_recv_burst_hold,
+		  (void *)nm_rx_release, (void *)nm_send_burst,
+		  (void *)nm_tx_reserve, (void *)nm_tx_commit,
+		  (void *)nm_bufs_alloc, (void *)nm_bufs_free,
+		  (void *)nm_bufcache_init, (void *)nm_buf_get,
+		  (void *)nm_buf_put } ;
 
 	if (d == NULL || d->self != d)
 		return EINVAL;
@@ -1016,6 +1125,229 @@ nm_nextpkt(struct nm_desc *d, struct nm_pkthdr *hdr)
 	return NULL; /* nothing found */
 }
 
+/*
+ * fill v[] with up to n packets from the rx rings, prefetching
+ * the buffers. If release is set, head is also advanced.
+ */
+static inline int
+nm_recv_burst_common(struct nm_desc *d, struct nm_bufdesc *v, int n,
+	int release)
+{
+	u_int c, nrings = d->last_rx_ring - d->first_rx_ring + 1;
+	u_int ri = d->cur_rx_ring;
+	int got = 0;
+
+	for (c = 0; c < nrings && got < n; c++) {
+		struct netmap_ring *ring;
+		u_int i, avail;
+
+		ri = d->cur_rx_ring + c;
+		if (ri > d->last_rx_ring)
+			ri -= nrings;
+		ring = NETMAP_RXRING(d->nifp, ri);
+		avail = nm_ring_space(ring);
+		if (avail == 0)
+			continue;
+		if (avail > (u_int)(n - got))
+			avail = n - got;
+		for (i = ring->cur; avail > 0; avail--, got++) {
+			struct netmap_slot *slot = &ring->slot[i];
+
+			v[got].buf = NETMAP_BUF(ring, slot->buf_idx);
+			v[got].len = slot->len;
+			v[got].ring = ri;
+			v[got].flags = slot->flags;
+			v[got].slot = i;
+			__builtin_prefetch(v[got].buf);
+			i = nm_ring_next(ring, i);
+		}
+		ring->cur = i;
+		if (release)
+			ring->head = i;
+	}
+	d->cur_rx_ring = ri;
+	return got;
+}
+
+static int
+nm_recv_burst(struct nm_desc *d, struct nm_bufdesc *v, int n)
+{
+	return nm_recv_burst_common(d, v, n, 1);
+}
+
+static int
+nm_recv_burst_hold(struct nm_desc *d, struct nm_bufdesc *v, int n)
+{
+	return nm_recv_burst_common(d, v, n, 0);
+}
+
+static void
+nm_rx_release(struct nm_desc *d, const struct nm_bufdesc *b)
+{
+	struct netmap_ring *ring = NETMAP_RXRING(d->nifp, b->ring);
+
+	ring->head = nm_ring_next(ring, b->slot);
+}
+
+static int
+nm_send_burst(struct nm_desc *d, const struct nm_bufdesc *v, int n)
+{
+	u_int c, nrings = d->last_tx_ring - d->first_tx_ring + 1;
+	u_int ri = d->cur_tx_ring;
+	int sent = 0;
+
+	for (c = 0; c < nrings && sent < n; c++) {
+		struct netmap_ring *ring;
+		u_int i, space;
+
+		ri = d->cur_tx_ring + c;
+		if (ri > d->last_tx_ring)
+			ri -= nrings;
+		ring = NETMAP_TXRING(d->nifp, ri);
+		space = nm_ring_space(ring);
+		if (space == 0)
+			continue;
+		if (space > (u_int)(n - sent))
+			space = n - sent;
+		for (i = ring->cur; space > 0; space--, sent++) {
+			struct netmap_slot *slot = &ring->slot[i];
+
+			if (likely(sent + 1 < n))
+				__builtin_prefetch(v[sent + 1].buf);
+			slot->len = v[sent].len;
+			slot->flags = 0;
+			nm_pkt_copy(v[sent].buf,
+				NETMAP_BUF(ring, slot->buf_idx), v[sent].len);
+			i = nm_ring_next(ring, i);
+		}
+		ring->head = ring->cur = i;
+	}
+	d->cur_tx_ring = ri;
+	return sent;
+}
+
+static int
+nm_tx_reserve(struct nm_desc *d, struct nm_bufdesc *v, int n)
+{
+	u_int c, nrings = d->last_tx_ring - d->first_tx_ring + 1;
+	int got = 0;
+
+	for (c = 0; c < nrings && got < n; c++) {
+		struct netmap_ring *ring;
+		u_int i, ri, space;
+
+		ri = d->cur_tx_ring + c;
+		if (ri > d->last_tx_ring)
+			ri -= nrings;
+		ring = NETMAP_TXRING(d->nifp, ri);
+		space = nm_ring_space(ring);
+		if (space > (u_int)(n - got))
+			space = n - got;
+		for (i = ring->cur; space > 0; space--, got++) {
+			v[got].buf = NETMAP_BUF(ring, ring->slot[i].buf_idx);
+			v[got].len = ring->nr_buf_size;
+			v[got].ring = ri;
+			v[got].flags = 0;
+			v[got].slot = i;
+			i = nm_ring_next(ring, i);
+		}
+	}
+	return got;
+}
+
+static int
+nm_tx_commit(struct nm_desc *d, const struct nm_bufdesc *v, int n)
+{
+	int i, pkts = 0;
+
+	for (i = 0; i < n; i++) {
+		struct netmap_ring *ring = NETMAP_TXRING(d->nifp, v[i].ring);
+		struct netmap_slot *slot = &ring->slot[v[i].slot];
+
+		slot->len = v[i].len;
+		slot->flags = v[i].flags & NS_MOREFRAG;
+		if (v[i].flags & NS_MOREFRAG)
+			continue;
+		ring->head = ring->cur = nm_ring_next(ring, v[i].slot);
+		d->cur_tx_ring = v[i].ring;
+		pkts++;
+	}
+	return pkts;
+}
+
+static int
+nm_bufs_ctl(struct nm_desc *d, uint16_t cmd, uint32_t n)
+{
+	struct nmreq req = d->req;
+
+	req.nr_cmd = cmd;
+	req.nr_arg3 = n;
+	if (ioctl(d->fd, NIOCREGIF, &req))
+		return -1;
+	return req.nr_arg3;
+}
+
+static int
+nm_bufs_alloc(struct nm_desc *d, uint32_t n)
+{
+	return nm_bufs_ctl(d, NETMAP_EXTRA_ALLOC, n);
+}
+
+static int
+nm_bufs_free(struct nm_desc *d, uint32_t n)
+{
+	return nm_bufs_ctl(d, NETMAP_EXTRA_FREE, n);
+}
+
+static void
+nm_bufcache_init(struct nm_bufcache *c, struct nm_desc *d,
+	uint32_t batch, uint32_t max)
+{
+	uint32_t scan;
+
+	c->d = d;
+	c->batch = batch ? batch : 1;
+	c->max = max > c->batch ? max : c->batch;
+	c->count = 0;
+	for (scan = d->nifp->ni_bufs_head; scan;
+	     scan = *(uint32_t *)NETMAP_BUF(d->some_ring, scan))
+		c->count++;
+}
+
+static uint32_t
+nm_buf_get(struct nm_bufcache *c)
+{
+	struct netmap_if *nifp = c->d->nifp;
+	uint32_t idx;
+
+	if (c->count == 0) {
+		int n = nm_bufs_alloc(c->d, c->batch);
+
+		if (n <= 0)
+			return 0;
+		c->count = n;
+	}
+	idx = nifp->ni_bufs_head;
+	nifp->ni_bufs_head = *(uint32_t *)NETMAP_BUF(c->d->some_ring, idx);
+	c->count--;
+	return idx;
+}
+
+static void
+nm_buf_put(struct nm_bufcache *c, uint32_t idx)
+{
+	struct netmap_if *nifp = c->d->nifp;
+	int n;
+
+	*(uint32_t *)NETMAP_BUF(c->d->some_ring, idx) = nifp->ni_bufs_head;
+	nifp->ni_bufs_head = idx;
+	if (++c->count > c->max) {
+		n = nm_bufs_free(c->d, c->batch);
+		if (n > 0)
+			c->count -= n;
+	}
+}
+
 #endif /* !HAVE_NETMAP_WITH_LIBS */
 
 #endif /* NETMAP_WITH_LIBS */